@@ -0,0 +1,83 @@
+#include "ft_ping.h"
+
+/**
+ * @brief The number of bytes summed per implementation and payload size.
+ */
+#define BENCH_BYTES (1ULL << 30)
+
+/**
+ * Checks that every implementation returns the same checksum as the scalar
+ * one, for all lengths up to max and for every alignment of the data.
+ *
+ * @param buf Random data, at least max + 8 bytes long.
+ * @param max The largest length to check.
+ * @return 0 if all implementations agree, 1 otherwise.
+ */
+static int check_impls(uint8_t *buf, int max)
+{
+    for (const t_cksum_impl *impl = cksum_impls + 1; impl->name; impl++)
+    {
+        if (!impl->supported())
+            continue;
+        for (int offset = 0; offset < 8; offset++)
+            for (int len = 0; len <= max; len++)
+            {
+                uint16_t expected = cksum_scalar((uint16_t *)(buf + offset), len);
+                uint16_t got = impl->fn((uint16_t *)(buf + offset), len);
+
+                if (got != expected)
+                {
+                    printf("%s: offset %d, length %d: 0x%04x instead of 0x%04x\n",
+                           impl->name, offset, len, got, expected);
+                    return 1;
+                }
+            }
+    }
+    return 0;
+}
+
+static double bench_impl(const t_cksum_impl *impl, uint8_t *buf, int len)
+{
+    volatile uint16_t sink = 0;
+    uint64_t rounds = BENCH_BYTES / len + 1;
+    uint64_t start = now_ns();
+
+    for (uint64_t i = 0; i < rounds; i++)
+        sink += impl->fn((uint16_t *)buf, len);
+    (void)sink;
+
+    return (double)rounds * len / (now_ns() - start);
+}
+
+int main(void)
+{
+    static uint8_t buf[PING_MAX_DATALEN + sizeof(struct icmphdr) + 8];
+    int sizes[] = {56, 64, 128, 256, 512, 1024, 1472, 4096, 9000, 16384, 32768, PING_MAX_DATALEN};
+
+    srand(42);
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = rand();
+
+    if (check_impls(buf, 4096) || check_impls(buf, 0) ||
+        cksum_impls[1].fn((uint16_t *)buf, PING_MAX_DATALEN) != cksum_scalar((uint16_t *)buf, PING_MAX_DATALEN))
+        return 1;
+    printf("all implementations agree on lengths 0 to 4096 and %d\n\n", PING_MAX_DATALEN);
+
+    printf("%8s", "bytes");
+    for (const t_cksum_impl *impl = cksum_impls; impl->name; impl++)
+        if (impl->supported())
+            printf(" %10s", impl->name);
+    printf("   (GB/s)\n");
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(*sizes); i++)
+    {
+        int len = sizes[i] + sizeof(struct icmphdr);
+
+        printf("%8d", len);
+        for (const t_cksum_impl *impl = cksum_impls; impl->name; impl++)
+            if (impl->supported())
+                printf(" %10.2f", bench_impl(impl, buf, len));
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,125 @@
+#!/bin/bash
+#
+# Measures ft_ping at increasing probe rates against a loopback target.
+#
+# For each rate, ft_ping runs for DURATION seconds twice: once timing round
+# trips in userspace as usual, once with kernel timestamps (-k). The kernel
+# round trip is what the network stack and the peer take, the difference of
+# the medians is what the tool itself adds, from stamping a packet to
+# reading the reply. CPU per packet is the user and system time of the run
+# divided by the packets sent and received.
+#
+# Usage: bench/bench_ping.sh [target]
+#
+#   target     Address to ping, 127.0.0.1 by default.
+#   VETH=1     Ping through a veth pair to another network namespace
+#              instead, which takes the path of a real interface (root).
+#   PONG=1     Ping a host behind the ft_pong responder instead (make pong,
+#              root), PONG_ARGS being its options, e.g. "-d 1 -j 1 -l 1".
+#   RATES      Probes per second to try, 0 meaning flood.
+#   DURATION   Seconds per run.
+#   ARGS       Extra ft_ping arguments, e.g. "-T 2" or "-E io_uring".
+#
+# The results are printed as a table with one row per rate, to be kept and
+# compared across versions.
+
+set -u
+
+cd "$(dirname "$0")/.."
+
+PING=./ft_ping
+RESPONDER=./ft_pong
+TARGET=${1:-127.0.0.1}
+RATES=${RATES:-"10 100 1000 10000 100000 0"}
+DURATION=${DURATION:-5}
+ARGS=${ARGS:-}
+NETNS=ft_ping_bench
+
+export LD_LIBRARY_PATH=./libft${LD_LIBRARY_PATH:+:$LD_LIBRARY_PATH}
+
+if [ ! -x "$PING" ]; then
+    echo "$0: build ft_ping first" >&2
+    exit 1
+fi
+
+cleanup() {
+    if [ "${VETH:-0}" = 1 ]; then
+        ip link del ft_ping0 2>/dev/null
+        ip netns del "$NETNS" 2>/dev/null
+    fi
+    if [ -n "${PONG_PID:-}" ]; then
+        kill -INT "$PONG_PID" 2>/dev/null
+        wait "$PONG_PID" 2>/dev/null
+    fi
+}
+
+if [ "${VETH:-0}" = 1 ]; then
+    trap cleanup EXIT
+    cleanup
+    ip netns add "$NETNS" &&
+        ip link add ft_ping0 type veth peer name ft_ping1 &&
+        ip link set ft_ping1 netns "$NETNS" &&
+        ip addr add 10.250.0.1/30 dev ft_ping0 &&
+        ip link set ft_ping0 up &&
+        ip -n "$NETNS" addr add 10.250.0.2/30 dev ft_ping1 &&
+        ip -n "$NETNS" link set ft_ping1 up &&
+        ip -n "$NETNS" link set lo up || {
+        echo "$0: could not set up the veth pair, are you root?" >&2
+        exit 1
+    }
+    TARGET=10.250.0.2
+fi
+
+if [ "${PONG:-0}" = 1 ]; then
+    trap cleanup EXIT
+    if [ ! -x "$RESPONDER" ]; then
+        echo "$0: build ft_pong first (make pong)" >&2
+        exit 1
+    fi
+    $RESPONDER ${PONG_ARGS:-} >/dev/null &
+    PONG_PID=$!
+    sleep 0.5
+    kill -0 "$PONG_PID" 2>/dev/null || {
+        echo "$0: could not start ft_pong, are you root?" >&2
+        exit 1
+    }
+    TARGET=10.251.0.2
+fi
+
+# Runs ft_ping for DURATION seconds and prints:
+# sent received p50 p99 user+system seconds
+run() {
+    local out cpu
+
+    out=$( { TIMEFORMAT='%U %S'; time timeout -s INT "$DURATION" $PING -q $ARGS "$@" "$TARGET" 2>&1; } 2>&1)
+    cpu=$(echo "$out" | tail -n 1 | awk '{ print $1 + $2 }')
+    echo "$out" | awk -v cpu="$cpu" '
+        /packets transmitted/ { sent = $1; received = $4 }
+        /p50\/p90\/p99/ { split($NF == "ms" ? $(NF - 1) : $NF, q, "/"); p50 = q[1]; p99 = q[3] }
+        END { printf "%d %d %s %s %s\n", sent, received, p50 == "" ? 0 : p50, p99 == "" ? 0 : p99, cpu }'
+}
+
+echo "target $TARGET, $DURATION s per run${ARGS:+, ft_ping $ARGS}${PONG_PID:+, ft_pong ${PONG_ARGS:-}}, $(nproc) cpus, $(uname -r)"
+printf "%8s %10s %10s %7s %10s %10s %10s %10s %10s\n" \
+    "rate" "sent/s" "recv/s" "loss%" "cpu ns/pkt" "rtt p50" "rtt p99" "kernel p50" "overhead"
+
+for rate in $RATES; do
+    if [ "$rate" = 0 ]; then
+        opts="-f"
+        label=flood
+    else
+        opts="-i $(awk -v r="$rate" 'BEGIN { printf "%.9f", 1 / r }')"
+        label=$rate
+    fi
+
+    read -r sent received p50 p99 cpu <<<"$(run $opts)"
+    read -r _ _ kp50 _ _ <<<"$(run $opts -k)"
+
+    awk -v label="$label" -v d="$DURATION" -v s="$sent" -v r="$received" -v cpu="$cpu" \
+        -v p50="$p50" -v p99="$p99" -v kp50="$kp50" 'BEGIN {
+        printf "%8s %10.0f %10.0f %7.2f %10.0f %10.3f %10.3f %10.3f %10.3f\n",
+            label, s / d, r / d, s ? (s - r) * 100 / s : 0,
+            s + r ? cpu * 1e9 / (s + r) : 0, p50, p99, kp50, p50 - kp50
+    }'
+done
+echo "rtt in ms, overhead is the userspace p50 minus the kernel timestamped one"
@@ -0,0 +1,544 @@
+#include "ft_ping.h"
+
+#include <linux/if.h>
+#include <linux/if_tun.h>
+#include <sys/ioctl.h>
+
+/*
+ * An ICMP echo responder on a TUN device, to load test ft_ping without a
+ * network and without the ideal replies of the loopback interface.
+ *
+ * The device gets an address and a subnet. The kernel routes the packets
+ * sent to the other hosts of the subnet to the device, where every echo
+ * request is answered after a configurable delay, or lost, duplicated,
+ * reordered, or turned into a destination unreachable or time exceeded
+ * error from a router of the subnet. Requests larger than a given MTU get
+ * a fragmentation needed error, as from a narrower link further down the
+ * path. Checksums are computed with the same code as ft_ping's.
+ */
+
+static t_argo pong_options[] = {
+    {'a', "address", "address/prefix", "address of the device, the rest of the subnet answers (10.251.0.1/24)", ONE_ARG},
+    {'d', "delay", "ms", "delay the replies by <ms> milliseconds", ONE_ARG},
+    {'D', "distribution", "name", "distribution of the jitter: uniform (default), normal or pareto", ONE_ARG},
+    {'g', "gap", "ms", "extra delay of the reordered replies (1 ms)", ONE_ARG},
+    {'i', "interface", "name", "name of the TUN device (ftpong0)", ONE_ARG},
+    {'j', "jitter", "ms", "add up to <ms> milliseconds of jitter to the delay", ONE_ARG},
+    {'l', "loss", "percent", "drop <percent> of the requests", ONE_ARG},
+    {'m', "mtu", "mtu", "answer requests larger than <mtu> bytes with fragmentation needed", ONE_ARG},
+    {'r', "reorder", "percent", "hold <percent> of the replies back by the gap", ONE_ARG},
+    {'S', "seed", "seed", "seed of the random generator, for reproducible runs", ONE_ARG},
+    {'t', "ttl", "ttl", "time to live of the replies (64)", ONE_ARG},
+    {'u', "duplicate", "percent", "answer <percent> of the requests twice", ONE_ARG},
+    {'U', "unreachable", "percent", "answer <percent> of the requests with a host unreachable error", ONE_ARG},
+    {'x', "ttl-exceeded", "percent", "answer <percent> of the requests with a time exceeded error", ONE_ARG},
+    {'?', "help", "help", "print help and exit", NO_ARG},
+    {0, NULL, NULL, NULL, NO_ARG}};
+
+static t_argp pong_argp = {
+    .options = pong_options,
+    .args_doc = "[options]",
+    .doc = ""};
+
+/**
+ * @brief The most packets waiting for their delay to elapse, the others are dropped.
+ */
+#define PONG_QUEUE_MAX 65536
+
+/**
+ * @brief Jitter distributions.
+ */
+#define PONG_UNIFORM 0
+#define PONG_NORMAL 1
+#define PONG_PARETO 2
+
+/**
+ * @brief A packet to write to the device at a given date.
+ */
+typedef struct s_pong_packet
+{
+    uint64_t due; /* Monotonic date in nanoseconds */
+    size_t len;
+    char *data;
+} t_pong_packet;
+
+typedef struct s_pong
+{
+    const char *ifname;
+    struct in_addr addr;   /* Address of the device */
+    struct in_addr router; /* Source of the errors, the last host of the subnet */
+    uint32_t mask;
+    double delay;          /* In nanoseconds, as the jitter and the gap */
+    double jitter;
+    double gap;
+    int distribution;
+    double loss;           /* Probabilities, between 0 and 1 */
+    double duplicate;
+    double reorder;
+    double unreachable;
+    double exceeded;
+    int ttl;
+    uint32_t mtu;          /* MTU of a link further down, 0 for none */
+    uint64_t rng;
+    int fd;
+    t_pong_packet *queue;  /* Min-heap on the due date */
+    size_t queued;
+    size_t num_requests;
+    size_t num_replies;
+    size_t num_lost;
+    size_t num_dup;
+    size_t num_reorder;
+    size_t num_errors;
+    size_t num_overflow;
+} t_pong;
+
+static volatile sig_atomic_t g_stop = 0;
+
+static void pong_sig_handler(__attribute__((__unused__)) int signo)
+{
+    g_stop = 1;
+}
+
+/**
+ * Draws a random number uniformly from [0, 1), with xorshift64*.
+ */
+static double pong_random(t_pong *pong)
+{
+    pong->rng ^= pong->rng >> 12;
+    pong->rng ^= pong->rng << 25;
+    pong->rng ^= pong->rng >> 27;
+    return ((pong->rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/**
+ * Draws the delay of a reply from the configured distribution.
+ *
+ * The jitter is the half-width of a uniform distribution around the delay,
+ * the standard deviation of a normal one, or the scale of a Pareto tail
+ * (shape 1.5) added to the delay, which models rare but large spikes.
+ */
+static uint64_t pong_delay(t_pong *pong)
+{
+    double delay = pong->delay;
+
+    if (pong->jitter > 0)
+    {
+        double u = pong_random(pong);
+
+        if (pong->distribution == PONG_NORMAL)
+            delay += pong->jitter * sqrt(-2 * log(1 - u)) * cos(2 * M_PI * pong_random(pong));
+        else if (pong->distribution == PONG_PARETO)
+            delay += pong->jitter * (pow(1 - u, -1 / 1.5) - 1);
+        else
+            delay += pong->jitter * (2 * u - 1);
+    }
+    return delay > 0 ? (uint64_t)delay : 0;
+}
+
+static void heap_swap(t_pong_packet *a, t_pong_packet *b)
+{
+    t_pong_packet tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+/**
+ * Queues a packet to be written at a date, or drops it if the queue is full.
+ */
+static void pong_queue(t_pong *pong, const char *data, size_t len, uint64_t due)
+{
+    size_t i = pong->queued;
+
+    if (i == PONG_QUEUE_MAX || !(pong->queue[i].data = malloc(len)))
+    {
+        pong->num_overflow++;
+        return;
+    }
+    memcpy(pong->queue[i].data, data, len);
+    pong->queue[i].len = len;
+    pong->queue[i].due = due;
+    pong->queued++;
+
+    for (; i && pong->queue[(i - 1) / 2].due > pong->queue[i].due; i = (i - 1) / 2)
+        heap_swap(&pong->queue[i], &pong->queue[(i - 1) / 2]);
+}
+
+/**
+ * Writes the packets whose date has come, earliest first.
+ *
+ * @return The date of the next packet, or 0 if the queue is empty.
+ */
+static uint64_t pong_flush(t_pong *pong)
+{
+    uint64_t now = now_ns();
+
+    while (pong->queued && pong->queue[0].due <= now)
+    {
+        t_pong_packet *top = &pong->queue[0];
+
+        if (write(pong->fd, top->data, top->len) < 0 && errno != ENOBUFS)
+            perror("write");
+        free(top->data);
+
+        *top = pong->queue[--pong->queued];
+        for (size_t i = 0, child; (child = 2 * i + 1) < pong->queued; i = child)
+        {
+            if (child + 1 < pong->queued && pong->queue[child + 1].due < pong->queue[child].due)
+                child++;
+            if (pong->queue[i].due <= pong->queue[child].due)
+                break;
+            heap_swap(&pong->queue[i], &pong->queue[child]);
+        }
+    }
+    return pong->queued ? pong->queue[0].due : 0;
+}
+
+/**
+ * Fills in and checksums an IPv4 header of 20 bytes.
+ */
+static void pong_ip_header(struct ip *ip, struct in_addr src, struct in_addr dst, size_t len, int ttl)
+{
+    memset(ip, 0, sizeof(*ip));
+    ip->ip_v = 4;
+    ip->ip_hl = sizeof(*ip) >> 2;
+    ip->ip_len = htons(len);
+    ip->ip_ttl = ttl;
+    ip->ip_p = IPPROTO_ICMP;
+    ip->ip_src = src;
+    ip->ip_dst = dst;
+    ip->ip_sum = icmp_cksum((uint16_t *)ip, sizeof(*ip));
+}
+
+/**
+ * Builds the ICMP error a router would send about a request.
+ *
+ * The error quotes the IP header of the request and the first 8 bytes of
+ * its ICMP message, the echo header with its identifier and sequence.
+ *
+ * @param mtu The MTU of the next hop, for fragmentation needed errors.
+ * @return The size of the error.
+ */
+static size_t pong_error(t_pong *pong, char *out, const char *request, uint8_t type, uint8_t code, uint16_t mtu)
+{
+    const struct ip *req = (const struct ip *)request;
+    size_t quoted = (req->ip_hl << 2) + ICMP_MINLEN;
+    size_t len = sizeof(struct ip) + ICMP_MINLEN + quoted;
+    struct icmphdr *icp = (struct icmphdr *)(out + sizeof(struct ip));
+
+    pong_ip_header((struct ip *)out, pong->router, req->ip_src, len, pong->ttl);
+    memset(icp, 0, ICMP_MINLEN);
+    icp->type = type;
+    icp->code = code;
+    icp->un.frag.mtu = htons(mtu);
+    memcpy(icp + 1, request, quoted);
+    icp->checksum = icmp_cksum((uint16_t *)icp, ICMP_MINLEN + quoted);
+    return len;
+}
+
+/**
+ * Answers an echo request read from the device, in the way configured.
+ *
+ * The reply reuses the request: addresses are swapped, the type changed and
+ * the ICMP checksum updated incrementally, like ft_ping stamps its probes.
+ */
+static void pong_answer(t_pong *pong, char *packet, size_t len)
+{
+    struct ip *ip = (struct ip *)packet;
+    size_t hlen = ip->ip_hl << 2;
+    struct icmphdr *icp = (struct icmphdr *)(packet + hlen);
+    char error[sizeof(struct ip) + ICMP_MINLEN + MAXIPLEN + ICMP_MINLEN];
+    uint64_t now = now_ns();
+
+    if (len < hlen + ICMP_MINLEN || ip->ip_v != 4 || ip->ip_p != IPPROTO_ICMP ||
+        icp->type != ICMP_ECHO || (ntohs(ip->ip_off) & 0x3fff))
+        return;
+    pong->num_requests++;
+
+    /* Packets that may not be fragmented do not fit the narrower link */
+    if (pong->mtu && len > pong->mtu && (ntohs(ip->ip_off) & IP_DF))
+    {
+        pong->num_errors++;
+        pong_queue(pong, error, pong_error(pong, error, packet, ICMP_DEST_UNREACH, ICMP_FRAG_NEEDED, pong->mtu),
+                   now + pong_delay(pong));
+        return;
+    }
+    if (pong_random(pong) < pong->loss)
+    {
+        pong->num_lost++;
+        return;
+    }
+    if (pong_random(pong) < pong->unreachable)
+    {
+        pong->num_errors++;
+        pong_queue(pong, error, pong_error(pong, error, packet, ICMP_DEST_UNREACH, ICMP_HOST_UNREACH, 0), now + pong_delay(pong));
+        return;
+    }
+    if (pong_random(pong) < pong->exceeded)
+    {
+        pong->num_errors++;
+        pong_queue(pong, error, pong_error(pong, error, packet, ICMP_TIME_EXCEEDED, ICMP_EXC_TTL, 0), now + pong_delay(pong));
+        return;
+    }
+
+    uint16_t old = *(uint16_t *)icp;
+    struct in_addr src = ip->ip_src;
+
+    icp->type = ICMP_ECHOREPLY;
+    icp->checksum = cksum_update(icp->checksum, &old, (uint16_t *)icp, 1);
+    pong_ip_header(ip, ip->ip_dst, src, len, pong->ttl);
+    if (hlen > sizeof(struct ip))
+    {
+        /* Options are not echoed back */
+        memmove(packet + sizeof(struct ip), icp, len - hlen);
+        len -= hlen - sizeof(struct ip);
+        pong_ip_header(ip, ip->ip_src, src, len, pong->ttl);
+    }
+
+    uint64_t due = now + pong_delay(pong);
+    if (pong_random(pong) < pong->reorder)
+    {
+        pong->num_reorder++;
+        due += pong->gap;
+    }
+    pong_queue(pong, packet, len, due);
+    pong->num_replies++;
+    if (pong_random(pong) < pong->duplicate)
+    {
+        pong->num_dup++;
+        pong_queue(pong, packet, len, now + pong_delay(pong));
+    }
+}
+
+/**
+ * Creates the TUN device, gives it its address and brings it up.
+ *
+ * @return Returns 0 on success, or 1 on failure.
+ */
+static int pong_open(t_pong *pong, const char *progname)
+{
+    struct ifreq ifr;
+    struct sockaddr_in *sin = (struct sockaddr_in *)&ifr.ifr_addr;
+    int sock;
+
+    pong->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (pong->fd < 0)
+    {
+        printf("%s: /dev/net/tun: %s\n", progname, strerror(errno));
+        return 1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+    ft_strlcpy(ifr.ifr_name, pong->ifname, IFNAMSIZ);
+    if (ioctl(pong->fd, TUNSETIFF, &ifr) < 0)
+    {
+        printf("%s: %s: %s\n", progname, pong->ifname, strerror(errno));
+        return 1;
+    }
+
+    sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+    {
+        perror("socket");
+        return 1;
+    }
+    sin->sin_family = AF_INET;
+    sin->sin_addr = pong->addr;
+    if (ioctl(sock, SIOCSIFADDR, &ifr) < 0)
+        goto fail;
+    sin->sin_addr.s_addr = htonl(pong->mask);
+    if (ioctl(sock, SIOCSIFNETMASK, &ifr) < 0)
+        goto fail;
+    /* The default queue of 500 packets overflows at high rates */
+    ifr.ifr_qlen = 10000;
+    if (ioctl(sock, SIOCSIFTXQLEN, &ifr) < 0)
+        goto fail;
+    if (ioctl(sock, SIOCGIFFLAGS, &ifr) < 0)
+        goto fail;
+    ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+    if (ioctl(sock, SIOCSIFFLAGS, &ifr) < 0)
+        goto fail;
+    close(sock);
+
+    return 0;
+
+fail:
+    printf("%s: %s: %s\n", progname, pong->ifname, strerror(errno));
+    close(sock);
+    return 1;
+}
+
+static int parse_number(const char *value, double min, double max, double *out, const char *progname)
+{
+    char *p;
+    double number = strtod(value, &p);
+
+    if (*p || p == value || number < min || number > max)
+    {
+        printf("%s: invalid argument: '%s': out of range: %g <= value <= %g\n", progname, value, min, max);
+        return 1;
+    }
+    *out = number;
+    return 0;
+}
+
+static int parse_address(t_pong *pong, const char *value, const char *progname)
+{
+    char addr[INET_ADDRSTRLEN];
+    const char *slash = strchr(value, '/');
+    char *p;
+    long prefix = 24;
+
+    ft_strlcpy(addr, value, slash && (size_t)(slash - value) < sizeof(addr) ? (size_t)(slash - value + 1) : sizeof(addr));
+    if (slash)
+        prefix = strtol(slash + 1, &p, 10);
+    if (inet_pton(AF_INET, addr, &pong->addr) != 1 || (slash && *p) || prefix < 8 || prefix > 30)
+    {
+        printf("%s: invalid address: '%s'\n", progname, value);
+        return 1;
+    }
+    pong->mask = ~0U << (32 - prefix);
+    pong->router.s_addr = htonl((ntohl(pong->addr.s_addr) & pong->mask) | (~pong->mask - 1));
+    return 0;
+}
+
+static int parse_pong_options(t_pong *pong, const char *argv[])
+{
+    t_args *args;
+    t_argr *argr;
+    double value;
+    int error = 0;
+
+    if (parse_args(&pong_argp, argv, &args))
+        return 1;
+    while (!error && (argr = get_next_option(args)))
+    {
+        const char *arg = argr->option->argnum == ONE_ARG ? argr->values[0] : NULL;
+
+        switch (argr->option->sflag)
+        {
+        case '?':
+            help_args(&pong_argp, argv[0]);
+            error = 1;
+            break;
+        case 'a':
+            error = parse_address(pong, arg, argv[0]);
+            break;
+        case 'i':
+            pong->ifname = arg;
+            break;
+        case 'D':
+            if (!strcmp(arg, "uniform"))
+                pong->distribution = PONG_UNIFORM;
+            else if (!strcmp(arg, "normal"))
+                pong->distribution = PONG_NORMAL;
+            else if (!strcmp(arg, "pareto"))
+                pong->distribution = PONG_PARETO;
+            else
+            {
+                printf("%s: invalid distribution: '%s'\n", argv[0], arg);
+                error = 1;
+            }
+            break;
+        case 'd':
+        case 'j':
+        case 'g':
+            error = parse_number(arg, 0, 3600000, &value, argv[0]);
+            value *= 1000000;
+            if (argr->option->sflag == 'd')
+                pong->delay = value;
+            else if (argr->option->sflag == 'j')
+                pong->jitter = value;
+            else
+                pong->gap = value;
+            break;
+        case 't':
+            error = parse_number(arg, 1, 255, &value, argv[0]);
+            pong->ttl = value;
+            break;
+        case 'm':
+            error = parse_number(arg, PING_PMTU_MIN, 65535, &value, argv[0]);
+            pong->mtu = value;
+            break;
+        case 'S':
+            error = parse_number(arg, 1, 1e18, &value, argv[0]);
+            pong->rng = value;
+            break;
+        default:
+            error = parse_number(arg, 0, 100, &value, argv[0]);
+            value /= 100;
+            if (argr->option->sflag == 'l')
+                pong->loss = value;
+            else if (argr->option->sflag == 'u')
+                pong->duplicate = value;
+            else if (argr->option->sflag == 'r')
+                pong->reorder = value;
+            else if (argr->option->sflag == 'U')
+                pong->unreachable = value;
+            else
+                pong->exceeded = value;
+            break;
+        }
+    }
+    free_args(args);
+    return error;
+}
+
+int main(__attribute__((__unused__)) int argc, const char *argv[])
+{
+    t_pong pong;
+    char packet[IP_MAXPACKET];
+    char addr[INET_ADDRSTRLEN], router[INET_ADDRSTRLEN];
+
+    memset(&pong, 0, sizeof(pong));
+    pong.ifname = "ftpong0";
+    pong.ttl = PING_DEFAULT_TTL;
+    pong.gap = 1000000;
+    pong.rng = now_ns() | 1;
+    parse_address(&pong, "10.251.0.1/24", argv[0]);
+    if (parse_pong_options(&pong, argv))
+        return 1;
+
+    pong.queue = malloc(PONG_QUEUE_MAX * sizeof(t_pong_packet));
+    if (!pong.queue)
+    {
+        perror("malloc");
+        return 1;
+    }
+    if (pong_open(&pong, argv[0]))
+        return 1;
+
+    signal(SIGINT, pong_sig_handler);
+    signal(SIGTERM, pong_sig_handler);
+    inet_ntop(AF_INET, &pong.addr, addr, sizeof(addr));
+    inet_ntop(AF_INET, &pong.router, router, sizeof(router));
+    printf("%s: answering on %s for the hosts of %s/%d, errors from %s\n", argv[0], pong.ifname,
+           addr, 32 - __builtin_ctz(pong.mask), router);
+    fflush(stdout);
+
+    while (!g_stop)
+    {
+        uint64_t next = pong_flush(&pong);
+        struct pollfd pfd = {.fd = pong.fd, .events = POLLIN};
+        struct timespec timeout;
+
+        calculate_timeout(&timeout, next, 0);
+        if (ppoll(&pfd, 1, next ? &timeout : NULL, NULL) <= 0)
+            continue;
+
+        ssize_t len;
+        while ((len = read(pong.fd, packet, sizeof(packet))) > 0)
+            pong_answer(&pong, packet, len);
+    }
+
+    printf("%zu requests, %zu replies, %zu lost, %zu duplicated, %zu reordered, %zu errors, %zu over the queue\n",
+           pong.num_requests, pong.num_replies, pong.num_lost, pong.num_dup, pong.num_reorder,
+           pong.num_errors, pong.num_overflow);
+
+    while (pong.queued)
+        free(pong.queue[--pong.queued].data);
+    free(pong.queue);
+    close(pong.fd);
+    return 0;
+}
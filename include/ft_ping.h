@@ -1,6 +1,10 @@
 #ifndef PING_H
 #define PING_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
 #include <stdbool.h>
 #include <sys/types.h>
@@ -12,6 +16,20 @@
 #include <math.h>
 
 #include <sys/time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/prctl.h>
+#include <sys/eventfd.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 #include <netdb.h>
 #include <sys/socket.h>
@@ -20,24 +38,53 @@
 #include <netinet/ip.h>
 #include <netinet/ip_icmp.h>
 #include <netinet/in_systm.h>
+#include <netinet/icmp6.h>
+#include <netinet/ip6.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/filter.h>
+#include <linux/io_uring.h>
+#include <stddef.h>
 
 #include "libft.h"
 #include "argparse.h"
 
 static t_argo options[] = {
+    {'4', "ipv4", "ipv4", "resolve hostnames to IPv4 addresses only", NO_ARG},
+    {'6', "ipv6", "ipv6", "resolve hostnames to IPv6 addresses only", NO_ARG},
+    {'A', "adaptive", "adaptive", "send the next packet as soon as a reply arrives", NO_ARG},
+    {'b', "busy-poll", "busy poll", "spin on the socket instead of sleeping between packets", NO_ARG},
     {'c', "count", "count", "stop after <count> replies", ONE_ARG},
+    {'C', "capture", "file", "write every packet sent and received to <file> in pcap format", ONE_ARG},
+    {'E', "event-loop", "backend", "wait for events with <backend>: epoll (default), io_uring or select", ONE_ARG},
+    {'f', "flood", "flood", "flood ping, send packets as fast as possible", NO_ARG},
+    {'F', "file", "file", "read the targets from <file>, one host per line with an optional interval and timeout, '-' for stdin", ONE_ARG},
+    {'H', "hops", "hops", "probe every hop to each target at once, like mtr, up to -t hops", NO_ARG},
+    {'k', "kernel-timestamps", "kernel timestamps", "time packets with kernel or hardware timestamps", NO_ARG},
+    {'I', "summary-interval", "interval", "print a summary of the last <interval> every <interval>, e.g. 10s", ONE_ARG},
     {'i', "interval", "interval", "wait <number> seconds between sending each packet", ONE_ARG},
+    {'j', "jitter", "fraction", "delay each packet by up to <fraction> of the interval, 0.1 with several targets", ONE_ARG},
+    {'M', "metrics", "address", "serve Prometheus metrics on [host:]port, or on a Unix socket path", ONE_ARG},
     {'n', "numeric", "numeric", "do not resolve host addresses.\n\t\t\t Here for swag purposes", NO_ARG},
+    {'P', "pmtu", "pmtu", "find the path MTU of each target, probing sizes up to -s data bytes", NO_ARG},
+    {'o', "output", "format", "print replies as <format>: text (default), json or binary records", ONE_ARG},
+    {'O', "output-file", "file", "write the json or binary records to <file> instead of stdout", ONE_ARG},
     {'q', "quiet", "quiet", "quiet output", NO_ARG},
+    {'R', "replay", "file", "analyse the packets of a pcap <file> instead of pinging", ONE_ARG},
+    {'r', "rate", "rate", "send at most <rate> packets per second to all the targets together", ONE_ARG},
     {'s', "size", "data size", "use <size> as number of data bytes to be sent", ONE_ARG},
+    {'T', "threads", "threads", "receive on <threads> dedicated threads, send on another one", ONE_ARG},
+    {'a', "affinity", "cpu list", "pin the sender then the receivers to these comma separated CPUs", ONE_ARG},
     {'t', "ttl", "time to live", "define time to live", ONE_ARG},
     {'v', "verbose", "verbose", "verbose output", NO_ARG},
+    {'W', "timeout", "timeout", "count a packet as lost after <timeout> seconds without a reply, 1 by default", ONE_ARG},
+    {'w', "deadline", "deadline", "stop after <deadline> seconds, whatever was sent or received", ONE_ARG},
     {'?', "help", "help", "print help and exit", NO_ARG},
     {0, NULL, NULL, NULL, NO_ARG}};
 
 static t_argp argp __attribute__((unused)) = {
     .options = options,
-    .args_doc = "[options] <destination>",
+    .args_doc = "[options] <destination> [destination...]",
     .doc = ""};
 
 #define MAXIPLEN 60
@@ -54,7 +101,17 @@ static t_argp argp __attribute__((unused)) = {
 #define PING_DEFAULT_INTERVAL 1000000
 
 /**
- * @brief The timeout delay for receiving packets in seconds.
+ * @brief The shortest interval in microseconds, and no flood, without a raw socket or root.
+ */
+#define PING_MIN_USER_INTERVAL 200000
+
+/**
+ * @brief The longest interval, timeout or deadline in seconds.
+ */
+#define PING_MAX_SECONDS 86400
+
+/**
+ * @brief The time a packet waits for its reply without -W, in seconds.
  */
 #define PING_DEFAULT_RECV_TIMEOUT 1
 
@@ -73,6 +130,150 @@ static t_argp argp __attribute__((unused)) = {
  */
 #define PING_DEFAULT_TTL 64
 
+/**
+ * @brief The number of distinct ICMP sequence numbers on the wire.
+ */
+#define PING_SEQ_SPACE 65536
+
+/**
+ * @brief Below this interval in nanoseconds, the timer slack is reduced to keep sleeps precise.
+ */
+#define PING_PRECISE_INTERVAL 1000000
+
+/**
+ * @brief The maximum number of packets sent or received per syscall.
+ */
+#define PING_BATCH 32
+
+/**
+ * @brief The maximum number of hosts resolved concurrently.
+ */
+#define PING_RESOLVERS 16
+
+/**
+ * @brief How long resolved and unknown hosts stay in the resolver cache, in seconds.
+ *
+ * Targets given by name are looked up again once their entry expires.
+ */
+#define PING_DNS_TTL 300
+#define PING_DNS_NEG_TTL 30
+
+/**
+ * @brief The size of the ancillary data buffer of each received packet.
+ */
+#define PING_CMSG_SIZE 256
+
+/**
+ * @brief The timestamps requested from the kernel with -k.
+ */
+#define PING_TIMESTAMPING (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | \
+                           SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE | \
+                           SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_RAW_HARDWARE)
+
+/**
+ * @brief The number of buffers of the receive ring, two batches.
+ */
+#define PING_RX_SLOTS (2 * PING_BATCH)
+
+/**
+ * @brief Room left for the link-layer header of looped back transmit timestamps.
+ */
+#define PING_LINK_HDR_MAX 64
+
+/**
+ * @brief The minimum size of a receive buffer, enough for any ICMP error (RFC 1812).
+ */
+#define PING_RX_MIN_LEN 576
+
+/**
+ * @brief The maximum number of receiver threads.
+ */
+#define PING_MAX_THREADS 64
+
+/**
+ * @brief How long a receiver thread waits for packets before checking whether to stop, in milliseconds.
+ */
+#define PING_RX_POLL_MS 100
+
+/**
+ * @brief The smallest MTU of an IPv4 (RFC 791) and of an IPv6 (RFC 8200) path.
+ */
+#define PING_PMTU_MIN 68
+#define PING_PMTU_MIN6 1280
+
+/**
+ * @brief Probes of a size lost before the search gives up on it.
+ */
+#define PING_PMTU_TRIES 3
+
+/**
+ * @brief The receive buffer asked for by the modes that have many probes in flight at once, in bytes.
+ */
+#define PING_RCVBUF (8 << 20)
+
+/**
+ * @brief The number of hops probed by the TTL sweep without -t.
+ */
+#define PING_TRACE_MAX_TTL 30
+
+/**
+ * @brief The timer wheel counts in ticks of 2^PING_WHEEL_TICK_SHIFT nanoseconds, about a microsecond.
+ */
+#define PING_WHEEL_TICK_SHIFT 10
+
+/**
+ * @brief Each level of the timer wheel has 2^PING_WHEEL_BITS slots, one bit of a 64-bit mask each.
+ */
+#define PING_WHEEL_BITS 6
+#define PING_WHEEL_SLOTS (1 << PING_WHEEL_BITS)
+
+/**
+ * @brief Levels of the timer wheel, which span 2^36 ticks (about 19 hours) before timers wait in a list.
+ */
+#define PING_WHEEL_LEVELS 6
+
+/**
+ * @brief The fraction of the interval probes are delayed by at most with several targets and no -j.
+ */
+#define PING_DEFAULT_JITTER 0.1
+
+/**
+ * @brief Stages of the hot path timed in builds with PING_PROFILE defined (make PROFILE=1).
+ */
+enum e_ping_stage
+{
+    PING_STAGE_BUILD,   /* Writing the head of a packet, checksum included */
+    PING_STAGE_SEND,    /* A send syscall */
+    PING_STAGE_WAKEUP,  /* Delay between the date of a send and the loop waking up for it */
+    PING_STAGE_RECV,    /* A receive syscall */
+    PING_STAGE_PROCESS, /* Processing a reply, the two stages below included */
+    PING_STAGE_PRINT,   /* Printing or recording a reply */
+    PING_STAGE_STATS,   /* Updating the statistics of a target */
+    PING_STAGES
+};
+
+#ifdef PING_PROFILE
+#define PROFILE_START(var) uint64_t var = profile_now()
+#define PROFILE_END(stage, var) profile_record((stage), profile_now() - (var))
+#define PROFILE_WAKEUP(date) profile_wakeup(date)
+#define PROFILE_FLUSH() profile_flush()
+#else
+#define PROFILE_START(var)
+#define PROFILE_END(stage, var)
+#define PROFILE_WAKEUP(date)
+#define PROFILE_FLUSH()
+#endif
+
+/**
+ * @brief Adds to a counter that receiver threads may update concurrently.
+ */
+#define PING_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+/**
+ * @brief Marks an unused slot of the in-flight probe table.
+ */
+#define PING_NO_TARGET UINT32_MAX
+
 /**
  * @brief The options for the ping program.
  */
@@ -84,71 +285,689 @@ typedef struct s_ping_options
     float interval;
     int ttl;
     bool quiet;
+    bool flood;
+    bool adaptive;
+    bool busy_poll;
+    bool timestamp;
+    const char *file;
+    size_t threads;                    /* Receiver threads, 0 to run single-threaded */
+    int cpus[PING_MAX_THREADS + 1];    /* CPUs of the sender then of the receivers */
+    size_t num_cpus;
+    const char *evloop;                /* Name of the event loop backend */
+    int family;                        /* Address family to resolve to, AF_UNSPEC for both */
+    int output;                        /* PING_OUTPUT_TEXT, PING_OUTPUT_JSON or PING_OUTPUT_BINARY */
+    const char *output_file;           /* File the records go to, NULL for stdout */
+    uint64_t summary;                  /* Nanoseconds between interval summaries, 0 for none */
+    const char *metrics;               /* Address of the metrics endpoint, NULL for none */
+    bool pmtu;                         /* Search the path MTU instead of pinging */
+    bool trace;                        /* Probe every hop of the path instead of pinging */
+    const char *capture;               /* File the packets are captured to, NULL for none */
+    const char *replay;                /* Capture analysed instead of pinging, NULL to ping */
+    float jitter;                      /* Largest delay of a probe, as a fraction of its interval, negative for the default */
+    double rate;                       /* Packets per second to all the targets, 0 for no limit */
+    uint64_t timeout;                  /* Nanoseconds a probe waits for its reply before it counts as lost */
+    uint64_t deadline;                 /* Nanoseconds the run lasts at most, 0 for no limit */
 } t_ping_options;
 
+/**
+ * @brief Number of bits of a value kept below its most significant bit in the histogram.
+ *
+ * Each power of two is split in 2^PING_HIST_SUB_BITS linear buckets, which bounds
+ * the relative error of a reported percentile to 1 / 2^PING_HIST_SUB_BITS.
+ */
+#define PING_HIST_SUB_BITS 4
+
+/**
+ * @brief Values from 2^PING_HIST_MAX_BITS nanoseconds (about 137 seconds) go in the last bucket.
+ */
+#define PING_HIST_MAX_BITS 37
+
+/**
+ * @brief The number of buckets of a latency histogram.
+ */
+#define PING_HIST_BUCKETS ((PING_HIST_MAX_BITS - PING_HIST_SUB_BITS + 1) << PING_HIST_SUB_BITS)
+
+/**
+ * @brief Up to this many targets, each keeps a latency histogram of its own besides the run total.
+ */
+#define PING_HIST_TARGETS 256
+
+/**
+ * @brief A log-bucketed latency histogram in nanoseconds, with a fixed size.
+ */
+typedef struct s_ping_hist
+{
+    uint64_t count;                     /* Number of recorded values */
+    uint64_t min;                       /* Smallest recorded value */
+    uint64_t max;                       /* Largest recorded value */
+    uint64_t buckets[PING_HIST_BUCKETS]; /* Number of values per bucket */
+} t_ping_hist;
+
+/**
+ * @brief Round-trip statistics, in milliseconds.
+ */
 typedef struct s_ping_stats
 {
-    double min;
-    double max;
-    double sum;
-    double sum_square;
+    uint64_t count;   /* Number of samples */
+    double mean;      /* Running mean */
+    double m2;        /* Sum of squared deviations from the mean */
+    double min;       /* Smallest sample */
+    double max;        /* Largest sample */
+    t_ping_hist *hist; /* Distribution of the samples, NULL when not kept */
 } t_ping_stats;
 
+/**
+ * @brief A timer of the timer wheel, embedded in what it times.
+ */
+typedef struct s_ping_timer
+{
+    struct s_ping_timer *next;   /* Next timer of the same slot */
+    struct s_ping_timer **pprev; /* Link to it in its slot, NULL when it waits in none */
+    uint64_t expires;            /* Monotonic date in nanoseconds */
+} t_ping_timer;
+
+/**
+ * @brief A hierarchical timer wheel, adding and expiring a timer in constant time.
+ *
+ * Level n has 64 slots of 64^n ticks each. A timer goes in the level of the
+ * highest 6-bit digit its tick differs from the current one by, and moves
+ * down a level each time the slot it is in comes up, at most
+ * PING_WHEEL_LEVELS times before it expires.
+ */
+typedef struct s_ping_wheel
+{
+    uint64_t now;                                          /* Current tick, the timers before it have expired */
+    uint64_t occupied[PING_WHEEL_LEVELS];                  /* Bit of each slot holding timers */
+    uint64_t first[PING_WHEEL_LEVELS][PING_WHEEL_SLOTS];   /* Earliest date of each occupied slot */
+    t_ping_timer *slots[PING_WHEEL_LEVELS][PING_WHEEL_SLOTS];
+    t_ping_timer *far;                                     /* Timers beyond the last level */
+    t_ping_timer *due;                                     /* Expired timers, oldest first */
+    t_ping_timer *due_last;
+    size_t num_due;
+} t_ping_wheel;
+
+/**
+ * @brief The schedule of the probes: a timer per target and a token bucket capping the total rate.
+ */
+typedef struct s_ping_sched
+{
+    t_ping_wheel wheel; /* Date of the next probe of each target */
+    uint64_t cost;      /* Credit a probe takes in nanoseconds, 0 without a rate limit */
+    uint64_t credit;    /* Credit of the token bucket in nanoseconds */
+    uint64_t refilled;  /* Monotonic date the credit was last updated */
+    double jitter;      /* Largest delay of a probe, as a fraction of its interval */
+    uint64_t seed;      /* State of the generator of the delays */
+} t_ping_sched;
+
+/**
+ * @brief Resolution states of a target.
+ */
+#define PING_TARGET_PENDING 0
+#define PING_TARGET_READY 1
+#define PING_TARGET_FAILED 2
+
+/**
+ * @brief A destination probed by the ping loop, with its own counters.
+ */
+typedef struct s_ping_target
+{
+    struct sockaddr_storage dest; /* Destination address, IPv4 or IPv6 */
+    socklen_t destlen;            /* Size of the destination address */
+    char addr[INET6_ADDRSTRLEN];  /* Destination address, formatted */
+    int state;                    /* PING_TARGET_PENDING until resolved */
+    char hostname[HOST_NAME_MAX]; /* Hostname */
+    bool named;                   /* Given by name rather than address, so looked up again as it expires */
+    bool renew;                   /* A new address of the host waits for the sender to take it */
+    struct sockaddr_storage renewed; /* That address */
+    socklen_t renewedlen;         /* Size of that address */
+    size_t num_emit;              /* Number of packets transmitted */
+    size_t num_recv;              /* Number of packets received */
+    size_t num_rept;              /* Number of duplicates received */
+    size_t num_err;               /* Number of errors */
+    size_t num_late;              /* Replies too old to be matched */
+    size_t num_reorder;           /* Replies overtaken by a later probe */
+    size_t num_lost;              /* Probes given up on after the reply timeout */
+    uint32_t next_seq;            /* Sequence after the highest one answered */
+    uint64_t interval;            /* Nanoseconds between two probes */
+    uint64_t timeout;             /* Nanoseconds a probe waits for its reply */
+    uint64_t next_send;           /* Monotonic date of the next probe, before jitter */
+    t_ping_timer timer;           /* Date of the next probe, jitter included, in the schedule */
+    struct s_ping_target *kick_next; /* Next target a reply released, in adaptive mode */
+    bool kicked;                  /* Waits in the list of targets a reply released */
+    t_ping_stats stats;           /* Round-trip statistics */
+    char lock;                    /* Taken by receiver threads to update the above, by the monitor to read it */
+} t_ping_target;
+
+/**
+ * @brief Kernel timestamps of a packet in nanoseconds since the epoch, 0 when missing.
+ */
+typedef struct s_ping_stamp
+{
+    int64_t sw; /* Taken by the kernel network stack */
+    int64_t hw; /* Taken by the network card, in its own clock */
+} t_ping_stamp;
+
+/**
+ * @brief An entry of the in-flight table, indexed by wire sequence number.
+ */
+typedef struct s_ping_probe
+{
+    uint32_t target;    /* Index of the probed target, PING_NO_TARGET if unused */
+    uint32_t seq;       /* Sequence number within that target */
+    bool lost;          /* Given up on, a reply is then late */
+    uint64_t sent;      /* Monotonic send date in nanoseconds, the reply deadline being a timeout later */
+    t_ping_stamp tx;    /* Transmit timestamps read from the error queue */
+    t_ping_timer timer; /* Reply deadline, in the deadline wheel from the first expiry after the send */
+} t_ping_probe;
+
+/**
+ * @brief The path MTU search of a target, sizes being those of whole IP packets.
+ *
+ * The path MTU lies in (ok, bad), which each probe halves until it is ok + 1.
+ */
+typedef struct s_ping_pmtu
+{
+    uint32_t ok;              /* Largest size answered, or the smallest one to try minus one */
+    uint32_t bad;             /* Smallest size known not to get through, 0 before the search */
+    uint32_t route;           /* MTU of the route as the kernel knows it, 0 if unknown */
+    uint32_t size;            /* Size of the probes in flight, 0 for none */
+    uint16_t first_seq;       /* Wire sequence of the first probe of that size */
+    uint16_t wire_seq;        /* Wire sequence of the last one */
+    int tries;                /* Probes of that size lost so far */
+    uint32_t unanswered;      /* Size given up on after PING_PMTU_TRIES probes without a reply, 0 if none */
+    uint64_t deadline;        /* Monotonic date the last probe is given up at */
+    uint32_t next;            /* Size to try next instead of halving, 0 for none */
+    bool answered;            /* Some probe got a reply */
+    bool done;                /* The search is over */
+    int error;                /* Error sending the probes, 0 if none */
+    uint8_t type;             /* ICMP error that ended the search, 0 if none */
+    uint8_t code;
+    char from[INET6_ADDRSTRLEN]; /* Source of that error */
+} t_ping_pmtu;
+
+/**
+ * @brief The statistics of a hop of the TTL sweep, probes sent with the same TTL.
+ */
+typedef struct s_ping_hop
+{
+    size_t sent;                 /* Probes sent */
+    size_t received;             /* Probes answered, by a router or by the target */
+    double last;                 /* Round trip of the last answer, in milliseconds */
+    uint8_t type;                /* ICMP type of the last answer */
+    uint8_t code;
+    char from[INET6_ADDRSTRLEN]; /* Source of the last answer, empty before any */
+    t_ping_stats stats;          /* Round-trip statistics */
+} t_ping_hop;
+
+/**
+ * @brief The TTL sweep of every target, a round sending one probe per hop.
+ */
+typedef struct s_ping_trace
+{
+    int max_ttl;       /* Hops probed per target */
+    size_t rounds;     /* Rounds started */
+    size_t target;     /* Target the round goes on with, the number of targets once it is all sent */
+    int ttl;           /* Hop of that target the round goes on with */
+    size_t size;       /* Probes of the round, as counted when it started */
+    size_t done;       /* Probes of the round sent so far */
+    uint64_t start;    /* Monotonic date the round started */
+    uint8_t *reached;  /* TTL each target answered at, 0 until it did */
+    t_ping_hop *hops;  /* max_ttl hops per target */
+} t_ping_trace;
+
+/**
+ * @brief Preallocated receive buffers, with their message headers set up once.
+ */
+typedef struct s_ping_rxring
+{
+    size_t len;               /* Size of each buffer */
+    size_t next;              /* First slot of the next batch */
+    char *buffers;            /* Packet buffers, then ancillary data areas */
+    struct mmsghdr *msgs;     /* Message header of each slot */
+    struct iovec *iov;        /* Buffer of each slot */
+    struct sockaddr_in6 *from; /* Source address of each slot, large enough for both families */
+} t_ping_rxring;
+
+/**
+ * @brief A host in the resolver cache.
+ */
+typedef struct s_ping_dns_entry
+{
+    const char *host;             /* Hostname, NULL for a free slot */
+    struct sockaddr_storage addr; /* Address found, the last one known if a later lookup failed */
+    socklen_t len;                /* Size of the address */
+    uint64_t expires;             /* Monotonic date the entry is valid until */
+    bool pending;                 /* Being looked up by a worker */
+    bool failed;                  /* The host is unknown */
+} t_ping_dns_entry;
+
+/**
+ * @brief The resolver cache, shared by the resolver workers.
+ */
+typedef struct s_ping_dns
+{
+    t_ping_dns_entry *entries; /* Open addressing hash table */
+    size_t size;               /* Number of slots, a power of two */
+    pthread_mutex_t lock;
+    pthread_cond_t done;       /* Signaled when a lookup completes, and to stop the workers */
+    bool renewing;             /* A worker looks the expired entries up again */
+} t_ping_dns;
+
+/**
+ * @brief Time a scrape of the metrics endpoint may take to send its request or read the response.
+ */
+#define PING_METRICS_TIMEOUT_MS 1000
+
+/**
+ * @brief Totals of all the targets at a point in time, interval summaries being differences of two.
+ */
+typedef struct s_ping_snapshot
+{
+    uint64_t time;    /* Monotonic date in nanoseconds */
+    size_t sent;      /* Echo requests sent */
+    size_t received;  /* Echo replies received, duplicates and errors aside */
+    t_ping_hist hist; /* Round-trip times */
+} t_ping_snapshot;
+
+/**
+ * @brief Output formats of the replies.
+ */
+#define PING_OUTPUT_TEXT 0
+#define PING_OUTPUT_JSON 1
+#define PING_OUTPUT_BINARY 2
+
+/**
+ * @brief Size of the buffer records are batched in before being written.
+ */
+#define PING_OUT_BUFSIZE (1 << 20)
+
+/**
+ * @brief Records are written out at least this often, in nanoseconds.
+ */
+#define PING_OUT_FLUSH_NS 1000000000
+
+/**
+ * @brief Flags of a record.
+ */
+#define PING_REC_DUP 0x01
+#define PING_REC_LATE 0x02
+#define PING_REC_REORDER 0x04
+#define PING_REC_ERROR 0x08
+#define PING_REC_KERNEL_TIME 0x10
+#define PING_REC_HW_TIME 0x20
+
+/**
+ * @brief The header of a binary record file, followed by the records.
+ */
+typedef struct s_ping_rec_header
+{
+    char magic[8];        /* PING_REC_MAGIC */
+    uint32_t version;     /* PING_REC_VERSION */
+    uint32_t record_size; /* sizeof(t_ping_record) */
+    uint64_t start_ns;    /* Start of the run, nanoseconds since the epoch */
+    uint32_t num_targets; /* Targets, numbered in the order they were given */
+    uint32_t reserved;
+} t_ping_rec_header;
+
+#define PING_REC_MAGIC "PINGREC\0"
+#define PING_REC_VERSION 1
+
+/**
+ * @brief A reply, as written in binary output. All fields are in host byte order.
+ */
+typedef struct s_ping_record
+{
+    uint64_t time_ns; /* Receipt time, nanoseconds since the epoch */
+    int64_t rtt_ns;   /* Round trip time, -1 when the reply carries no timestamp */
+    uint32_t target;  /* Index of the target */
+    uint32_t seq;     /* Sequence number within the target */
+    uint8_t type;     /* ICMP type, ICMPv6 ones translated to their ICMP equivalent */
+    uint8_t code;     /* ICMP code */
+    uint8_t ttl;      /* Time to live or hop limit */
+    uint8_t flags;    /* PING_REC_* */
+    uint32_t size;    /* Size of the ICMP message */
+    uint8_t from[16]; /* Source address, IPv4-mapped for IPv4 */
+} t_ping_record;
+
+/**
+ * @brief Batches records in a large buffer and writes them out in one call.
+ */
+typedef struct s_ping_writer
+{
+    int fd;             /* File written to, -1 in text mode */
+    char *buf;          /* Pending records */
+    size_t len;         /* Size of the pending records */
+    uint64_t flushed;   /* Date of the last write, in nanoseconds since the epoch like the records */
+    uint64_t due;       /* Monotonic date the pending records are written by, 0 with none pending */
+    char lock;          /* Taken by receiver threads to append */
+} t_ping_writer;
+
+/**
+ * @brief The pcap format: nanosecond and microsecond magic numbers, link types read and written.
+ */
+#define PING_PCAP_MAGIC_NS 0xa1b23c4d
+#define PING_PCAP_MAGIC_US 0xa1b2c3d4
+#define PING_PCAP_LINKTYPE_ETHERNET 1
+#define PING_PCAP_LINKTYPE_RAW 101
+
+/**
+ * @brief Size by which the capture file is grown and mapped at a time.
+ */
+#define PING_PCAP_CHUNK (16 << 20)
+
+/**
+ * @brief The header of a pcap file, followed by the packets.
+ */
+typedef struct s_ping_pcap_header
+{
+    uint32_t magic;         /* PING_PCAP_MAGIC_NS or PING_PCAP_MAGIC_US */
+    uint16_t version_major; /* 2 */
+    uint16_t version_minor; /* 4 */
+    int32_t thiszone;       /* Always 0 */
+    uint32_t sigfigs;       /* Always 0 */
+    uint32_t snaplen;       /* Largest packet */
+    uint32_t linktype;      /* PING_PCAP_LINKTYPE_RAW for raw IPv4 and IPv6 packets */
+} t_ping_pcap_header;
+
+/**
+ * @brief The header of a packet of a pcap file, followed by its bytes.
+ */
+typedef struct s_ping_pcap_record
+{
+    uint32_t ts_sec;  /* Capture time, seconds since the epoch */
+    uint32_t ts_frac; /* Nanoseconds or microseconds, depending on the magic number */
+    uint32_t caplen;  /* Bytes kept */
+    uint32_t len;     /* Size of the packet */
+} t_ping_pcap_record;
+
+/**
+ * @brief Appends packets to a capture file through a shared mapping, without a syscall per packet.
+ */
+typedef struct s_ping_capture
+{
+    int fd;      /* Capture file, -1 for none */
+    char *map;   /* Mapped chunk of the file, NULL once writing failed */
+    size_t base; /* Offset of that chunk in the file */
+    size_t len;  /* Bytes written in that chunk */
+    char lock;   /* Taken by the sender and receiver threads to append */
+} t_ping_capture;
+
 /**
  * @brief The data for the ping program.
  */
 typedef struct ping_data PING;
+
+/**
+ * @brief A way of waiting for replies and for the next send of the single-threaded loop.
+ */
+typedef struct s_ping_evloop
+{
+    const char *name;                        /* Name given to -E */
+    int (*init)(PING *ping);                 /* Sets the backend up, non zero if unavailable */
+    int (*wait)(PING *ping, uint64_t until); /* Processes replies until the monotonic date, 0 to poll */
+    void (*free)(PING *ping);                /* Releases the backend */
+} t_ping_evloop;
+
 struct ping_data
 {
     int fd;                       /* Socket file descriptor */
+    bool raw;                     /* Raw socket, receiving the ICMP traffic of others */
+    int fd6;                      /* ICMPv6 socket, -1 without IPv6 targets */
+    bool raw6;                    /* Raw ICMPv6 socket */
     uint16_t ident;               /* Process ID */
-    size_t count;                 /* Number of packets to send */
+    size_t count;                 /* Number of packets to send, 0 means infinite */
     struct timeval start_time;    /* Time when the ping loop starts */
     size_t interval;              /* Interval between packets */
-    struct sockaddr_in dest;      /* Destination address */
     struct sockaddr_in from;      /* Source address */
-    char hostname[HOST_NAME_MAX]; /* Hostname */
     size_t datalen;               /* Data byte count */
     struct icmphdr hdr;           /* ICMP header */
     size_t num_emit;              /* Number of packets transmitted */
     size_t num_recv;              /* Number of packets received */
     size_t num_rept;              /* Number of duplicates received */
     size_t num_err;               /* Number of errors */
+    size_t num_lost;              /* Number of probes given up on */
+    size_t num_expired;           /* Probes sent whose fate is settled, in sending order */
+    size_t num_armed;             /* Probes sent whose reply deadline is in the wheel, in sending order */
+    t_ping_wheel deadlines;       /* Reply deadline of each probe in flight */
+    uint64_t end;                 /* Monotonic date the run stops at, 0 for none */
+    t_ping_hist hist;             /* Round-trip times of all the targets */
     t_ping_options options;       /* Ping options */
-    t_ping_stats stats;           /* Ping statistics */
+    t_ping_target *targets;       /* Destinations to probe */
+    size_t num_targets;           /* Number of destinations */
+    size_t max_targets;           /* Allocated size of targets */
+    size_t num_failed;            /* Targets whose host is unknown */
+    const char *progname;         /* Name of the program */
+    t_ping_dns dns;               /* Resolver cache */
+    pthread_t resolvers[PING_RESOLVERS]; /* Resolver workers */
+    size_t num_resolvers;         /* Number of resolver workers started */
+    size_t next_resolve;          /* Next target for the resolver workers */
+    t_ping_writer out;            /* Writer of the json or binary records */
+    t_ping_capture cap;           /* Writer of the captured packets */
+    t_ping_sched sched;           /* Dates of the next probes */
+    t_ping_probe *inflight;       /* Probes indexed by wire sequence */
+    uint64_t *seen;               /* Bitmap of the wire sequences already answered */
+    char *packet;                 /* Echo request template */
+    size_t packetlen;             /* Size of the echo request */
+    size_t headlen;               /* Size of the part rewritten for each send */
+    char *txbuf;                  /* Heads of the packets of the current send burst */
+    t_ping_rxring rx;             /* Receive buffers of the main thread */
+    bool stop;                    /* Tells receiver threads to exit */
+    int kick_fd;                  /* Wakes the sender thread up in adaptive mode */
+    size_t num_send_calls;        /* Number of send syscalls */
+    size_t num_recv_calls;        /* Number of receive syscalls */
+    size_t num_recv_packets;      /* Number of packets read from the socket */
+    size_t num_kick;              /* Replies that release a probe in adaptive mode */
+    t_ping_target *kicked;        /* Targets those replies came from, the last first */
+    size_t num_stamp_tx;          /* Transmit timestamps read from the error queue */
+    size_t num_stamp_sw;          /* Round trips timed with software kernel timestamps */
+    size_t num_stamp_hw;          /* Round trips timed with hardware timestamps */
+    uint64_t icmp_in_msgs;        /* ICMP messages received by the host at start */
+    const t_ping_evloop *evloop;  /* Event loop backend of the single-threaded loop */
+    int loop_fd;                  /* Epoll or io_uring instance */
+    int timer_fd;                 /* Timer of the epoll backend */
+    uint64_t timer_armed;         /* Date the timer is set to, 0 when disarmed */
+    void *uring;                  /* Rings of the io_uring backend */
+    size_t num_wakeups;           /* Number of returns from the event loop backend */
+    bool shared;                  /* Targets are read or updated by several threads, under their lock */
+    pthread_t monitor;            /* Thread printing summaries and serving metrics */
+    bool monitoring;              /* The monitor thread is running */
+    int monitor_fd;               /* Tells the monitor thread to exit */
+    int metrics_fd;               /* Listening socket of the metrics endpoint, -1 for none */
+    t_ping_pmtu *pmtu;            /* Path MTU search of each target, NULL when pinging */
+    t_ping_trace *trace;          /* TTL sweep of the targets, NULL when pinging */
 };
 
+/**
+ * @brief An implementation of the Internet checksum.
+ */
+typedef struct s_cksum_impl
+{
+    const char *name;                        /* Name shown by the benchmark */
+    uint16_t (*fn)(uint16_t *icmph, int len); /* Checksum function */
+    bool (*supported)(void);                 /* Whether the CPU can run it */
+} t_cksum_impl;
+
 /* ft_ping.c */
 int ft_ping(const char *argv[]);
+int ping_loop(PING *ping);
+bool ping_done(PING *ping);
+
+/* threads.c */
+int ping_loop_threaded(PING *ping);
+
+/* sched.c */
+void wheel_init(t_ping_wheel *wheel, uint64_t now);
+void wheel_add(t_ping_wheel *wheel, t_ping_timer *timer, uint64_t expires);
+void wheel_advance(t_ping_wheel *wheel, uint64_t now);
+t_ping_timer *wheel_pop(t_ping_wheel *wheel);
+uint64_t wheel_next(t_ping_wheel *wheel);
+bool wheel_remove(t_ping_timer *timer);
+bool wheel_expire(t_ping_wheel *wheel, t_ping_timer *timer);
+void sched_rate(t_ping_sched *sched, double rate, uint64_t now);
+size_t sched_tokens(t_ping_sched *sched, uint64_t now);
+void sched_spend(t_ping_sched *sched, size_t n);
+uint64_t sched_refill(t_ping_sched *sched);
+void sched_init(PING *ping);
+uint64_t sched_next(PING *ping);
+void sched_kick(PING *ping, t_ping_target *target);
+void send_due(PING *ping);
+
+/* pmtu.c */
+int ping_pmtu_loop(PING *ping);
+void pmtu_reply(PING *ping, uint32_t target, uint16_t wire_seq);
+
+/* trace.c */
+int ping_trace_loop(PING *ping);
+void trace_reply(PING *ping, t_ping_probe *probe, uint16_t wire_seq, uint8_t type, uint8_t code,
+                 const void *from, t_ping_stamp *rx);
+bool trace_error(PING *ping, int fd, struct msghdr *msg, size_t len);
+void trace_free(PING *ping);
+
+/* pcap.c */
+int capture_open(PING *ping);
+void capture_sent(PING *ping, struct msghdr *msg);
+void capture_received(PING *ping, const void *from, const char *packet, size_t len, t_ping_stamp *rx, int hops);
+void capture_close(PING *ping);
+int ping_replay(PING *ping);
 
 /* init.c */
 int parse_ping_options(t_ping_options *ping_options, t_args *args, const char *progname);
 int ping_parse_args(PING *ping, const char *argv[]);
-int ping_open_socket(const char *progname);
+int ping_open_socket(int family, const char *progname);
+size_t ping_grow_rcvbuf(int fd, int size);
 int ping_init(PING *ping, const char *progname);
+int ping_init6(PING *ping, const char *progname);
+void ping_free(PING *ping);
+
+/* resolve.c */
+int resolve_host(const char *host, int family, int flags, struct sockaddr_storage *addr, socklen_t *len);
+void target_ready(t_ping_target *target, struct sockaddr_storage *addr, socklen_t len);
+int resolve_target(PING *ping, t_ping_target *target);
+void target_renew(PING *ping, t_ping_target *target);
+int resolver_start(PING *ping);
+void resolver_stop(PING *ping);
+
+/* target.c */
+int ping_add_target(PING *ping, const char *host);
+int ping_read_targets(PING *ping, const char *path, const char *progname);
+void ping_reset_inflight(PING *ping);
+t_ping_probe *ping_match_probe(PING *ping, uint16_t wire_seq);
+bool ping_mark_seen(PING *ping, uint16_t wire_seq);
+bool ping_is_seen(PING *ping, uint16_t wire_seq);
+bool ping_is_late(PING *ping, uint16_t wire_seq);
+bool ping_mark_order(t_ping_target *target, uint32_t seq);
+void publish_probe(PING *ping, uint16_t wire_seq, uint32_t target, uint32_t seq);
+void ping_expire(PING *ping, uint64_t now);
+uint64_t ping_next_expiry(PING *ping);
 
 /* print.c */
 void print_stats(PING *ping);
+void print_target_stats(t_ping_target *target);
+void print_rtt_stats(t_ping_stats *stats);
+void print_io_stats(PING *ping);
 void print_header(PING *ping);
 void print_error_dump(struct icmphdr *icmp_packet, ssize_t received);
-int print_recv(uint8_t type, uint hlen, ssize_t received, char *from, uint seq, uint ttl, struct timeval *now);
+int print_recv(uint8_t type, uint hlen, ssize_t received, char *from, uint seq, uint ttl, struct timeval *now, const char *note);
 
 /* stats.c */
-void calculate_stats(t_ping_stats *stats, struct timeval *sent);
+void init_stats(t_ping_stats *stats);
+uint64_t calculate_stats(t_ping_stats *stats, struct timeval *sent);
+void merge_stats(t_ping_stats *dst, t_ping_stats *src);
+double stddev_stats(t_ping_stats *stats);
+
+/* loop.c */
+extern const t_ping_evloop ping_evloops[];
+const t_ping_evloop *evloop_find(const char *name);
+
+/* uring.c */
+int uring_init(PING *ping);
+int uring_wait(PING *ping, uint64_t until);
+void uring_free(PING *ping);
+
+/* output.c */
+int output_open(PING *ping);
+void output_record(t_ping_record *rec, const void *from, t_ping_stamp *rx);
+void output_reply(PING *ping, t_ping_record *rec);
+void output_summary(PING *ping);
+void output_pmtu(PING *ping, t_ping_target *target, t_ping_pmtu *pmtu);
+void output_hop(PING *ping, t_ping_target *target, int ttl, t_ping_hop *hop, size_t rounds);
+void output_write(PING *ping, const char *data, size_t len);
+void output_flush(PING *ping);
+void output_tick(PING *ping, uint64_t now);
+void output_close(PING *ping);
+bool output_to_stdout(PING *ping);
+
+/* profile.c */
+#ifdef PING_PROFILE
+uint64_t profile_now(void);
+void profile_record(int stage, uint64_t ns);
+void profile_wakeup(uint64_t date);
+void profile_flush(void);
+void profile_print(void);
+#endif
+
+/* monitor.c */
+int monitor_start(PING *ping);
+void monitor_stop(PING *ping);
+
+/* filter.c */
+int ping_attach_filter(PING *ping);
+int ping_attach_filter6(PING *ping);
+uint64_t icmp_in_msgs(void);
+
+/* ring.c */
+int rxring_init(t_ping_rxring *ring, size_t len);
+struct mmsghdr *rxring_batch(t_ping_rxring *ring);
+void rxring_free(t_ping_rxring *ring);
+
+/* hist.c */
+void hist_init(t_ping_hist *hist);
+t_ping_hist *hist_alloc(void);
+void hist_record(t_ping_hist *hist, uint64_t value);
+void hist_record_atomic(t_ping_hist *hist, uint64_t value);
+void hist_copy(t_ping_hist *dst, t_ping_hist *src);
+void hist_merge(t_ping_hist *dst, t_ping_hist *src);
+void hist_diff(t_ping_hist *dst, t_ping_hist *older);
+uint64_t hist_quantile(t_ping_hist *hist, double quantile);
 
 /* icmp.c */
-int send_packet(PING *ping);
-int recv_packet(PING *ping);
+size_t send_packets(PING *ping, t_ping_target **targets, size_t n);
+void send_messages(PING *ping, int fd, struct mmsghdr *msgs, size_t n);
+int recv_packets(PING *ping, int fd, t_ping_rxring *ring);
+void recv_tx_stamps(PING *ping, int fd, t_ping_rxring *ring);
+int process_message(PING *ping, struct msghdr *msg, char *packet, ssize_t received);
+int process_packet(PING *ping, char *packet, ssize_t received, struct sockaddr_in *from, t_ping_stamp *rx);
+int process_packet6(PING *ping, char *packet, ssize_t received, struct sockaddr_in6 *from, t_ping_stamp *rx, int hops);
+void read_stamp(struct msghdr *msg, t_ping_stamp *stamp);
 void create_packet(PING *ping, struct icmphdr *packet, size_t len);
+void stamp_packet(struct icmphdr *head, size_t headlen, uint16_t seq);
+void stamp_packet6(struct icmphdr *head, size_t headlen, uint16_t seq);
 
-/* utils.c */
-double nsqrt(double a, double prec);
+/* cksum.c */
+extern const t_cksum_impl cksum_impls[];
 uint16_t icmp_cksum(uint16_t *icmph, int len);
+uint16_t cksum_scalar(uint16_t *icmph, int len);
+uint16_t cksum_wide(uint16_t *icmph, int len);
+uint16_t cksum_update(uint16_t cksum, const uint16_t *old, const uint16_t *cur, size_t words);
+
+/* utils.c */
 void tvsub(struct timeval *out, struct timeval *in);
 int parse_count_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
 int parse_size_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
 int parse_interval_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
 int parse_ttl_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
-void calculate_timeout(struct timeval *timeout, struct timeval *last, struct timeval *interval);
+int parse_summary_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_output_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_evloop_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_threads_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_affinity_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_jitter_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_rate_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_timeout_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+int parse_deadline_arg(t_ping_options *ping_args, t_argr *argr, const char *progname);
+void calculate_timeout(struct timespec *timeout, uint64_t last, uint64_t interval);
+uint64_t now_ns(void);
+void ns_to_timeval(struct timeval *tv, int64_t ns);
+const char *format_addr(const void *addr, char *buf, size_t len);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,273 @@
+#include "ft_ping.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CKSUM_X86 1
+#endif
+
+/**
+ * @brief Below this length in bytes, the vector setup costs more than it saves.
+ */
+#define CKSUM_VECTOR_MIN 256
+
+/**
+ * Folds a one's complement sum to 16 bits and complements it.
+ *
+ * @param sum The sum to fold.
+ * @return The checksum.
+ */
+static uint16_t cksum_fold(uint64_t sum)
+{
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 32) + (sum & 0xffffffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return ~sum;
+}
+
+/**
+ * Sums the bytes that do not fill a whole vector or word.
+ *
+ * The tail is copied at the start of a zeroed word, which keeps each byte
+ * at the same position within its 16-bit word as in the data.
+ *
+ * @param data The start of the tail.
+ * @param len The length of the tail in bytes, less than 8.
+ * @return The one's complement sum of the tail, not folded.
+ */
+static uint64_t cksum_tail(const uint8_t *data, size_t len)
+{
+    uint64_t word = 0;
+
+    memcpy(&word, data, len);
+    return (word >> 32) + (word & 0xffffffff);
+}
+
+/**
+ * Calculates the Internet Checksum one 16-bit word at a time.
+ *
+ * This is the reference implementation, the other ones must return the same
+ * value for any data and length.
+ *
+ * @param icmph The address of the data.
+ * @param len The length of the data in bytes.
+ * @return The calculated checksum.
+ */
+uint16_t cksum_scalar(uint16_t *icmph, int len)
+{
+    uint16_t ret = 0;
+    uint32_t sum = 0;
+    uint16_t odd_byte = 0;
+
+    while (len > 1)
+    {
+        sum += *icmph++;
+        len -= 2;
+    }
+
+    if (len == 1)
+    {
+        *(uint8_t *)(&odd_byte) = *(uint8_t *)icmph;
+        sum += odd_byte;
+    }
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+    ret = ~sum;
+
+    return ret;
+}
+
+/**
+ * Calculates the Internet Checksum 64 bits at a time.
+ *
+ * The carry out of each addition is added back at once (end-around carry),
+ * which keeps the sum a valid one's complement sum of the 16-bit words.
+ *
+ * @param icmph The address of the data.
+ * @param len The length of the data in bytes.
+ * @return The calculated checksum.
+ */
+uint16_t cksum_wide(uint16_t *icmph, int len)
+{
+    const uint8_t *data = (const uint8_t *)icmph;
+    uint64_t sum = 0, word;
+
+    for (; len >= 8; len -= 8, data += 8)
+    {
+        memcpy(&word, data, sizeof(word));
+        sum += word;
+        sum += (sum < word);
+    }
+
+    word = cksum_tail(data, len);
+    sum += word;
+    sum += (sum < word);
+
+    return cksum_fold(sum);
+}
+
+#ifdef CKSUM_X86
+
+/**
+ * Calculates the Internet Checksum 16 bytes at a time with SSE2.
+ *
+ * The 16-bit words are widened into 32-bit lanes, which are spilled into a
+ * 64-bit sum before they can overflow.
+ *
+ * @param icmph The address of the data.
+ * @param len The length of the data in bytes.
+ * @return The calculated checksum.
+ */
+static __attribute__((target("sse2"))) uint16_t cksum_sse2(uint16_t *icmph, int len)
+{
+    const uint8_t *data = (const uint8_t *)icmph;
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+    uint32_t lanes[4];
+
+    while (len >= 16)
+    {
+        __m128i acc = zero;
+
+        /* 2 * 8192 additions of 16-bit words fit in a 32-bit lane */
+        for (int i = 0; i < 8192 && len >= 16; i++, len -= 16, data += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i *)data);
+
+            acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+            acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+        }
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+
+    for (; len >= 8; len -= 8, data += 8)
+        sum += cksum_tail(data, 8);
+    sum += cksum_tail(data, len);
+
+    return cksum_fold(sum);
+}
+
+/**
+ * Calculates the Internet Checksum 32 bytes at a time with AVX2.
+ *
+ * @param icmph The address of the data.
+ * @param len The length of the data in bytes.
+ * @return The calculated checksum.
+ */
+static __attribute__((target("avx2"))) uint16_t cksum_avx2(uint16_t *icmph, int len)
+{
+    const uint8_t *data = (const uint8_t *)icmph;
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+    uint32_t lanes[8];
+
+    while (len >= 32)
+    {
+        __m256i acc = zero;
+
+        for (int i = 0; i < 8192 && len >= 32; i++, len -= 32, data += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)data);
+
+            acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+            acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+        }
+        _mm256_storeu_si256((__m256i *)lanes, acc);
+        for (int i = 0; i < 8; i++)
+            sum += lanes[i];
+    }
+
+    for (; len >= 8; len -= 8, data += 8)
+        sum += cksum_tail(data, 8);
+    sum += cksum_tail(data, len);
+
+    return cksum_fold(sum);
+}
+
+static bool has_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool has_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+static bool always_supported(void)
+{
+    return true;
+}
+
+/**
+ * @brief The checksum implementations, from the slowest to the fastest.
+ */
+const t_cksum_impl cksum_impls[] = {
+    {"scalar", cksum_scalar, always_supported},
+    {"wide", cksum_wide, always_supported},
+#ifdef CKSUM_X86
+    {"sse2", cksum_sse2, has_sse2},
+    {"avx2", cksum_avx2, has_avx2},
+#endif
+    {NULL, NULL, NULL}};
+
+static uint16_t cksum_resolve(uint16_t *icmph, int len);
+
+static uint16_t (*cksum_impl)(uint16_t *, int) = cksum_resolve;
+
+/**
+ * Picks the fastest implementation the CPU supports, on the first call.
+ */
+static uint16_t cksum_resolve(uint16_t *icmph, int len)
+{
+    for (const t_cksum_impl *impl = cksum_impls; impl->name; impl++)
+        if (impl->supported())
+            cksum_impl = impl->fn;
+
+    return cksum_impl(icmph, len);
+}
+
+/**
+ * Calculates the Internet Checksum (ICMP checksum) for the given data.
+ *
+ * @param icmph The address of the data.
+ * @param len The length of the data in bytes.
+ * @return The calculated ICMP checksum.
+ */
+uint16_t icmp_cksum(uint16_t *icmph, int len)
+{
+    if (len < CKSUM_VECTOR_MIN)
+        return cksum_wide(icmph, len);
+    return cksum_impl(icmph, len);
+}
+
+/**
+ * Updates an Internet checksum after some 16-bit words of the data changed.
+ *
+ * Implements equation 3 of RFC 1624, HC' = ~(~HC + ~m + m'), for each word,
+ * which avoids summing the unchanged data again.
+ *
+ * @param cksum The checksum of the data before the change.
+ * @param old The previous value of the words.
+ * @param cur The new value of the words.
+ * @param words The number of words that changed.
+ * @return The checksum of the data after the change.
+ */
+uint16_t cksum_update(uint16_t cksum, const uint16_t *old, const uint16_t *cur, size_t words)
+{
+    uint32_t sum = (uint16_t)~cksum;
+
+    for (size_t i = 0; i < words; i++)
+        sum += (uint16_t)~old[i] + cur[i];
+
+    sum = (sum >> 16) + (sum & 0xffff);
+    sum += (sum >> 16);
+
+    return ~sum;
+}
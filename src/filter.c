@@ -0,0 +1,124 @@
+#include "ft_ping.h"
+
+/**
+ * Attaches a classic BPF program that drops the ICMP traffic of others.
+ *
+ * A raw ICMP socket gets a copy of every ICMP packet reaching the host. The
+ * program runs in the kernel on the IP datagram and only passes echo replies
+ * carrying our identifier, and the errors quoting one of our echo requests,
+ * so unrelated packets are neither queued nor copied to userspace.
+ *
+ * Datagram sockets are already matched on their identifier by the kernel and
+ * are left alone.
+ *
+ * @param ping The PING structure holding the socket and identifier.
+ * @return Returns 0 on success, or -1 if the filter could not be attached.
+ */
+int ping_attach_filter(PING *ping)
+{
+    struct sock_filter code[] = {
+        /* X = offset of the ICMP header */
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHOREPLY, 10, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_DEST_UNREACH, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_TIME_EXCEEDED, 0, 11),
+        /* X = offset of the quoted ICMP header, past the quoted IP header */
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, ICMP_MINLEN),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0x0f),
+        BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_X, 0),
+        BPF_STMT(BPF_ALU | BPF_ADD | BPF_K, ICMP_MINLEN),
+        BPF_STMT(BPF_MISC | BPF_TAX, 0),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ICMP_ECHO, 0, 3),
+        /* Identifier of the reply or of the quoted request */
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, offsetof(struct icmphdr, un.echo.id)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ping->ident, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+
+    if (!ping->raw)
+        return 0;
+
+    if (setsockopt(ping->fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Lets only the ICMPv6 messages a reply can come as through the ICMPv6 socket.
+ *
+ * ICMPv6 sockets have their own filter on the message type, which is enough
+ * to drop the neighbor discovery and router traffic every host receives.
+ *
+ * @param ping The PING structure holding the ICMPv6 socket.
+ * @return Returns 0 on success, or -1 if the filter could not be set.
+ */
+int ping_attach_filter6(PING *ping)
+{
+    struct icmp6_filter filter;
+
+    if (!ping->raw6)
+        return 0;
+
+    ICMP6_FILTER_SETBLOCKALL(&filter);
+    ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+    ICMP6_FILTER_SETPASS(ICMP6_DST_UNREACH, &filter);
+    ICMP6_FILTER_SETPASS(ICMP6_TIME_EXCEEDED, &filter);
+
+    return setsockopt(ping->fd6, IPPROTO_ICMPV6, ICMP6_FILTER, &filter, sizeof(filter));
+}
+
+/**
+ * Reads the number of ICMP and ICMPv6 messages received by the host.
+ *
+ * Packets rejected by a socket filter are not accounted anywhere for the
+ * socket, so the number filtered out is derived from these counters, which
+ * every ICMP message reaching the host increments.
+ *
+ * @return The sum of the Icmp InMsgs counter of /proc/net/snmp and of the
+ *         Icmp6InMsgs counter of /proc/net/snmp6, or 0 if unavailable.
+ */
+uint64_t icmp_in_msgs(void)
+{
+    FILE *file;
+    char names[1024];
+    char values[1024];
+    uint64_t in_msgs = 0;
+
+    file = fopen("/proc/net/snmp", "r");
+    if (!file)
+        return 0;
+
+    /* Each protocol has a line of names followed by a line of values */
+    while (fgets(names, sizeof(names), file) && fgets(values, sizeof(values), file))
+    {
+        if (strncmp(names, "Icmp: InMsgs ", 13) || strncmp(values, "Icmp: ", 6))
+            continue;
+        in_msgs = strtoull(values + 6, NULL, 10);
+        break;
+    }
+    fclose(file);
+
+    /* One counter per line there */
+    file = fopen("/proc/net/snmp6", "r");
+    if (!file)
+        return in_msgs;
+    while (fgets(names, sizeof(names), file))
+    {
+        if (strncmp(names, "Icmp6InMsgs ", 12))
+            continue;
+        in_msgs += strtoull(names + 12, NULL, 10);
+        break;
+    }
+    fclose(file);
+
+    return in_msgs;
+}
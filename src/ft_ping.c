@@ -8,63 +8,135 @@ void sig_handler(__attribute__((__unused__)) int signo)
     printf("Signal\n");
 }
 
+/**
+ * Tells whether the ping loop is over.
+ *
+ * It is once every packet has been sent and answered or given up on, at
+ * the deadline, or when none of the targets could be resolved.
+ *
+ * @param ping The PING structure.
+ * @return true if the loop should stop.
+ */
+bool ping_done(PING *ping)
+{
+    if (__atomic_load_n(&ping->num_failed, __ATOMIC_RELAXED) == ping->num_targets)
+        return true;
+    if (ping->end && now_ns() >= ping->end)
+        return true;
+
+    return ping->options.count &&
+           ping->num_emit == __atomic_load_n(&ping->count, __ATOMIC_RELAXED) &&
+           __atomic_load_n(&ping->num_recv, __ATOMIC_RELAXED) + ping->num_lost == ping->num_emit;
+}
+
+/**
+ * Runs the single-threaded ping loop on the selected event loop backend.
+ *
+ * The backend waits until the date of the next send given by the schedule,
+ * processing replies as they arrive. A backend that cannot be set up falls
+ * back to select().
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 on failure.
+ */
 int ping_loop(PING *ping)
 {
-    fd_set fdset;
-    struct timeval timeout, last, interval;
+    int result = 0;
 
-    FD_ZERO(&fdset);
-    FD_SET(ping->fd, &fdset);
+    /* Each target is probed once per interval, spread evenly across it */
+    uint64_t slot = (uint64_t)(ping->options.interval * 1000.0) / ping->num_targets;
 
-    interval.tv_sec = ping->options.interval / 1000000;
-    interval.tv_usec = (long int)ping->options.interval % 1000000;
+    /* The default timer slack would round short sleeps up by tens of microseconds */
+    if (slot < PING_PRECISE_INTERVAL)
+        prctl(PR_SET_TIMERSLACK, 1UL);
 
-    gettimeofday(&last, NULL);
-    send_packet(ping);
+    if (ping->evloop->init(ping))
+    {
+        perror(ping->evloop->name);
+        ping->evloop->free(ping);
+        ping->evloop = evloop_find("select");
+        printf("falling back to %s\n", ping->evloop->name);
+    }
+
+    sched_init(ping);
 
     while (!g_kill)
     {
-        FD_ZERO(&fdset);
-        FD_SET(ping->fd, &fdset);
-
-        calculate_timeout(&timeout, &last, &interval);
+        uint64_t until = ping->options.busy_poll ? 0 : sched_next(ping);
 
-        int result = select(ping->fd + 1, &fdset, NULL, NULL, &timeout);
-        if (result < 0 && errno != EINTR)
+        if (ping->evloop->wait(ping, until))
         {
-            perror("select");
-            return 1;
+            result = 1;
+            break;
         }
-        else if (result == 1)
-            recv_packet(ping);
-        else if ((ping->num_emit < ping->options.count || ping->options.count == 0) && !g_kill)
-            send_packet(ping);
-
-        if (ping->count == ping->options.count && ping->num_recv == ping->num_emit)
+        ping->num_wakeups++;
+        PROFILE_WAKEUP(until);
+        /* The loop wakes up at the deadline, a probe sent then could not be answered */
+        if (ping_done(ping))
             break;
+        if (!g_kill)
+        {
+            uint64_t now;
+
+            send_due(ping);
+            now = now_ns();
+            ping_expire(ping, now);
+            output_tick(ping, now);
+        }
+        if (ping->options.flood)
+            fflush(stdout);
 
-        gettimeofday(&last, NULL);
+        if (ping_done(ping))
+            break;
     }
 
-    return 0;
+    ping->evloop->free(ping);
+    return result;
 }
 
 int ft_ping(const char *argv[])
 {
     PING ping;
     int result;
+    bool own;
 
     if (ping_parse_args(&ping, argv))
         return 1;
 
     signal(SIGINT, sig_handler);
 
-    print_header(&ping);
-
-    result = ping_loop(&ping);
-
-    print_stats(&ping);
+    /* Records on the standard output replace the text */
+    if (!output_to_stdout(&ping))
+        print_header(&ping);
+
+    if (ping.options.replay)
+        result = ping_replay(&ping);
+    else if (ping.options.pmtu)
+        result = ping_pmtu_loop(&ping);
+    else if (ping.options.trace)
+        result = ping_trace_loop(&ping);
+    else
+        result = ping.options.threads ? ping_loop_threaded(&ping) : ping_loop(&ping);
+    monitor_stop(&ping);
+    PROFILE_FLUSH();
+
+    /* The path MTU search and the TTL sweep print their own results */
+    own = ping.options.pmtu || ping.options.trace;
+    if (!own)
+        output_summary(&ping);
+    output_flush(&ping);
+    if (!output_to_stdout(&ping) && !own)
+    {
+        if (ping.options.flood && !ping.options.quiet && ping.options.output == PING_OUTPUT_TEXT)
+            putchar('\n');
+        print_stats(&ping);
+#ifdef PING_PROFILE
+        profile_print();
+#endif
+    }
+    if (ping.num_failed == ping.num_targets)
+        result = 1;
 
-    close(ping.fd);
+    ping_free(&ping);
     return result;
 }
\ No newline at end of file
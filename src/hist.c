@@ -0,0 +1,193 @@
+#include "ft_ping.h"
+
+/**
+ * @brief Computes the bucket of a value.
+ *
+ * Values below 2^PING_HIST_SUB_BITS have a bucket each. Above, the bucket is
+ * picked from the position of the most significant bit and the
+ * PING_HIST_SUB_BITS bits that follow it, so the cost is a single bit scan.
+ *
+ * @param value The value to classify.
+ * @return The index of the bucket.
+ */
+static size_t hist_index(uint64_t value)
+{
+    uint shift;
+
+    if (value >> PING_HIST_MAX_BITS)
+        return PING_HIST_BUCKETS - 1;
+    if (value < (1 << PING_HIST_SUB_BITS))
+        return value;
+
+    shift = 63 - __builtin_clzll(value) - PING_HIST_SUB_BITS;
+    return ((shift + 1) << PING_HIST_SUB_BITS) + (value >> shift) - (1 << PING_HIST_SUB_BITS);
+}
+
+/**
+ * @brief Computes the value in the middle of a bucket, the inverse of hist_index().
+ *
+ * @param index The index of the bucket.
+ * @return The value the bucket stands for.
+ */
+static uint64_t hist_value(size_t index)
+{
+    uint shift;
+    uint64_t base;
+
+    if (index < (1 << PING_HIST_SUB_BITS))
+        return index;
+
+    shift = (index >> PING_HIST_SUB_BITS) - 1;
+    base = (uint64_t)((index & ((1 << PING_HIST_SUB_BITS) - 1)) + (1 << PING_HIST_SUB_BITS)) << shift;
+    return base + ((1ULL << shift) >> 1);
+}
+
+void hist_init(t_ping_hist *hist)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->min = UINT64_MAX;
+}
+
+/**
+ * @brief Allocates an empty histogram.
+ *
+ * @return The histogram, to be freed, or NULL on allocation failure.
+ */
+t_ping_hist *hist_alloc(void)
+{
+    t_ping_hist *hist = malloc(sizeof(*hist));
+
+    if (hist)
+        hist_init(hist);
+    return hist;
+}
+
+/**
+ * @brief Records a value in constant time.
+ *
+ * @param hist The histogram.
+ * @param value The value in nanoseconds.
+ */
+void hist_record(t_ping_hist *hist, uint64_t value)
+{
+    hist->buckets[hist_index(value)]++;
+    hist->count++;
+    if (value < hist->min)
+        hist->min = value;
+    if (value > hist->max)
+        hist->max = value;
+}
+
+/**
+ * @brief Records a value in a histogram other threads record into at the same time.
+ *
+ * Buckets are incremented atomically rather than under a lock, so receiver
+ * threads do not wait for each other. The extremes are updated by compare
+ * and swap, which only loops when they change.
+ *
+ * @param hist The histogram.
+ * @param value The value in nanoseconds.
+ */
+void hist_record_atomic(t_ping_hist *hist, uint64_t value)
+{
+    uint64_t cur;
+
+    __atomic_fetch_add(&hist->buckets[hist_index(value)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+    cur = __atomic_load_n(&hist->min, __ATOMIC_RELAXED);
+    while (value < cur &&
+           !__atomic_compare_exchange_n(&hist->min, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    cur = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+    while (value > cur &&
+           !__atomic_compare_exchange_n(&hist->max, &cur, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * @brief Copies a histogram that hist_record_atomic() may be recording into.
+ *
+ * The copy is not a single point in time: values recorded meanwhile may be
+ * counted in their bucket but not yet in the total, or the other way round.
+ *
+ * @param dst The copy.
+ * @param src The histogram.
+ */
+void hist_copy(t_ping_hist *dst, t_ping_hist *src)
+{
+    for (size_t i = 0; i < PING_HIST_BUCKETS; i++)
+        dst->buckets[i] = __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->min = __atomic_load_n(&src->min, __ATOMIC_RELAXED);
+    dst->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Adds the values recorded in a histogram to another one.
+ *
+ * @param dst The histogram to merge into.
+ * @param src The histogram to merge from.
+ */
+void hist_merge(t_ping_hist *dst, t_ping_hist *src)
+{
+    for (size_t i = 0; i < PING_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/**
+ * @brief Removes from a histogram the values recorded in an older copy of it.
+ *
+ * What is left are the values recorded in between. Their extremes are not
+ * known, so the range is widened to anything.
+ *
+ * @param dst The histogram.
+ * @param older The older copy.
+ */
+void hist_diff(t_ping_hist *dst, t_ping_hist *older)
+{
+    for (size_t i = 0; i < PING_HIST_BUCKETS; i++)
+        dst->buckets[i] -= older->buckets[i];
+    dst->count -= older->count;
+    dst->min = 0;
+    dst->max = UINT64_MAX;
+}
+
+/**
+ * @brief Estimates a quantile of the recorded values.
+ *
+ * @param hist The histogram.
+ * @param quantile The quantile, between 0 and 1.
+ * @return The estimated value in nanoseconds, or 0 if the histogram is empty.
+ */
+uint64_t hist_quantile(t_ping_hist *hist, double quantile)
+{
+    uint64_t rank, value, seen = 0;
+    size_t i;
+
+    if (!hist->count)
+        return 0;
+
+    rank = (uint64_t)ceil(quantile * hist->count);
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < PING_HIST_BUCKETS - 1; i++)
+    {
+        seen += hist->buckets[i];
+        if (seen >= rank)
+            break;
+    }
+
+    /* A bucket midpoint may fall outside the range actually recorded */
+    value = hist_value(i);
+    if (value < hist->min)
+        value = hist->min;
+    if (value > hist->max)
+        value = hist->max;
+    return value;
+}
@@ -1,5 +1,15 @@
 #include "ft_ping.h"
 
+/**
+ * Builds the echo request template, once for the whole run.
+ *
+ * The sequence number and the timestamp are left to zero; they are patched
+ * into a copy of the head of the packet for each send by stamp_packet().
+ *
+ * @param ping The PING structure.
+ * @param packet The buffer of the template.
+ * @param len The size of the packet in bytes.
+ */
 void create_packet(PING *ping, struct icmphdr *packet, size_t len)
 {
     memset(packet, 0, len);
@@ -7,74 +17,397 @@ void create_packet(PING *ping, struct icmphdr *packet, size_t len)
     packet->type = ICMP_ECHO;
     packet->code = 0;
     packet->un.echo.id = htons(ping->ident);
-    packet->un.echo.sequence = htons(ping->num_emit);
+    packet->un.echo.sequence = 0;
+
+    packet->checksum = icmp_cksum((uint16_t *)packet, len);
+}
+
+/**
+ * Writes the sequence number and the send time into the head of a packet.
+ *
+ * The head is a copy of the first headlen bytes of the template, whose
+ * sequence and timestamp are zero. Its checksum is updated incrementally
+ * (RFC 1624) for the words that change, so the cost does not depend on the
+ * size of the payload.
+ *
+ * @param head The head of the packet, copied from the template.
+ * @param headlen The size of the head in bytes.
+ * @param seq The wire sequence number.
+ */
+void stamp_packet(struct icmphdr *head, size_t headlen, uint16_t seq)
+{
+    uint16_t zero[(sizeof(uint16_t) + sizeof(struct timeval)) / sizeof(uint16_t)] = {0};
+
+    head->un.echo.sequence = htons(seq);
+    head->checksum = cksum_update(head->checksum, zero, &head->un.echo.sequence, 1);
 
-    if (len >= sizeof(struct icmphdr) + sizeof(struct timeval))
+    if (headlen >= sizeof(struct icmphdr) + sizeof(struct timeval))
     {
         struct timeval now;
         gettimeofday(&now, NULL);
-        memcpy((char *)packet + sizeof(struct icmphdr), &now, sizeof(now));
+        memcpy(head + 1, &now, sizeof(now));
+        head->checksum = cksum_update(head->checksum, zero, (uint16_t *)(head + 1),
+                                      sizeof(now) / sizeof(uint16_t));
     }
+}
 
-    packet->checksum = icmp_cksum((uint16_t *)packet, len);
+/**
+ * Writes the sequence number and the send time into the head of an ICMPv6 packet.
+ *
+ * The kernel computes the checksum of ICMPv6 packets, over a pseudo-header
+ * that only it knows the source address of, so it is left to zero.
+ *
+ * @param head The head of the packet, copied from the template.
+ * @param headlen The size of the head in bytes.
+ * @param seq The wire sequence number.
+ */
+void stamp_packet6(struct icmphdr *head, size_t headlen, uint16_t seq)
+{
+    head->type = ICMP6_ECHO_REQUEST;
+    head->checksum = 0;
+    head->un.echo.sequence = htons(seq);
+
+    if (headlen >= sizeof(struct icmphdr) + sizeof(struct timeval))
+    {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        memcpy(head + 1, &now, sizeof(now));
+    }
 }
 
 /**
- * Sends an ICMP packet to the destination address.
+ * Sends messages on a socket, skipping over the ones that fail.
+ *
+ * sendmmsg stops at the first message that cannot be sent and only reports
+ * the error on the next call, which then starts with that message. On a
+ * socket with IP_RECVERR, an ICMP error about an earlier packet is returned
+ * by the next send as well, which clears it: a failing message is tried
+ * once more before being skipped.
  *
- * @param ping The PING structure containing the socket file descriptor and destination address.
- * @param ping_args The ping options specifying the packet size.
- * @return 0 if the packet is sent successfully, other otherwise.
+ * @param ping The PING structure.
+ * @param fd The socket to send on.
+ * @param msgs The messages.
+ * @param n The number of messages.
  */
-int send_packet(PING *ping)
+void send_messages(PING *ping, int fd, struct mmsghdr *msgs, size_t n)
 {
-    size_t len;
+    size_t done = 0;
+    bool retried = false;
 
-    len = sizeof(struct icmphdr) + ping->options.size;
+    if (ping->cap.fd >= 0)
+        for (size_t i = 0; i < n; i++)
+            capture_sent(ping, &msgs[i].msg_hdr);
 
-    char packet[len];
+    while (done < n)
+    {
+        PROFILE_START(send);
+        int sent = sendmmsg(fd, msgs + done, n - done, 0);
 
-    create_packet(ping, (struct icmphdr *)packet, len);
+        PROFILE_END(PING_STAGE_SEND, send);
+        ping->num_send_calls++;
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (!retried && errno != ENOBUFS)
+            {
+                retried = true;
+                continue;
+            }
+            /* Skip the failing target so that it cannot stall the others */
+            perror("sendmmsg");
+            sent = 1;
+        }
+        retried = false;
+        done += sent;
+    }
+}
 
-    int sent = sendto(ping->fd, packet, len, 0, (struct sockaddr *)&ping->dest, sizeof(struct sockaddr));
-    if (sent < 0)
+/**
+ * Sends a burst of ICMP packets, one to each of the given targets.
+ *
+ * The targets are resolved ones picked by the schedule, a target appearing
+ * once per probe it gets.
+ *
+ * The burst goes out with one sendmmsg call per address family. The wire
+ * sequence number is global to the process; the in-flight table maps it back
+ * to the target and to the sequence number within that target. Entries are
+ * published before the burst is sent, so that a receiver thread can match a
+ * reply that comes back before sendmmsg returns.
+ *
+ * A probe that could not be sent is still counted as transmitted, and so as
+ * lost, so that an unreachable target does not get more probes than others.
+ *
+ * @param ping The PING structure containing the socket file descriptor and targets.
+ * @param targets The target of each probe.
+ * @param n The number of probes, at most PING_BATCH.
+ * @return The number of packets sent.
+ */
+size_t send_packets(PING *ping, t_ping_target **targets, size_t n)
+{
+    struct mmsghdr msgs[2][PING_BATCH];
+    struct iovec iov[PING_BATCH][2];
+    size_t count[2] = {0, 0};
+    uint64_t now = now_ns();
+    size_t k = 0;
+
+    if (n > PING_BATCH)
+        n = PING_BATCH;
+
+    for (size_t i = 0; i < n; i++)
     {
-        perror("sendto");
-        return 1;
+        t_ping_target *target = targets[i];
+        char *head = ping->txbuf + k * ping->headlen;
+        int v6 = target->dest.ss_family == AF_INET6;
+        struct mmsghdr *msg = &msgs[v6][count[v6]++];
+
+        /* Only the head is rewritten, the payload is shared with the template */
+        PROFILE_START(build);
+        memcpy(head, ping->packet, ping->headlen);
+        if (v6)
+            stamp_packet6((struct icmphdr *)head, ping->headlen, ping->num_emit + k);
+        else
+            stamp_packet((struct icmphdr *)head, ping->headlen, ping->num_emit + k);
+        PROFILE_END(PING_STAGE_BUILD, build);
+        iov[k][0].iov_base = head;
+        iov[k][0].iov_len = ping->headlen;
+        iov[k][1].iov_base = ping->packet + ping->headlen;
+        iov[k][1].iov_len = ping->packetlen - ping->headlen;
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_hdr.msg_iov = iov[k];
+        msg->msg_hdr.msg_iovlen = 2;
+        msg->msg_hdr.msg_name = &target->dest;
+        msg->msg_hdr.msg_namelen = target->destlen;
+        ping->inflight[(uint16_t)(ping->num_emit + k)].sent = now;
+        publish_probe(ping, ping->num_emit + k, target - ping->targets, target->num_emit++);
+        k++;
     }
 
-    ping->count++;
-    ping->num_emit++;
+    if (count[0])
+        send_messages(ping, ping->fd, msgs[0], count[0]);
+    if (count[1])
+        send_messages(ping, ping->fd6, msgs[1], count[1]);
 
-    return 0;
+    __atomic_store_n(&ping->num_emit, ping->num_emit + k, __ATOMIC_RELAXED);
+    if (ping->options.flood && !ping->options.quiet && ping->options.output == PING_OUTPUT_TEXT)
+        for (size_t i = 0; i < k; i++)
+            putchar('.');
+
+    return k;
 }
 
 /**
- * Receives an ICMP packet and processes its contents.
+ * Matches a reply to its probe, times it, prints it and updates the statistics.
+ *
+ * This is the part shared by both address families, once their headers are
+ * parsed. ICMPv6 types are translated to their ICMP equivalent by the caller.
  *
  * @param ping The PING structure containing the necessary information.
- * @param stats The ping statistics structure.
- * @param ping_options The ping options.
- * @return Returns 0 on success, other on failure.
+ * @param type The ICMP type of the reply.
+ * @param icp The ICMP header of the reply.
+ * @param echo The echo header of the reply, or the one quoted by an error.
+ * @param len The size of the ICMP message in bytes.
+ * @param hlen The size of the IP header that preceded it.
+ * @param from The address the packet was received from.
+ * @param ttl The time to live or hop limit of the reply.
+ * @param rx The kernel timestamps of the packet, or NULL to time it now.
+ * @return Returns -1 if the packet is not ours, 1 if it was printed as an error, 0 otherwise.
  */
-int recv_packet(PING *ping)
+static int handle_reply(PING *ping, uint8_t type, struct icmphdr *icp, struct icmphdr *echo, ssize_t len,
+                        uint hlen, const void *from, uint ttl, t_ping_stamp *rx)
 {
-    char packet[IP_MAXPACKET];
-    struct sockaddr_in from;
-    socklen_t fromlen;
-    ssize_t received;
-    uint hlen;
+    char addr[INET6_ADDRSTRLEN];
     struct timeval now, sent, *tp;
-    struct icmphdr *icp;
+    t_ping_target *target;
+    t_ping_probe *probe;
+    uint16_t wire_seq;
+    uint seq;
     bool error = false;
+    int printed = 0;
+    const char *note = "";
+    uint8_t flags = 0;
+    int64_t rtt_ns = -1;
+    uint64_t rtt = 0;
+    bool timed;
+
+    wire_seq = ntohs(echo->un.echo.sequence);
+    probe = ping_match_probe(ping, wire_seq);
+    if (!probe)
+        return -1;
+    target = &ping->targets[probe->target];
+    seq = probe->seq;
+
+    /* The path MTU search only needs to know which probes got through */
+    if (ping->pmtu)
+    {
+        if (type == ICMP_ECHOREPLY)
+            pmtu_reply(ping, probe->target, wire_seq);
+        return 0;
+    }
+
+    /* The TTL sweep keeps statistics per hop rather than per target */
+    if (ping->trace)
+    {
+        trace_reply(ping, probe, wire_seq, type, icp->code, from, rx);
+        return 0;
+    }
+
+    /* An error answers its probe as a reply does, only once and before the deadline */
+    if (type != ICMP_ECHOREPLY)
+    {
+        error = true;
+        flags |= PING_REC_ERROR;
+    }
+    if (ping_is_late(ping, wire_seq))
+    {
+        note = " (late)";
+        flags |= PING_REC_LATE;
+    }
+    else if (ping_mark_seen(ping, wire_seq))
+    {
+        /* The probe was given up on, or already answered */
+        if (__atomic_load_n(&probe->lost, __ATOMIC_ACQUIRE))
+        {
+            note = " (late)";
+            flags |= PING_REC_LATE;
+        }
+        else
+        {
+            note = " (DUP!)";
+            flags |= PING_REC_DUP;
+        }
+    }
+    else if (!error && ping_mark_order(target, seq))
+    {
+        note = " (reordered)";
+        flags |= PING_REC_REORDER;
+    }
 
-    fromlen = sizeof(from);
-    received = recvfrom(ping->fd, packet, IP_MAXPACKET, 0, (struct sockaddr *)&from, &fromlen);
-    if (received < 0)
+    /* Prefer timestamps taken on both ends by the same clock: NIC, then kernel */
+    if (rx && rx->hw && probe->tx.hw)
     {
-        perror("recvfrom");
-        return 1;
+        rtt_ns = rx->hw - probe->tx.hw;
+        ns_to_timeval(&now, rtt_ns);
+        PING_ADD(ping->num_stamp_hw, 1);
+        flags |= PING_REC_HW_TIME;
     }
+    else if (rx && rx->sw && probe->tx.sw)
+    {
+        rtt_ns = rx->sw - probe->tx.sw;
+        ns_to_timeval(&now, rtt_ns);
+        PING_ADD(ping->num_stamp_sw, 1);
+        flags |= PING_REC_KERNEL_TIME;
+    }
+    else
+    {
+        if (rx && rx->sw)
+            ns_to_timeval(&now, rx->sw);
+        else
+            gettimeofday(&now, NULL);
+        tp = (struct timeval *)(icp + 1);
+        memcpy(&sent, tp, sizeof(sent));
+        tvsub(&now, &sent);
+    }
+
+    if (!error && !*note && ping->options.adaptive)
+        sched_kick(ping, target);
+
+    PROFILE_START(print);
+    if (ping->options.output != PING_OUTPUT_TEXT)
+    {
+        t_ping_record rec = {
+            .rtt_ns = rtt_ns,
+            .target = probe->target,
+            .seq = seq,
+            .type = type,
+            .code = icp->code,
+            .ttl = ttl,
+            .flags = flags,
+            .size = len,
+        };
+
+        /* Kernel timestamps keep their nanoseconds, the payload one has microseconds */
+        if (error)
+            rec.rtt_ns = -1;
+        else if (rtt_ns < 0 && len >= (ssize_t)(sizeof(struct icmphdr) + sizeof(struct timeval)))
+            rec.rtt_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_usec * 1000;
+        output_record(&rec, from, rx);
+        output_reply(ping, &rec);
+    }
+    else if (ping->options.flood)
+    {
+        if (!ping->options.quiet && !(flags & (PING_REC_ERROR | PING_REC_DUP | PING_REC_LATE)))
+            putchar('\b');
+    }
+    else if (!ping->options.quiet)
+    {
+        /* Errors come from routers on the way, replies from the target itself */
+        const char *name = error ? format_addr(from, addr, sizeof(addr)) : target->addr;
+
+        printed = print_recv(type, hlen, len, (char *)name, seq, ttl, &now, note);
+    }
+    PROFILE_END(PING_STAGE_PRINT, print);
+
+    /* Receiver threads may update the same target concurrently, the monitor read it */
+    PROFILE_START(stats);
+    timed = !(flags & (PING_REC_DUP | PING_REC_LATE)) && !error &&
+            len >= (ssize_t)(sizeof(struct icmphdr) + sizeof(struct timeval));
+    if (ping->shared)
+        while (__atomic_test_and_set(&target->lock, __ATOMIC_ACQUIRE))
+            ;
+    /* Only a few targets keep a histogram each, allocated with their first round trip */
+    if (timed && !target->stats.hist && ping->num_targets <= PING_HIST_TARGETS)
+        target->stats.hist = hist_alloc();
+    if (flags & PING_REC_DUP)
+        target->num_rept++;
+    else if (flags & PING_REC_LATE)
+        target->num_late++;
+    else
+    {
+        if (error)
+            target->num_err++;
+        if (flags & PING_REC_REORDER)
+            target->num_reorder++;
+        target->num_recv++;
+        if (timed)
+            rtt = calculate_stats(&target->stats, &now);
+    }
+    if (ping->shared)
+        __atomic_clear(&target->lock, __ATOMIC_RELEASE);
+    if (timed && ping->shared)
+        hist_record_atomic(&ping->hist, rtt);
+    else if (timed)
+        hist_record(&ping->hist, rtt);
+    PROFILE_END(PING_STAGE_STATS, stats);
+
+    /* Duplicates and late replies must not make up for lost probes */
+    if (flags & PING_REC_DUP)
+        PING_ADD(ping->num_rept, 1);
+    else if (!(flags & PING_REC_LATE))
+    {
+        if (error)
+            PING_ADD(ping->num_err, 1);
+        PING_ADD(ping->num_recv, 1);
+    }
+
+    return printed;
+}
+
+/**
+ * Processes the contents of a received ICMP packet.
+ *
+ * @param ping The PING structure containing the necessary information.
+ * @param packet The received packet, starting with its IP header.
+ * @param received The size of the packet in bytes.
+ * @param from The address the packet was received from.
+ * @param rx The kernel timestamps of the packet, or NULL to time it now.
+ * @return Returns 0 on success, -1 if the packet is not ours.
+ */
+int process_packet(PING *ping, char *packet, ssize_t received, struct sockaddr_in *from, t_ping_stamp *rx)
+{
+    uint hlen;
+    struct icmphdr *icp, *echo;
+    int result;
 
     struct ip *ip_packet = (struct ip *)packet;
     hlen = ip_packet->ip_hl << 2;
@@ -87,31 +420,260 @@ int recv_packet(PING *ping)
     if (icp->type != ICMP_ECHOREPLY && icp->type != ICMP_DEST_UNREACH && icp->type != ICMP_TIME_EXCEEDED)
         return -1;
 
-    gettimeofday(&now, NULL);
-    tp = (struct timeval *)(icp + 1);
-    memcpy(&sent, tp, sizeof(sent));
-    tvsub(&now, &sent);
+    /* Errors quote the header of the probe that triggered them */
+    echo = icp;
+    if (icp->type != ICMP_ECHOREPLY)
+    {
+        struct ip *orig = (struct ip *)(icp + 1);
+
+        if (received < (ssize_t)(hlen + ICMP_MINLEN + sizeof(struct ip)) ||
+            received < hlen + ICMP_MINLEN + (orig->ip_hl << 2) + ICMP_MINLEN)
+            return -1;
+        echo = (struct icmphdr *)((char *)orig + (orig->ip_hl << 2));
+        if (echo->type != ICMP_ECHO)
+            return -1;
+    }
+
+    /* Datagram sockets get their identifier rewritten and matched by the kernel */
+    if (ping->raw && echo->un.echo.id != htons(ping->ident))
+        return -1;
+
+    result = handle_reply(ping, icp->type, icp, echo, received - hlen, hlen, from, ip_packet->ip_ttl, rx);
+    if (result < 0)
+        return -1;
+    if (result && ping->options.verbose)
+        print_error_dump(icp + 1, received - hlen - sizeof(struct icmphdr));
+
+    return 0;
+}
+
+/**
+ * Processes the contents of a received ICMPv6 packet.
+ *
+ * ICMPv6 sockets do not return the IPv6 header: the packet starts with the
+ * ICMPv6 header, and the hop limit comes as ancillary data. Errors quote
+ * the IPv6 header of the probe, extension headers are not expected there.
+ *
+ * @param ping The PING structure containing the necessary information.
+ * @param packet The received packet, starting with its ICMPv6 header.
+ * @param received The size of the packet in bytes.
+ * @param from The address the packet was received from.
+ * @param rx The kernel timestamps of the packet, or NULL to time it now.
+ * @param hops The hop limit of the packet, or -1 if unknown.
+ * @return Returns 0 on success, -1 if the packet is not ours.
+ */
+int process_packet6(PING *ping, char *packet, ssize_t received, struct sockaddr_in6 *from, t_ping_stamp *rx, int hops)
+{
+    struct icmphdr *icp = (struct icmphdr *)packet, *echo = icp;
+    uint8_t type;
+
+    if (received < (ssize_t)sizeof(struct icmp6_hdr))
+        return -1;
+
+    switch (icp->type)
+    {
+    case ICMP6_ECHO_REPLY:
+        type = ICMP_ECHOREPLY;
+        break;
+    case ICMP6_DST_UNREACH:
+        type = ICMP_DEST_UNREACH;
+        break;
+    case ICMP6_TIME_EXCEEDED:
+        type = ICMP_TIME_EXCEEDED;
+        break;
+    default:
+        return -1;
+    }
+
+    /* Errors quote the header of the probe that triggered them */
+    if (type != ICMP_ECHOREPLY)
+    {
+        struct ip6_hdr *orig = (struct ip6_hdr *)(icp + 1);
+
+        if (received < (ssize_t)(sizeof(struct icmp6_hdr) + sizeof(struct ip6_hdr) + sizeof(struct icmp6_hdr)) ||
+            orig->ip6_nxt != IPPROTO_ICMPV6)
+            return -1;
+        echo = (struct icmphdr *)(orig + 1);
+        if (echo->type != ICMP6_ECHO_REQUEST)
+            return -1;
+    }
+
+    if (ping->raw6 && echo->un.echo.id != htons(ping->ident))
+        return -1;
+
+    return handle_reply(ping, type, icp, echo, received, 0, from, hops, rx) < 0 ? -1 : 0;
+}
+
+/**
+ * Reads the hop limit of an ICMPv6 packet from its ancillary data.
+ *
+ * @param msg The message the packet was received with.
+ * @return The hop limit, or -1 if missing.
+ */
+static int read_hoplimit(struct msghdr *msg)
+{
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT)
+        {
+            int hops;
+
+            memcpy(&hops, CMSG_DATA(cmsg), sizeof(hops));
+            return hops;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Processes a packet received on either socket, along with its ancillary data.
+ *
+ * @param ping The PING structure containing the necessary information.
+ * @param msg The message the packet was received with, its name being the source address.
+ * @param packet The received packet.
+ * @param received The size of the packet in bytes.
+ * @return Returns 0 on success, -1 if the packet is not ours.
+ */
+int process_message(PING *ping, struct msghdr *msg, char *packet, ssize_t received)
+{
+    t_ping_stamp stamp;
+    bool v6 = ((struct sockaddr *)msg->msg_name)->sa_family == AF_INET6;
+    int hops = v6 ? read_hoplimit(msg) : -1;
+    int result;
+
+    PROFILE_START(process);
+    read_stamp(msg, &stamp);
+    if (ping->cap.fd >= 0)
+        capture_received(ping, msg->msg_name, packet, received, &stamp, hops);
+    if (v6)
+        result = process_packet6(ping, packet, received, msg->msg_name, &stamp, hops);
+    else
+        result = process_packet(ping, packet, received, msg->msg_name, &stamp);
+    PROFILE_END(PING_STAGE_PROCESS, process);
+
+    return result;
+}
 
-    if (!ping->options.quiet)
+/**
+ * Extracts the kernel timestamps from the ancillary data of a packet.
+ *
+ * @param msg The message the packet was received with.
+ * @param stamp Set to the timestamps found, zeroed when there are none.
+ */
+void read_stamp(struct msghdr *msg, t_ping_stamp *stamp)
+{
+    stamp->sw = 0;
+    stamp->hw = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
     {
-        error = print_recv(
-            icp->type,
-            hlen,
-            received - hlen,
-            inet_ntoa(*(struct in_addr *)&from.sin_addr.s_addr),
-            ntohs(icp->un.echo.sequence),
-            ip_packet->ip_ttl,
-            &now);
-        if (error && ping->options.verbose)
-            print_error_dump(icp + 1, received - hlen - sizeof(struct icmphdr));
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_TIMESTAMPING)
+            continue;
+
+        struct scm_timestamping ts;
+
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        stamp->sw = (int64_t)ts.ts[0].tv_sec * 1000000000 + ts.ts[0].tv_nsec;
+        stamp->hw = (int64_t)ts.ts[2].tv_sec * 1000000000 + ts.ts[2].tv_nsec;
     }
+}
 
-    if (error)
-        ping->num_err++;
-    ping->num_recv++;
+/**
+ * Reads the transmit timestamps looped back on the socket error queue.
+ *
+ * Each entry carries a copy of the sent frame, link and IP headers included.
+ * The echo request is its last part, and its sequence number tells which
+ * probe the timestamps belong to.
+ *
+ * @param ping The PING structure containing the necessary information.
+ * @param fd The socket the probes were sent on.
+ * @param ring The receive buffers of the calling thread.
+ */
+void recv_tx_stamps(PING *ping, int fd, t_ping_rxring *ring)
+{
+    struct mmsghdr *msgs;
+    size_t icmplen = sizeof(struct icmphdr) + ping->datalen;
+    int received;
+
+    do
+    {
+        msgs = rxring_batch(ring);
+        received = recvmmsg(fd, msgs, PING_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if (received <= 0)
+            return;
+        PING_ADD(ping->num_recv_calls, 1);
+
+        for (int i = 0; i < received; i++)
+        {
+            struct icmphdr *icp;
+            t_ping_probe *probe;
+            t_ping_stamp stamp;
 
-    if (received >= (ssize_t)(hlen + sizeof(struct icmphdr) + sizeof(struct timeval)) && !error)
-        calculate_stats(&ping->stats, &now);
+            /* ICMP errors share the queue on datagram sockets of the TTL sweep */
+            if (ping->trace && trace_error(ping, fd, &msgs[i].msg_hdr, msgs[i].msg_len))
+                continue;
+            if (msgs[i].msg_len < icmplen)
+                continue;
+            icp = (struct icmphdr *)((char *)msgs[i].msg_hdr.msg_iov->iov_base + msgs[i].msg_len - icmplen);
+            if (icp->type != (fd == ping->fd6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO))
+                continue;
+            probe = ping_match_probe(ping, ntohs(icp->un.echo.sequence));
+            if (!probe)
+                continue;
+
+            read_stamp(&msgs[i].msg_hdr, &stamp);
+            if (stamp.sw)
+                probe->tx.sw = stamp.sw;
+            if (stamp.hw)
+                probe->tx.hw = stamp.hw;
+            PING_ADD(ping->num_stamp_tx, 1);
+        }
+    } while (received == PING_BATCH);
+}
+
+/**
+ * Drains the replies queued on the socket.
+ *
+ * Each recvmmsg call fills up to PING_BATCH buffers of the receive ring at
+ * once; another call is made only when a batch came back full. Packets are
+ * parsed in place, nothing is allocated or copied per packet.
+ *
+ * @param ping The PING structure containing the necessary information.
+ * @param fd The socket to read, ICMP or ICMPv6.
+ * @param ring The receive buffers of the calling thread.
+ * @return Returns 0 on success, other on failure.
+ */
+int recv_packets(PING *ping, int fd, t_ping_rxring *ring)
+{
+    struct mmsghdr *msgs;
+    int received;
+
+    /* Transmit timestamps must be known before the replies are timed */
+    if (ping->options.timestamp)
+        recv_tx_stamps(ping, fd, ring);
+
+    do
+    {
+        msgs = rxring_batch(ring);
+        PROFILE_START(recv);
+        received = recvmmsg(fd, msgs, PING_BATCH, MSG_DONTWAIT, NULL);
+        PROFILE_END(PING_STAGE_RECV, recv);
+        if (received < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            /* With IP_RECVERR, errors are read from the error queue, see pmtu.c and trace.c */
+            if (ping->pmtu || ping->trace)
+                return 0;
+            perror("recvmmsg");
+            return 1;
+        }
+        PING_ADD(ping->num_recv_calls, 1);
+        PING_ADD(ping->num_recv_packets, received);
+
+        for (int i = 0; i < received; i++)
+            process_message(ping, &msgs[i].msg_hdr, msgs[i].msg_hdr.msg_iov->iov_base, msgs[i].msg_len);
+    } while (received == PING_BATCH);
 
     return 0;
-}
\ No newline at end of file
+}
@@ -3,35 +3,37 @@
 /**
  * Opens a socket for ICMP communication.
  *
- * This function creates a socket for sending and receiving ICMP packets.
+ * This function creates a socket for sending and receiving ICMP or ICMPv6 packets.
  * It first retrieves the protocol information for ICMP using `getprotobyname()`.
  * If the protocol information is not found, an error message is printed and -1 is returned.
  * Otherwise, it creates a raw socket using `socket()` with the retrieved protocol.
  * If the raw socket creation fails due to lack of privilege, it falls back to creating a datagram socket.
  * If the socket creation fails for any other reason, an error message is printed and -1 is returned.
  *
+ * @param family AF_INET for ICMP, or AF_INET6 for ICMPv6.
  * @param progname The name of the program.
  * @return The file descriptor of the opened socket, or -1 if an error occurred.
  */
-int ping_open_socket(const char *progname)
+int ping_open_socket(int family, const char *progname)
 {
     int fd;
     struct protoent *proto;
+    const char *name = family == AF_INET6 ? "ipv6-icmp" : "icmp";
 
-    proto = getprotobyname("icmp");
+    proto = getprotobyname(name);
     if (!proto)
     {
-        fprintf(stderr, "%s: unknown protocol icmp.\n", progname);
+        fprintf(stderr, "%s: unknown protocol %s.\n", progname, name);
         return -1;
     }
 
-    fd = socket(AF_INET, SOCK_RAW, proto->p_proto);
+    fd = socket(family, SOCK_RAW, proto->p_proto);
     if (fd < 0)
     {
         if (errno == EPERM || errno == EACCES)
         {
             errno = 0;
-            fd = socket(AF_INET, SOCK_DGRAM, proto->p_proto);
+            fd = socket(family, SOCK_DGRAM, proto->p_proto);
             if (fd < 0)
             {
                 if (errno == EPERM || errno == EACCES || errno == EPROTONOSUPPORT)
@@ -49,6 +51,28 @@ int ping_open_socket(const char *progname)
     return fd;
 }
 
+/**
+ * Enlarges the receive buffer of a socket.
+ *
+ * SO_RCVBUFFORCE goes past net.core.rmem_max with CAP_NET_ADMIN. Without
+ * it, SO_RCVBUF is capped there, so the size obtained is read back.
+ *
+ * @param fd The socket.
+ * @param size The size asked for, in bytes.
+ * @return The size of the receive buffer, as the kernel accounts it, or 0 if unknown.
+ */
+size_t ping_grow_rcvbuf(int fd, int size)
+{
+    int got = 0;
+    socklen_t len = sizeof(got);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &got, &len) < 0 || got < 0)
+        return 0;
+    return got;
+}
+
 /**
  * Initializes a PING structure with the given program name, argument reader, and ping options.
  *
@@ -59,7 +83,17 @@ int ping_open_socket(const char *progname)
  */
 int ping_init(PING *ping, const char *progname)
 {
-    ping->fd = ping_open_socket(progname);
+    ping->fd = ping->options.replay ? -1 : ping_open_socket(AF_INET, progname);
+    int type = 0;
+    socklen_t typelen = sizeof(type);
+    ping->raw = getsockopt(ping->fd, SOL_SOCKET, SO_TYPE, &type, &typelen) == 0 && type == SOCK_RAW;
+    ping->fd6 = -1;
+    ping->raw6 = false;
+    ping->progname = progname;
+    memset(&ping->dns, 0, sizeof(ping->dns));
+    ping->num_resolvers = 0;
+    ping->next_resolve = 0;
+    ping->num_failed = 0;
     ping->count = 0;
     ping->interval = 1;
     ping->datalen = ping->options.size;
@@ -68,12 +102,80 @@ int ping_init(PING *ping, const char *progname)
     ping->num_recv = 0;
     ping->num_rept = 0;
     ping->num_err = 0;
+    ping->num_lost = 0;
+    ping->num_expired = 0;
+    ping->num_armed = 0;
+    wheel_init(&ping->deadlines, now_ns());
+    ping->end = 0;
+    hist_init(&ping->hist);
+    ping->targets = NULL;
+    ping->packet = NULL;
+    ping->txbuf = NULL;
+    memset(&ping->rx, 0, sizeof(ping->rx));
+    ping->stop = false;
+    ping->evloop = evloop_find(ping->options.evloop);
+    ping->loop_fd = -1;
+    ping->timer_fd = -1;
+    ping->timer_armed = 0;
+    ping->uring = NULL;
+    ping->num_wakeups = 0;
+    memset(&ping->out, 0, sizeof(ping->out));
+    ping->out.fd = -1;
+    memset(&ping->cap, 0, sizeof(ping->cap));
+    ping->cap.fd = -1;
+    ping->shared = ping->options.threads > 1 || ping->options.summary || ping->options.metrics;
+    ping->monitoring = false;
+    ping->monitor_fd = -1;
+    ping->metrics_fd = -1;
+    ping->pmtu = NULL;
+    ping->trace = NULL;
+    ping->kick_fd = -1;
+    ping->num_targets = 0;
+    ping->max_targets = 0;
     gettimeofday(&ping->start_time, NULL);
 
-    ping->stats.sum = -1;
-    ping->stats.min = -1;
-    ping->stats.max = -1;
-    ping->stats.sum_square = -1;
+    ping->inflight = malloc(PING_SEQ_SPACE * sizeof(t_ping_probe));
+    if (!ping->inflight)
+    {
+        perror("malloc");
+        return (1);
+    }
+    ping_reset_inflight(ping);
+    ping->seen = calloc(PING_SEQ_SPACE / 64, sizeof(uint64_t));
+    if (!ping->seen)
+    {
+        perror("calloc");
+        return (1);
+    }
+
+    ping->num_send_calls = 0;
+    ping->num_recv_calls = 0;
+    ping->num_recv_packets = 0;
+    ping->num_kick = 0;
+    ping->kicked = NULL;
+    ping->num_stamp_tx = 0;
+    ping->num_stamp_sw = 0;
+    ping->num_stamp_hw = 0;
+    ping->packetlen = sizeof(struct icmphdr) + ping->datalen;
+    ping->headlen = sizeof(struct icmphdr);
+    if (ping->datalen >= sizeof(struct timeval))
+        ping->headlen += sizeof(struct timeval);
+    ping->packet = malloc(ping->packetlen);
+    ping->txbuf = malloc(PING_BATCH * ping->headlen);
+    /* Large enough for our replies, looped back requests and ICMP errors */
+    size_t rxlen = ping->packetlen + MAXIPLEN + PING_LINK_HDR_MAX;
+    if (rxlen < PING_RX_MIN_LEN)
+        rxlen = PING_RX_MIN_LEN;
+    if (!ping->packet || !ping->txbuf || rxring_init(&ping->rx, rxlen))
+    {
+        perror("malloc");
+        return (1);
+    }
+    create_packet(ping, (struct icmphdr *)ping->packet, ping->packetlen);
+
+    /* A replay reads a capture, there is no socket to set up */
+    if (ping->options.replay)
+        return (0);
 
     if (ping->options.ttl > 0)
         if (setsockopt(ping->fd, IPPROTO_IP, IP_TTL,
@@ -84,37 +186,128 @@ int ping_init(PING *ping, const char *progname)
             return (1);
         }
 
+    if (ping_attach_filter(ping) < 0)
+    {
+        perror("setsockopt");
+        return (1);
+    }
+    ping->icmp_in_msgs = icmp_in_msgs();
+
+    if (ping->options.timestamp)
+    {
+        int flags = PING_TIMESTAMPING;
+
+        if (setsockopt(ping->fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        {
+            perror("setsockopt");
+            return (1);
+        }
+    }
+
     return (0);
 }
 
 /**
- * Sets the destination address for the PING structure.
+ * Opens and sets up the ICMPv6 socket, when some targets are or may be IPv6 ones.
+ *
+ * Without IPv6 targets known yet, a socket that cannot be opened is not an
+ * error: pending hosts are then only resolved to IPv4 addresses.
+ *
+ * The kernel computes the checksum of ICMPv6 packets itself. Only echo
+ * replies and the errors that can quote an echo request are let through,
+ * and the hop limit of each reply is asked for since there is no IP header
+ * to read it from.
  *
- * @param ping The PING structure to set the destination for.
- * @param host The hostname or IP address of the destination.
+ * @param ping The PING structure, with its targets resolved.
+ * @param progname The name of the program.
  * @return Returns 0 on success, or 1 if an error occurred.
  */
-static int set_dest(PING *ping, const char *host)
+int ping_init6(PING *ping, const char *progname)
 {
-    struct addrinfo hints;
-    struct addrinfo *res;
-    struct sockaddr_in *ipv4;
+    int on = 1;
+    int type = 0;
+    socklen_t typelen = sizeof(type);
+    bool needed = false;
+    bool maybe = false;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
+    for (size_t i = 0; i < ping->num_targets; i++)
+    {
+        if (ping->targets[i].state == PING_TARGET_PENDING)
+            maybe = ping->options.family != AF_INET;
+        else if (ping->targets[i].dest.ss_family == AF_INET6)
+            needed = true;
+    }
+    if (!needed && !maybe)
+        return (0);
 
-    if (getaddrinfo(host, NULL, &hints, &res) != 0)
-        return 1;
+    if (needed)
+        ping->fd6 = ping_open_socket(AF_INET6, progname);
+    else
+    {
+        ping->fd6 = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
+        if (ping->fd6 < 0)
+            ping->fd6 = socket(AF_INET6, SOCK_DGRAM, IPPROTO_ICMPV6);
+        if (ping->fd6 < 0)
+            return (0);
+    }
+    if (ping->fd6 < 0)
+        return (1);
+    ping->raw6 = getsockopt(ping->fd6, SOL_SOCKET, SO_TYPE, &type, &typelen) == 0 && type == SOCK_RAW;
 
-    ipv4 = (struct sockaddr_in *)res->ai_addr;
-    ping->dest = *ipv4;
+    if (ping_attach_filter6(ping) < 0 ||
+        setsockopt(ping->fd6, IPPROTO_IPV6, IPV6_RECVHOPLIMIT, &on, sizeof(on)) < 0)
+    {
+        perror("setsockopt");
+        return (1);
+    }
 
-    ft_strlcpy(ping->hostname, host, HOST_NAME_MAX);
+    if (ping->options.ttl > 0)
+        if (setsockopt(ping->fd6, IPPROTO_IPV6, IPV6_UNICAST_HOPS,
+                       &ping->options.ttl, sizeof(ping->options.ttl)) < 0)
+        {
+            perror("setsockopt");
+            return (1);
+        }
 
-    freeaddrinfo(res);
+    if (ping->options.timestamp)
+    {
+        int flags = PING_TIMESTAMPING;
 
-    return 0;
+        if (setsockopt(ping->fd6, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+        {
+            perror("setsockopt");
+            return (1);
+        }
+    }
+
+    return (0);
+}
+
+/**
+ * Releases the resources held by a PING structure.
+ *
+ * @param ping The PING structure to release.
+ */
+void ping_free(PING *ping)
+{
+    monitor_stop(ping);
+    resolver_stop(ping);
+    output_close(ping);
+    capture_close(ping);
+    for (size_t i = 0; i < ping->num_targets; i++)
+        free(ping->targets[i].stats.hist);
+    free(ping->targets);
+    free(ping->inflight);
+    free(ping->seen);
+    free(ping->pmtu);
+    trace_free(ping);
+    free(ping->packet);
+    free(ping->txbuf);
+    rxring_free(&ping->rx);
+    if (ping->fd >= 0)
+        close(ping->fd);
+    if (ping->fd6 >= 0)
+        close(ping->fd6);
 }
 
 /**
@@ -128,6 +321,9 @@ static int set_dest(PING *ping, const char *host)
 int parse_ping_options(t_ping_options *ping_options, t_args *args, const char *progname)
 {
     t_argr *argr;
+    bool interval_set = false;
+    bool size_set = false;
+    bool ttl_set = false;
 
     ping_options->verbose = false;
     ping_options->count = PING_DEFAULT_COUNT;
@@ -135,6 +331,27 @@ int parse_ping_options(t_ping_options *ping_options, t_args *args, const char *p
     ping_options->interval = PING_DEFAULT_INTERVAL;
     ping_options->ttl = PING_DEFAULT_TTL;
     ping_options->quiet = false;
+    ping_options->flood = false;
+    ping_options->adaptive = false;
+    ping_options->busy_poll = false;
+    ping_options->timestamp = false;
+    ping_options->file = NULL;
+    ping_options->threads = 0;
+    ping_options->num_cpus = 0;
+    ping_options->evloop = NULL;
+    ping_options->family = AF_UNSPEC;
+    ping_options->output = PING_OUTPUT_TEXT;
+    ping_options->output_file = NULL;
+    ping_options->summary = 0;
+    ping_options->metrics = NULL;
+    ping_options->pmtu = false;
+    ping_options->trace = false;
+    ping_options->capture = NULL;
+    ping_options->replay = NULL;
+    ping_options->jitter = -1;
+    ping_options->rate = 0;
+    ping_options->timeout = PING_DEFAULT_RECV_TIMEOUT * 1000000000ULL;
+    ping_options->deadline = 0;
 
     while ((argr = get_next_option(args)))
     {
@@ -147,6 +364,12 @@ int parse_ping_options(t_ping_options *ping_options, t_args *args, const char *p
         case 'v':
             ping_options->verbose = true;
             break;
+        case '4':
+            ping_options->family = AF_INET;
+            break;
+        case '6':
+            ping_options->family = AF_INET6;
+            break;
         case 'c':
             if (parse_count_arg(ping_options, argr, progname))
                 return 1;
@@ -154,20 +377,142 @@ int parse_ping_options(t_ping_options *ping_options, t_args *args, const char *p
         case 's':
             if (parse_size_arg(ping_options, argr, progname))
                 return 1;
+            size_set = true;
             break;
         case 'i':
             if (parse_interval_arg(ping_options, argr, progname))
                 return 1;
+            interval_set = true;
             break;
         case 't':
             if (parse_ttl_arg(ping_options, argr, progname))
                 return 1;
+            ttl_set = true;
             break;
         case 'q':
             ping_options->quiet = true;
             break;
+        case 'F':
+            ping_options->file = argr->values[0];
+            break;
+        case 'o':
+            if (parse_output_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'O':
+            ping_options->output_file = argr->values[0];
+            break;
+        case 'I':
+            if (parse_summary_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'M':
+            ping_options->metrics = argr->values[0];
+            break;
+        case 'P':
+            ping_options->pmtu = true;
+            break;
+        case 'H':
+            ping_options->trace = true;
+            break;
+        case 'C':
+            ping_options->capture = argr->values[0];
+            break;
+        case 'R':
+            ping_options->replay = argr->values[0];
+            break;
+        case 'j':
+            if (parse_jitter_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'r':
+            if (parse_rate_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'W':
+            if (parse_timeout_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'w':
+            if (parse_deadline_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'E':
+            if (parse_evloop_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'f':
+            ping_options->flood = true;
+            break;
+        case 'A':
+            ping_options->adaptive = true;
+            break;
+        case 'b':
+            ping_options->busy_poll = true;
+            break;
+        case 'k':
+            ping_options->timestamp = true;
+            break;
+        case 'T':
+            if (parse_threads_arg(ping_options, argr, progname))
+                return 1;
+            break;
+        case 'a':
+            if (parse_affinity_arg(ping_options, argr, progname))
+                return 1;
+            break;
         }
     }
+
+    /* Flooding without an explicit interval sends as fast as possible */
+    if (ping_options->flood && !interval_set)
+        ping_options->interval = 0;
+    /* The path MTU search probes sizes up to the largest one by default */
+    if (ping_options->pmtu && !size_set)
+        ping_options->size = PING_MAX_DATALEN;
+    /* The TTL sweep probes as many hops as traceroute by default */
+    if (ping_options->trace && !ttl_set)
+        ping_options->ttl = PING_TRACE_MAX_TTL;
+    if (ping_options->pmtu && ping_options->trace)
+    {
+        printf("%s: -P and -H cannot be used together\n", progname);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Refuses to flood or to send faster than the minimum interval without privileges.
+ *
+ * As in iputils, that takes a raw socket or root: a datagram ICMP socket
+ * is open to any user.
+ *
+ * @param ping The PING structure, with its sockets and targets.
+ * @param progname The name of the program.
+ * @return Returns 0 if allowed, or 1 after printing why not.
+ */
+static int ping_check_interval(PING *ping, const char *progname)
+{
+    uint64_t min = PING_MIN_USER_INTERVAL * 1000ULL;
+    bool fast = false;
+
+    if (ping->options.replay || geteuid() == 0 ||
+        ((ping->fd < 0 || ping->raw) && (ping->fd6 < 0 || ping->raw6)))
+        return 0;
+    if (ping->options.flood)
+    {
+        printf("%s: cannot flood; minimal interval allowed for user is %dms\n", progname,
+               PING_MIN_USER_INTERVAL / 1000);
+        return 1;
+    }
+    for (size_t i = 0; i < ping->num_targets; i++)
+        fast |= ping->targets[i].interval < min;
+    if (fast || ping->options.interval < PING_MIN_USER_INTERVAL)
+    {
+        printf("%s: cannot set interval; minimal interval allowed for user is %dms\n", progname,
+               PING_MIN_USER_INTERVAL / 1000);
+        return 1;
+    }
     return 0;
 }
 
@@ -187,21 +532,47 @@ int ping_parse_args(PING *ping, const char *argv[])
     if (parse_ping_options(&ping->options, args, argv[0]) || ping_init(ping, argv[0]))
         return 1;
 
-    t_argr *argr = get_next_arg(args);
+    t_argr *argr;
 
-    if (!argr)
+    while ((argr = get_next_arg(args)))
+    {
+        if (ping_add_target(ping, argr->values[0]) < 0)
+        {
+            perror("realloc");
+            free_args(args);
+            return 1;
+        }
+    }
+
+    if (ping->options.file && ping_read_targets(ping, ping->options.file, argv[0]))
     {
-        printf("%s: destination argument required\n", argv[0]);
         free_args(args);
         return 1;
     }
+    free_args(args);
+
+    /* The targets of a replay are the destinations found in the capture */
+    if (!ping->num_targets && !ping->options.replay)
+    {
+        printf("%s: destination argument required\n", argv[0]);
+        return 1;
+    }
+
+    ping->count = ping->options.count * ping->num_targets;
+    if (output_open(ping) || capture_open(ping))
+        return 1;
+    if (ping_init6(ping, argv[0]) || ping_check_interval(ping, argv[0]))
+        return 1;
 
-    if (set_dest(ping, argr->values[0]))
+    /* A single host is resolved first, to be shown in the header */
+    if (ping->num_targets == 1 && ping->targets[0].state == PING_TARGET_PENDING &&
+        resolve_target(ping, &ping->targets[0]))
     {
         printf("%s: unknown host\n", argv[0]);
-        free_args(args);
         return 1;
     }
-    free_args(args);
+    if (resolver_start(ping) || monitor_start(ping))
+        return 1;
+
     return 0;
 }
@@ -0,0 +1,167 @@
+#include "ft_ping.h"
+
+/**
+ * Waits with pselect(), the portable fallback.
+ *
+ * The descriptor set is rebuilt on each call, which is cheap with a single
+ * socket but does not scale to more.
+ *
+ * @param ping The PING structure.
+ * @param until The monotonic date of the next send in nanoseconds, 0 to poll.
+ * @return Returns 0 on success, or 1 on failure.
+ */
+static int select_wait(PING *ping, uint64_t until)
+{
+    fd_set fdset;
+    struct timespec timeout;
+
+    FD_ZERO(&fdset);
+    FD_SET(ping->fd, &fdset);
+    if (ping->fd6 >= 0)
+        FD_SET(ping->fd6, &fdset);
+    calculate_timeout(&timeout, until, 0);
+
+    int result = pselect((ping->fd > ping->fd6 ? ping->fd : ping->fd6) + 1, &fdset, NULL, NULL, &timeout, NULL);
+    if (result < 0 && errno != EINTR)
+    {
+        perror("pselect");
+        return 1;
+    }
+    if (result > 0 && FD_ISSET(ping->fd, &fdset) && recv_packets(ping, ping->fd, &ping->rx))
+        return 1;
+    if (result > 0 && ping->fd6 >= 0 && FD_ISSET(ping->fd6, &fdset))
+        return recv_packets(ping, ping->fd6, &ping->rx);
+
+    return 0;
+}
+
+static int select_init(__attribute__((__unused__)) PING *ping)
+{
+    return 0;
+}
+
+static void select_free(__attribute__((__unused__)) PING *ping)
+{
+}
+
+/**
+ * Sets up an epoll instance watching the sockets and a timerfd.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 if epoll is unavailable.
+ */
+static int epoll_init(PING *ping)
+{
+    struct epoll_event event = {.events = EPOLLIN};
+
+    ping->loop_fd = epoll_create1(EPOLL_CLOEXEC);
+    ping->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    ping->timer_armed = 0;
+    if (ping->loop_fd < 0 || ping->timer_fd < 0)
+        return 1;
+
+    event.data.fd = ping->fd;
+    if (epoll_ctl(ping->loop_fd, EPOLL_CTL_ADD, ping->fd, &event) < 0)
+        return 1;
+    event.data.fd = ping->fd6;
+    if (ping->fd6 >= 0 && epoll_ctl(ping->loop_fd, EPOLL_CTL_ADD, ping->fd6, &event) < 0)
+        return 1;
+    event.data.fd = ping->timer_fd;
+    if (epoll_ctl(ping->loop_fd, EPOLL_CTL_ADD, ping->timer_fd, &event) < 0)
+        return 1;
+
+    return 0;
+}
+
+/**
+ * Waits with epoll, the timer firing at the date of the next send.
+ *
+ * The timer is set with an absolute date, and only when that date changes,
+ * so a steady stream of replies costs a single syscall per wakeup. Dates
+ * already passed do not arm it at all.
+ *
+ * @param ping The PING structure.
+ * @param until The monotonic date of the next send in nanoseconds, 0 to poll.
+ * @return Returns 0 on success, or 1 on failure.
+ */
+static int epoll_wait_until(PING *ping, uint64_t until)
+{
+    struct epoll_event events[3];
+    int timeout = -1;
+
+    if (until <= now_ns())
+        timeout = 0;
+    else if (until != ping->timer_armed)
+    {
+        struct itimerspec its = {
+            .it_value = {.tv_sec = until / 1000000000, .tv_nsec = until % 1000000000},
+        };
+
+        if (timerfd_settime(ping->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        {
+            perror("timerfd_settime");
+            return 1;
+        }
+        ping->timer_armed = until;
+    }
+
+    int result = epoll_wait(ping->loop_fd, events, 3, timeout);
+    if (result < 0 && errno != EINTR)
+    {
+        perror("epoll_wait");
+        return 1;
+    }
+
+    for (int i = 0; i < result; i++)
+    {
+        if (events[i].data.fd == ping->timer_fd)
+        {
+            uint64_t expirations;
+
+            if (read(ping->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+                return 1;
+            ping->timer_armed = 0;
+        }
+        else if (recv_packets(ping, events[i].data.fd, &ping->rx))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void epoll_free(PING *ping)
+{
+    if (ping->loop_fd >= 0)
+        close(ping->loop_fd);
+    if (ping->timer_fd >= 0)
+        close(ping->timer_fd);
+    ping->loop_fd = -1;
+    ping->timer_fd = -1;
+}
+
+/**
+ * @brief The event loop backends, the first one being the default.
+ */
+const t_ping_evloop ping_evloops[] = {
+    {"epoll", epoll_init, epoll_wait_until, epoll_free},
+    {"io_uring", uring_init, uring_wait, uring_free},
+    {"select", select_init, select_wait, select_free},
+    {NULL, NULL, NULL, NULL}};
+
+/**
+ * Looks an event loop backend up by name.
+ *
+ * @param name The name of the backend, NULL for the default one.
+ * @return The backend, or NULL if there is none with that name.
+ */
+const t_ping_evloop *evloop_find(const char *name)
+{
+    if (!name)
+        return &ping_evloops[0];
+
+    for (const t_ping_evloop *evloop = ping_evloops; evloop->name; evloop++)
+        if (!strcmp(evloop->name, name))
+            return evloop;
+
+    return NULL;
+}
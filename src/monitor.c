@@ -0,0 +1,462 @@
+#include "ft_ping.h"
+
+/**
+ * Sums the counters of all the targets and copies the round-trip times of the run.
+ *
+ * Each target is read under its lock while receivers update it. The
+ * histogram of the run is recorded into without one, so it may count a
+ * few more replies than the counters do.
+ *
+ * @param ping The PING structure.
+ * @param snap The snapshot to fill.
+ */
+static void take_snapshot(PING *ping, t_ping_snapshot *snap)
+{
+    snap->time = now_ns();
+    snap->sent = 0;
+    snap->received = 0;
+    hist_copy(&snap->hist, &ping->hist);
+
+    for (size_t i = 0; i < ping->num_targets; i++)
+    {
+        t_ping_target *target = &ping->targets[i];
+
+        while (__atomic_test_and_set(&target->lock, __ATOMIC_ACQUIRE))
+            ;
+        snap->sent += __atomic_load_n(&target->num_emit, __ATOMIC_RELAXED);
+        snap->received += target->num_recv - target->num_err;
+        __atomic_clear(&target->lock, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Prints what happened since the previous snapshot.
+ *
+ * Replies still in flight at the end of the interval count as lost in it and
+ * as received in the next one, so loss is only exact over long intervals.
+ *
+ * @param ping The PING structure.
+ * @param prev The previous snapshot, replaced by the current one.
+ * @param start The monotonic date the monitor started at.
+ */
+static void print_interval(PING *ping, t_ping_snapshot *prev, uint64_t start)
+{
+    t_ping_snapshot cur;
+    t_ping_hist hist;
+    char line[512];
+    int len;
+
+    take_snapshot(ping, &cur);
+    hist = cur.hist;
+    hist_diff(&hist, &prev->hist);
+
+    double elapsed = (cur.time - prev->time) / 1000000000.0;
+    double since = (cur.time - start) / 1000000000.0;
+    size_t sent = cur.sent - prev->sent;
+    size_t received = cur.received - prev->received;
+    double loss = sent > received ? (sent - received) * 100.0 / sent : 0.0;
+
+    if (ping->options.output == PING_OUTPUT_JSON)
+    {
+        len = snprintf(line, sizeof(line),
+                       "{\"elapsed\":%.3f,\"interval\":%.3f,\"sent\":%zu,\"received\":%zu,\"loss\":%.3f,"
+                       "\"send_rate\":%.3f,\"recv_rate\":%.3f,\"rtt_ms\":{\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f},"
+                       "\"status\":\"interval\"}\n",
+                       since, elapsed, sent, received, loss, sent / elapsed, received / elapsed,
+                       hist_quantile(&hist, 0.50) / 1000000.0,
+                       hist_quantile(&hist, 0.90) / 1000000.0,
+                       hist_quantile(&hist, 0.99) / 1000000.0);
+        output_write(ping, line, len);
+        output_flush(ping);
+    }
+    else if (!output_to_stdout(ping))
+    {
+        printf("[%.1fs] %zu sent (%.1f/s), %zu received (%.1f/s), %.1f%% loss, "
+               "rtt p50/p90/p99 = %.3f/%.3f/%.3f ms\n",
+               since, sent, sent / elapsed, received, received / elapsed, loss,
+               hist_quantile(&hist, 0.50) / 1000000.0,
+               hist_quantile(&hist, 0.90) / 1000000.0,
+               hist_quantile(&hist, 0.99) / 1000000.0);
+        fflush(stdout);
+    }
+
+    *prev = cur;
+}
+
+/**
+ * Writes a Prometheus label value, escaped.
+ */
+static void metrics_label(FILE *out, const char *str)
+{
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', out);
+        if (*str == '\n')
+            fputs("\\n", out);
+        else
+            fputc(*str, out);
+    }
+}
+
+/**
+ * Writes the metrics of every target in the Prometheus text format.
+ *
+ * @param ping The PING structure.
+ * @param out The stream to write to.
+ */
+static void metrics_write(PING *ping, FILE *out)
+{
+    static const struct
+    {
+        const char *name;
+        const char *help;
+        size_t offset;
+    } counters[] = {
+        {"ping_requests_sent_total", "Echo requests sent.", offsetof(t_ping_target, num_emit)},
+        {"ping_replies_received_total", "Echo replies and errors received.", offsetof(t_ping_target, num_recv)},
+        {"ping_errors_total", "ICMP errors received in reply to echo requests.", offsetof(t_ping_target, num_err)},
+        {"ping_duplicates_total", "Duplicate echo replies.", offsetof(t_ping_target, num_rept)},
+        {"ping_reordered_total", "Echo replies received after a later one.", offsetof(t_ping_target, num_reorder)},
+        {"ping_late_total", "Echo replies too late to be matched.", offsetof(t_ping_target, num_late)},
+        {"ping_timeouts_total", "Echo requests given up on after the reply timeout.", offsetof(t_ping_target, num_lost)},
+    };
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    t_ping_stats stats;
+    t_ping_hist hist;
+
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", counters[c].name, counters[c].help, counters[c].name);
+        for (size_t i = 0; i < ping->num_targets; i++)
+        {
+            t_ping_target *target = &ping->targets[i];
+
+            if (__atomic_load_n(&target->state, __ATOMIC_ACQUIRE) != PING_TARGET_READY)
+                continue;
+            fprintf(out, "%s{target=\"", counters[c].name);
+            metrics_label(out, target->hostname);
+            fprintf(out, "\",addr=\"%s\"} %zu\n", target->addr,
+                    __atomic_load_n((size_t *)((char *)target + counters[c].offset), __ATOMIC_RELAXED));
+        }
+    }
+
+    fprintf(out, "# HELP ping_rtt_seconds Round-trip time of the echo replies.\n# TYPE ping_rtt_seconds summary\n");
+    for (size_t i = 0; i < ping->num_targets; i++)
+    {
+        t_ping_target *target = &ping->targets[i];
+
+        if (__atomic_load_n(&target->state, __ATOMIC_ACQUIRE) != PING_TARGET_READY)
+            continue;
+        while (__atomic_test_and_set(&target->lock, __ATOMIC_ACQUIRE))
+            ;
+        stats = target->stats;
+        if (stats.hist)
+        {
+            hist = *stats.hist;
+            stats.hist = &hist;
+        }
+        __atomic_clear(&target->lock, __ATOMIC_RELEASE);
+
+        /* Targets without a histogram of their own only have a sum and a count */
+        for (size_t q = 0; stats.hist && q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        {
+            fprintf(out, "ping_rtt_seconds{target=\"");
+            metrics_label(out, target->hostname);
+            fprintf(out, "\",addr=\"%s\",quantile=\"%g\"} %.9f\n", target->addr, quantiles[q],
+                    hist_quantile(stats.hist, quantiles[q]) / 1000000000.0);
+        }
+        fprintf(out, "ping_rtt_seconds_sum{target=\"");
+        metrics_label(out, target->hostname);
+        fprintf(out, "\",addr=\"%s\"} %.9f\n", target->addr, stats.mean * stats.count / 1000.0);
+        fprintf(out, "ping_rtt_seconds_count{target=\"");
+        metrics_label(out, target->hostname);
+        fprintf(out, "\",addr=\"%s\"} %lu\n", target->addr, stats.count);
+    }
+
+    hist_copy(&hist, &ping->hist);
+    fprintf(out, "# HELP ping_run_rtt_seconds Round-trip time of the echo replies of all the targets.\n"
+                 "# TYPE ping_run_rtt_seconds summary\n");
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        fprintf(out, "ping_run_rtt_seconds{quantile=\"%g\"} %.9f\n", quantiles[q],
+                hist_quantile(&hist, quantiles[q]) / 1000000000.0);
+    fprintf(out, "ping_run_rtt_seconds_count %lu\n", hist.count);
+
+    fprintf(out, "# HELP ping_send_calls_total Send system calls.\n# TYPE ping_send_calls_total counter\n"
+                 "ping_send_calls_total %zu\n",
+            __atomic_load_n(&ping->num_send_calls, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP ping_recv_calls_total Receive system calls.\n# TYPE ping_recv_calls_total counter\n"
+                 "ping_recv_calls_total %zu\n",
+            __atomic_load_n(&ping->num_recv_calls, __ATOMIC_RELAXED));
+    fprintf(out, "# HELP ping_recv_packets_total Packets read from the sockets.\n# TYPE ping_recv_packets_total counter\n"
+                 "ping_recv_packets_total %zu\n",
+            __atomic_load_n(&ping->num_recv_packets, __ATOMIC_RELAXED));
+}
+
+/**
+ * Answers a scrape of the metrics endpoint.
+ *
+ * The client has PING_METRICS_TIMEOUT_MS to send its request and to read the
+ * response: a stuck scraper holds the monitor thread up that long at most,
+ * and never the ping loop.
+ *
+ * @param ping The PING structure.
+ */
+static void metrics_serve(PING *ping)
+{
+    struct timeval timeout = {
+        .tv_sec = PING_METRICS_TIMEOUT_MS / 1000,
+        .tv_usec = PING_METRICS_TIMEOUT_MS % 1000 * 1000,
+    };
+    char request[1024];
+    char *body = NULL;
+    size_t bodylen = 0;
+    FILE *out;
+    ssize_t n;
+    int fd;
+
+    fd = accept4(ping->metrics_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    n = recv(fd, request, sizeof(request) - 1, 0);
+    if (n <= 0 || !(out = open_memstream(&body, &bodylen)))
+    {
+        close(fd);
+        return;
+    }
+    request[n] = '\0';
+
+    if (!strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET / ", 6))
+    {
+        metrics_write(ping, out);
+        fflush(out);
+        dprintf(fd, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                    "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                bodylen);
+        for (size_t done = 0; done < bodylen; done += n)
+            if ((n = send(fd, body + done, bodylen - done, MSG_NOSIGNAL)) <= 0)
+                break;
+    }
+    else
+        dprintf(fd, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+
+    fclose(out);
+    free(body);
+    close(fd);
+}
+
+/**
+ * Removes the Unix socket a killed run left behind at an address.
+ *
+ * The socket is only stale if nothing accepts connections on it anymore,
+ * so the endpoint of a run still going is never taken over.
+ *
+ * @param addr The address of the socket.
+ */
+static void metrics_unlink_stale(const struct sockaddr_un *addr)
+{
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return;
+    if (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) < 0 && errno == ECONNREFUSED)
+        unlink(addr->sun_path);
+    close(fd);
+}
+
+/**
+ * Opens the listening socket of the metrics endpoint.
+ *
+ * An address containing a '/' is the path of a Unix socket, which replaces
+ * a stale one left by a killed run. Otherwise it is
+ * a port, optionally preceded by the host to listen on, the loopback address
+ * by default.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 if the address could not be listened on.
+ */
+static int metrics_open(PING *ping)
+{
+    const char *address = ping->options.metrics;
+    const char *port = strrchr(address, ':');
+    char host[INET6_ADDRSTRLEN + 2] = "127.0.0.1";
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE | AI_NUMERICSERV};
+    struct addrinfo *res;
+    int on = 1;
+
+    if (strchr(address, '/'))
+    {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+        if (strlen(address) >= sizeof(addr.sun_path))
+        {
+            printf("%s: %s: %s\n", ping->progname, address, strerror(ENAMETOOLONG));
+            return 1;
+        }
+        strcpy(addr.sun_path, address);
+        metrics_unlink_stale(&addr);
+        ping->metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (ping->metrics_fd < 0 || bind(ping->metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(ping->metrics_fd, SOMAXCONN) < 0)
+        {
+            printf("%s: %s: %s\n", ping->progname, address, strerror(errno));
+            if (ping->metrics_fd >= 0)
+                close(ping->metrics_fd);
+            ping->metrics_fd = -1;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (port)
+    {
+        size_t len = port - address;
+
+        /* Brackets around an IPv6 address */
+        if (len >= 2 && address[0] == '[' && address[len - 1] == ']')
+        {
+            address++;
+            len -= 2;
+        }
+        if (len >= sizeof(host))
+            len = sizeof(host) - 1;
+        memcpy(host, address, len);
+        host[len] = '\0';
+        port++;
+    }
+    else
+        port = address;
+
+    if (getaddrinfo(*host ? host : NULL, port, &hints, &res))
+    {
+        printf("%s: invalid metrics address: '%s'\n", ping->progname, ping->options.metrics);
+        return 1;
+    }
+    ping->metrics_fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ping->metrics_fd < 0 ||
+        setsockopt(ping->metrics_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(ping->metrics_fd, res->ai_addr, res->ai_addrlen) < 0 ||
+        listen(ping->metrics_fd, SOMAXCONN) < 0)
+    {
+        printf("%s: %s: %s\n", ping->progname, ping->options.metrics, strerror(errno));
+        if (ping->metrics_fd >= 0)
+            close(ping->metrics_fd);
+        ping->metrics_fd = -1;
+        freeaddrinfo(res);
+        return 1;
+    }
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/**
+ * Prints the interval summaries and serves the metrics endpoint.
+ *
+ * Both only read the targets, under their lock, from this thread of their
+ * own: a slow terminal or scraper never delays the ping loop.
+ */
+static void *monitor_thread(void *arg)
+{
+    PING *ping = arg;
+    struct pollfd pfd[2] = {
+        {.fd = ping->monitor_fd, .events = POLLIN},
+        {.fd = ping->metrics_fd, .events = POLLIN},
+    };
+    /* The TTL sweep prints its hops every interval instead */
+    uint64_t summary = ping->options.trace ? 0 : ping->options.summary;
+    t_ping_snapshot prev;
+    uint64_t start, next;
+
+    take_snapshot(ping, &prev);
+    start = prev.time;
+    next = start + summary;
+
+    for (;;)
+    {
+        int timeout = -1;
+        uint64_t now = now_ns();
+
+        if (summary)
+            timeout = next > now ? (next - now + 999999) / 1000000 : 0;
+        if (poll(pfd, 2, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if (pfd[0].revents)
+            break;
+        if (pfd[1].revents)
+            metrics_serve(ping);
+
+        if (summary && now_ns() >= next)
+        {
+            print_interval(ping, &prev, start);
+            /* Intervals missed while the system was suspended are skipped */
+            while (next <= prev.time)
+                next += summary;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Starts the monitor thread, when interval summaries or metrics are asked for.
+ *
+ * @param ping The PING structure, with all its targets added.
+ * @return Returns 0 on success, or 1 if the thread could not be started.
+ */
+int monitor_start(PING *ping)
+{
+    int error;
+
+    if ((!ping->options.summary || ping->options.trace) && !ping->options.metrics)
+        return 0;
+
+    if (ping->options.metrics && metrics_open(ping))
+        return 1;
+    ping->monitor_fd = eventfd(0, EFD_CLOEXEC);
+    if (ping->monitor_fd < 0)
+    {
+        perror("eventfd");
+        return 1;
+    }
+
+    error = pthread_create(&ping->monitor, NULL, monitor_thread, ping);
+    if (error)
+    {
+        fprintf(stderr, "pthread_create: %s\n", strerror(error));
+        return 1;
+    }
+    ping->monitoring = true;
+
+    return 0;
+}
+
+/**
+ * Stops the monitor thread and closes the metrics endpoint.
+ *
+ * @param ping The PING structure.
+ */
+void monitor_stop(PING *ping)
+{
+    if (ping->monitoring)
+    {
+        eventfd_write(ping->monitor_fd, 1);
+        pthread_join(ping->monitor, NULL);
+        ping->monitoring = false;
+    }
+    if (ping->monitor_fd >= 0)
+        close(ping->monitor_fd);
+    ping->monitor_fd = -1;
+    if (ping->metrics_fd >= 0)
+    {
+        if (strchr(ping->options.metrics, '/'))
+            unlink(ping->options.metrics);
+        close(ping->metrics_fd);
+    }
+    ping->metrics_fd = -1;
+}
@@ -0,0 +1,487 @@
+#include "ft_ping.h"
+
+_Static_assert(sizeof(t_ping_record) == 48, "binary records have a fixed size");
+_Static_assert(sizeof(t_ping_rec_header) == 32, "the header keeps records aligned");
+
+/**
+ * Room kept in the buffer for a JSON line, more than the longest one.
+ */
+#define PING_OUT_LINE_MAX (6 * HOST_NAME_MAX + 512)
+
+/**
+ * Writes the pending records out, with as many calls as partial writes need.
+ *
+ * Text lines printed with stdio are flushed first, so that they keep their
+ * place among the records when both go to the standard output.
+ */
+static void writer_flush(t_ping_writer *out, uint64_t now)
+{
+    size_t done = 0;
+
+    if (out->fd == STDOUT_FILENO)
+        fflush(stdout);
+    while (done < out->len)
+    {
+        ssize_t n = write(out->fd, out->buf + done, out->len - done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            perror("write");
+            break;
+        }
+        done += n;
+    }
+    out->len = 0;
+    out->flushed = now;
+    __atomic_store_n(&out->due, 0, __ATOMIC_RELAXED);
+}
+
+static void writer_lock(PING *ping)
+{
+    if (ping->shared)
+        while (__atomic_test_and_set(&ping->out.lock, __ATOMIC_ACQUIRE))
+            ;
+}
+
+static void writer_unlock(PING *ping)
+{
+    if (ping->shared)
+        __atomic_clear(&ping->out.lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Makes room for a record of a given size, writing the buffer out if needed.
+ *
+ * The first record after a write sets the date the loops write it out by,
+ * should no later record come to do it.
+ */
+static char *writer_reserve(t_ping_writer *out, size_t len, uint64_t now)
+{
+    if (out->len + len > PING_OUT_BUFSIZE)
+        writer_flush(out, now);
+    if (!out->len)
+        __atomic_store_n(&out->due, now_ns() + PING_OUT_FLUSH_NS, __ATOMIC_RELAXED);
+    return out->buf + out->len;
+}
+
+/**
+ * Appends a string to a JSON line, quoted and escaped.
+ */
+static size_t json_string(char *buf, const char *str)
+{
+    size_t len = 0;
+
+    buf[len++] = '"';
+    for (; *str; str++)
+    {
+        unsigned char c = *str;
+
+        if (c == '"' || c == '\\')
+        {
+            buf[len++] = '\\';
+            buf[len++] = c;
+        }
+        else if (c < 0x20)
+            len += sprintf(buf + len, "\\u%04x", c);
+        else
+            buf[len++] = c;
+    }
+    buf[len++] = '"';
+    return len;
+}
+
+/**
+ * Formats the source address of a record, IPv4-mapped ones as plain IPv4.
+ */
+static const char *record_addr(const t_ping_record *rec, char *buf)
+{
+    if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)rec->from))
+        return inet_ntop(AF_INET, rec->from + 12, buf, INET6_ADDRSTRLEN);
+    return inet_ntop(AF_INET6, rec->from, buf, INET6_ADDRSTRLEN);
+}
+
+static const char *record_status(const t_ping_record *rec)
+{
+    if (rec->flags & PING_REC_DUP)
+        return "dup";
+    if (rec->flags & PING_REC_LATE)
+        return "late";
+    if (rec->type == ICMP_DEST_UNREACH)
+        return "unreachable";
+    if (rec->type == ICMP_TIME_EXCEEDED)
+        return "time_exceeded";
+    if (rec->flags & PING_REC_ERROR)
+        return "error";
+    if (rec->flags & PING_REC_REORDER)
+        return "reordered";
+    return "reply";
+}
+
+/**
+ * Sets up the writer of the records, when they are asked for.
+ *
+ * A binary stream starts with a header describing the records, which all
+ * have the same size so that a file of them can be mapped as an array.
+ *
+ * @param ping The PING structure, with all its targets added.
+ * @return Returns 0 on success, or 1 if the output file could not be opened.
+ */
+int output_open(PING *ping)
+{
+    t_ping_writer *out = &ping->out;
+    struct timespec ts;
+
+    if (ping->options.output == PING_OUTPUT_TEXT)
+        return 0;
+
+    out->fd = STDOUT_FILENO;
+    if (ping->options.output_file)
+    {
+        out->fd = open(ping->options.output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (out->fd < 0)
+        {
+            printf("%s: %s: %s\n", ping->progname, ping->options.output_file, strerror(errno));
+            return 1;
+        }
+    }
+    out->buf = malloc(PING_OUT_BUFSIZE);
+    if (!out->buf)
+    {
+        perror("malloc");
+        return 1;
+    }
+    out->len = 0;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    out->flushed = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+    if (ping->options.output == PING_OUTPUT_BINARY)
+    {
+        t_ping_rec_header header = {
+            .version = PING_REC_VERSION,
+            .record_size = sizeof(t_ping_record),
+            .start_ns = out->flushed,
+            .num_targets = ping->num_targets,
+        };
+
+        memcpy(header.magic, PING_REC_MAGIC, sizeof(header.magic));
+        memcpy(writer_reserve(out, sizeof(header), out->flushed), &header, sizeof(header));
+        out->len = sizeof(header);
+    }
+
+    return 0;
+}
+
+/**
+ * Tells whether the records replace the text output on the standard output.
+ *
+ * @param ping The PING structure.
+ * @return true if records are written to the standard output.
+ */
+bool output_to_stdout(PING *ping)
+{
+    return ping->options.output != PING_OUTPUT_TEXT && !ping->options.output_file;
+}
+
+/**
+ * Fills the receipt time and the source address of a record.
+ *
+ * @param rec The record.
+ * @param from The sockaddr_in or sockaddr_in6 the reply came from.
+ * @param rx The kernel timestamps of the reply, or NULL if it was not stamped.
+ */
+void output_record(t_ping_record *rec, const void *from, t_ping_stamp *rx)
+{
+    const struct sockaddr *sa = from;
+
+    if (rx && rx->sw)
+        rec->time_ns = rx->sw;
+    else
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+        rec->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+
+    if (sa->sa_family == AF_INET6)
+        memcpy(rec->from, &((const struct sockaddr_in6 *)from)->sin6_addr, 16);
+    else
+    {
+        memset(rec->from, 0, 10);
+        memset(rec->from + 10, 0xff, 2);
+        memcpy(rec->from + 12, &((const struct sockaddr_in *)from)->sin_addr, 4);
+    }
+}
+
+/**
+ * Appends a reply to the records.
+ *
+ * Records are only buffered: the buffer is written out once full, or once
+ * a second went by since the last write, which keeps a single write() for
+ * thousands of replies when flooding and a live stream otherwise. When no
+ * reply comes to write them, output_tick() does.
+ *
+ * @param ping The PING structure.
+ * @param rec The reply.
+ */
+void output_reply(PING *ping, t_ping_record *rec)
+{
+    t_ping_writer *out = &ping->out;
+
+    writer_lock(ping);
+    if (ping->options.output == PING_OUTPUT_BINARY)
+    {
+        memcpy(writer_reserve(out, sizeof(*rec), rec->time_ns), rec, sizeof(*rec));
+        out->len += sizeof(*rec);
+    }
+    else
+    {
+        char *line = writer_reserve(out, PING_OUT_LINE_MAX, rec->time_ns);
+        char addr[INET6_ADDRSTRLEN];
+        size_t len;
+
+        len = sprintf(line, "{\"time\":%lu.%06lu,\"target\":",
+                      rec->time_ns / 1000000000, rec->time_ns % 1000000000 / 1000);
+        len += json_string(line + len, ping->targets[rec->target].hostname);
+        len += sprintf(line + len, ",\"from\":\"%s\",\"seq\":%u,\"type\":%u,\"code\":%u,\"ttl\":%u,\"bytes\":%u,",
+                       record_addr(rec, addr), rec->seq, rec->type, rec->code, rec->ttl, rec->size);
+        if (rec->rtt_ns >= 0)
+            len += sprintf(line + len, "\"rtt_ms\":%.6f,", rec->rtt_ns / 1000000.0);
+        else
+            len += sprintf(line + len, "\"rtt_ms\":null,");
+        len += sprintf(line + len, "\"status\":\"%s\"}\n", record_status(rec));
+        out->len += len;
+    }
+    if (rec->time_ns > out->flushed && rec->time_ns - out->flushed >= PING_OUT_FLUSH_NS)
+        writer_flush(out, rec->time_ns);
+    writer_unlock(ping);
+}
+
+/**
+ * Appends round-trip statistics to a JSON line, as an rtt_ms object if there are any.
+ *
+ * Percentiles are only there when the statistics keep a histogram.
+ */
+static size_t json_rtt(char *buf, t_ping_stats *stats)
+{
+    size_t len;
+
+    if (!stats->count)
+        return 0;
+    len = sprintf(buf, ",\"rtt_ms\":{\"min\":%.6f,\"avg\":%.6f,\"max\":%.6f,\"stddev\":%.6f",
+                  stats->min, stats->mean, stats->max, stddev_stats(stats));
+    if (stats->hist)
+        len += sprintf(buf + len, ",\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f,\"p999\":%.6f",
+                       hist_quantile(stats->hist, 0.50) / 1000000.0,
+                       hist_quantile(stats->hist, 0.90) / 1000000.0,
+                       hist_quantile(stats->hist, 0.99) / 1000000.0,
+                       hist_quantile(stats->hist, 0.999) / 1000000.0);
+    return len + sprintf(buf + len, "}");
+}
+
+/**
+ * Appends the statistics of every target to JSON records, one line each.
+ *
+ * Binary records carry no summary, it is derived from the records.
+ *
+ * @param ping The PING structure.
+ */
+void output_summary(PING *ping)
+{
+    t_ping_writer *out = &ping->out;
+
+    if (ping->options.output != PING_OUTPUT_JSON)
+        return;
+
+    for (size_t i = 0; i < ping->num_targets; i++)
+    {
+        t_ping_target *target = &ping->targets[i];
+        t_ping_stats *stats = &target->stats;
+        char *line = writer_reserve(out, PING_OUT_LINE_MAX, out->flushed);
+        size_t received = target->num_recv - target->num_err;
+        size_t len;
+
+        len = sprintf(line, "{\"target\":");
+        len += json_string(line + len, target->hostname);
+        if (target->state == PING_TARGET_FAILED)
+        {
+            len += sprintf(line + len, ",\"status\":\"unknown_host\"}\n");
+            out->len += len;
+            continue;
+        }
+        len += sprintf(line + len, ",\"addr\":\"%s\",\"transmitted\":%zu,\"received\":%zu,"
+                                   "\"duplicates\":%zu,\"errors\":%zu,\"reordered\":%zu,\"late\":%zu,\"timed_out\":%zu,"
+                                   "\"loss\":%.3f",
+                       target->addr, target->num_emit, received, target->num_rept, target->num_err,
+                       target->num_reorder, target->num_late, target->num_lost,
+                       target->num_emit ? (target->num_emit - received) * 100.0 / target->num_emit : 0.0);
+        len += json_rtt(line + len, stats);
+        len += sprintf(line + len, ",\"status\":\"summary\"}\n");
+        out->len += len;
+    }
+}
+
+/**
+ * Appends the result of the path MTU search of a target to JSON records.
+ *
+ * Binary records only hold replies, the results are left out of them.
+ *
+ * @param ping The PING structure.
+ * @param target The target.
+ * @param pmtu Its search, once over.
+ */
+void output_pmtu(PING *ping, t_ping_target *target, t_ping_pmtu *pmtu)
+{
+    t_ping_writer *out = &ping->out;
+    size_t hdr = target->dest.ss_family == AF_INET6 ? sizeof(struct ip6_hdr) : sizeof(struct ip);
+    const char *status = "pmtu";
+    char *line;
+    size_t len;
+
+    if (ping->options.output != PING_OUTPUT_JSON)
+        return;
+
+    if (pmtu->error)
+        status = "error";
+    else if (pmtu->type == ICMP_DEST_UNREACH)
+        status = "unreachable";
+    else if (pmtu->type == ICMP_TIME_EXCEEDED)
+        status = "time_exceeded";
+    else if (!pmtu->answered)
+        status = "no_reply";
+
+    writer_lock(ping);
+    line = writer_reserve(out, PING_OUT_LINE_MAX, out->flushed);
+    len = sprintf(line, "{\"target\":");
+    len += json_string(line + len, target->hostname);
+    len += sprintf(line + len, ",\"addr\":\"%s\",\"probes\":%zu,", target->addr, target->num_emit);
+    if (pmtu->route)
+        len += sprintf(line + len, "\"route_mtu\":%u,", pmtu->route);
+    if (!strcmp(status, "pmtu"))
+        len += sprintf(line + len, "\"pmtu\":%u,\"data_bytes\":%zu,", pmtu->ok,
+                       pmtu->ok - hdr - sizeof(struct icmphdr));
+    if (!strcmp(status, "pmtu") && pmtu->unanswered)
+        len += sprintf(line + len, "\"unanswered\":%u,", pmtu->unanswered);
+    else if (pmtu->type)
+        len += sprintf(line + len, "\"from\":\"%s\",\"type\":%u,\"code\":%u,", pmtu->from, pmtu->type,
+                       pmtu->code);
+    len += sprintf(line + len, "\"status\":\"%s\"}\n", status);
+    out->len += len;
+    writer_unlock(ping);
+}
+
+/**
+ * Appends the statistics of a hop of the TTL sweep to JSON records.
+ *
+ * Binary records only hold replies, the hops are left out of them.
+ *
+ * @param ping The PING structure.
+ * @param target The target.
+ * @param ttl The hop, counted from 1.
+ * @param hop Its statistics.
+ * @param rounds The rounds sent so far.
+ */
+void output_hop(PING *ping, t_ping_target *target, int ttl, t_ping_hop *hop, size_t rounds)
+{
+    t_ping_writer *out = &ping->out;
+    const char *status = "hop";
+    char *line;
+    size_t len;
+
+    if (ping->options.output != PING_OUTPUT_JSON)
+        return;
+
+    if (!hop->received)
+        status = "no_reply";
+    else if (hop->type == ICMP_ECHOREPLY)
+        status = "reached";
+    else if (hop->type == ICMP_DEST_UNREACH)
+        status = "unreachable";
+
+    writer_lock(ping);
+    line = writer_reserve(out, PING_OUT_LINE_MAX, out->flushed);
+    len = sprintf(line, "{\"target\":");
+    len += json_string(line + len, target->hostname);
+    len += sprintf(line + len, ",\"addr\":\"%s\",\"rounds\":%zu,\"hop\":%d,", target->addr, rounds, ttl);
+    if (hop->received)
+        len += sprintf(line + len, "\"from\":\"%s\",\"type\":%u,\"code\":%u,", hop->from, hop->type, hop->code);
+    len += sprintf(line + len, "\"sent\":%zu,\"received\":%zu,\"loss\":%.3f", hop->sent, hop->received,
+                   hop->sent ? (hop->sent - hop->received) * 100.0 / hop->sent : 0.0);
+    if (hop->received)
+        len += sprintf(line + len, ",\"last_ms\":%.6f", hop->last);
+    len += json_rtt(line + len, &hop->stats);
+    len += sprintf(line + len, ",\"status\":\"%s\"}\n", status);
+    out->len += len;
+    writer_unlock(ping);
+}
+
+/**
+ * Appends a preformatted record, such as an interval summary.
+ *
+ * @param ping The PING structure.
+ * @param data The record.
+ * @param len The size of the record, at most PING_OUT_BUFSIZE.
+ */
+void output_write(PING *ping, const char *data, size_t len)
+{
+    t_ping_writer *out = &ping->out;
+
+    writer_lock(ping);
+    memcpy(writer_reserve(out, len, out->flushed), data, len);
+    out->len += len;
+    writer_unlock(ping);
+}
+
+/**
+ * Writes out the records still buffered.
+ *
+ * @param ping The PING structure.
+ */
+void output_flush(PING *ping)
+{
+    if (!ping->out.buf)
+        return;
+    writer_lock(ping);
+    writer_flush(&ping->out, ping->out.flushed);
+    writer_unlock(ping);
+}
+
+/**
+ * Writes out the records buffered for PING_OUT_FLUSH_NS, when no later reply did.
+ *
+ * Called by the loops each time they wake up, which they do by the date
+ * the records are due, so that records still go out when replies stop.
+ *
+ * @param ping The PING structure.
+ * @param now The current monotonic date in nanoseconds.
+ */
+void output_tick(PING *ping, uint64_t now)
+{
+    t_ping_writer *out = &ping->out;
+    uint64_t due = __atomic_load_n(&out->due, __ATOMIC_RELAXED);
+    struct timespec ts;
+
+    if (!due || now < due)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    writer_lock(ping);
+    writer_flush(out, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+    writer_unlock(ping);
+}
+
+/**
+ * Writes out the records still buffered and closes the output file.
+ *
+ * @param ping The PING structure.
+ */
+void output_close(PING *ping)
+{
+    output_flush(ping);
+    free(ping->out.buf);
+    ping->out.buf = NULL;
+    if (ping->out.fd > STDERR_FILENO)
+        close(ping->out.fd);
+    ping->out.fd = -1;
+}
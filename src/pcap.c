@@ -0,0 +1,429 @@
+#include "ft_ping.h"
+
+_Static_assert(sizeof(t_ping_pcap_header) == 24, "the pcap header has a fixed size");
+_Static_assert(sizeof(t_ping_pcap_record) == 16, "pcap packet headers have a fixed size");
+
+extern bool g_kill;
+
+/*
+ * Packet capture (-C) and offline replay (-R).
+ *
+ * Every probe sent and every packet received is appended to a pcap file
+ * of raw IP packets, with nanosecond timestamps: the kernel ones with -k,
+ * the time of the send or of the read otherwise. The IP header the kernel
+ * adds to the probes, and strips from what datagram and ICMPv6 sockets
+ * return, is made up from the addresses known, so that any pcap reader
+ * decodes them.
+ *
+ * The file is written through a shared mapping grown by PING_PCAP_CHUNK at
+ * a time, so that capturing costs a copy rather than a syscall per packet,
+ * and cut to its length when closed.
+ *
+ * A replay runs a capture through the receive path, without any socket.
+ */
+
+static uint64_t realtime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The sender thread and the receiver threads all append packets */
+static void capture_lock(PING *ping)
+{
+    if (ping->options.threads)
+        while (__atomic_test_and_set(&ping->cap.lock, __ATOMIC_ACQUIRE))
+            ;
+}
+
+static void capture_unlock(PING *ping)
+{
+    if (ping->options.threads)
+        __atomic_clear(&ping->cap.lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Maps the chunk of the capture file starting at an offset, growing the file by as much.
+ *
+ * Space is allocated up front, so that a full disk fails here rather than
+ * with a SIGBUS when the mapping is written to.
+ *
+ * @return Returns 0 on success, or 1 if capturing has to stop.
+ */
+static int capture_map(t_ping_capture *cap, size_t base)
+{
+    int error;
+
+    if (cap->map)
+        munmap(cap->map, PING_PCAP_CHUNK);
+    cap->map = NULL;
+
+    error = posix_fallocate(cap->fd, base, PING_PCAP_CHUNK);
+    if (error)
+    {
+        fprintf(stderr, "capture: %s\n", strerror(error));
+        return 1;
+    }
+    cap->map = mmap(NULL, PING_PCAP_CHUNK, PROT_READ | PROT_WRITE, MAP_SHARED, cap->fd, base);
+    if (cap->map == MAP_FAILED)
+    {
+        cap->map = NULL;
+        perror("mmap");
+        return 1;
+    }
+    cap->base = base;
+    cap->len = 0;
+    return 0;
+}
+
+/**
+ * Appends bytes to the capture, across chunks if need be.
+ */
+static void capture_copy(t_ping_capture *cap, const void *data, size_t n)
+{
+    while (n && cap->map)
+    {
+        size_t room = PING_PCAP_CHUNK - cap->len;
+
+        if (!room)
+        {
+            capture_map(cap, cap->base + PING_PCAP_CHUNK);
+            continue;
+        }
+        if (room > n)
+            room = n;
+        memcpy(cap->map + cap->len, data, room);
+        cap->len += room;
+        data = (const char *)data + room;
+        n -= room;
+    }
+}
+
+/**
+ * Appends a packet, its IP header and its parts.
+ */
+static void capture_record(PING *ping, uint64_t time, const void *hdr, size_t hdrlen,
+                           const struct iovec *iov, size_t iovcnt)
+{
+    t_ping_pcap_record rec;
+    size_t len = hdrlen;
+
+    for (size_t i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+    rec.ts_sec = time / 1000000000;
+    rec.ts_frac = time % 1000000000;
+    rec.caplen = len;
+    rec.len = len;
+
+    capture_lock(ping);
+    capture_copy(&ping->cap, &rec, sizeof(rec));
+    capture_copy(&ping->cap, hdr, hdrlen);
+    for (size_t i = 0; i < iovcnt; i++)
+        capture_copy(&ping->cap, iov[i].iov_base, iov[i].iov_len);
+    capture_unlock(ping);
+}
+
+/**
+ * Makes up the IP header of an ICMP message, the kernel's own being out of reach.
+ *
+ * Only one of the addresses is known, the local one is left unspecified.
+ *
+ * @param buf Room for an IPv6 header.
+ * @param src The source address, or NULL for a probe.
+ * @param dst The destination address, or NULL for a reply.
+ * @param ttl The time to live or hop limit, 0 if unknown.
+ * @param len The size of the ICMP message.
+ * @return The size of the header.
+ */
+static size_t capture_ip_header(void *buf, const void *src, const void *dst, int ttl, size_t len)
+{
+    const struct sockaddr *sa = src ? src : dst;
+
+    if (sa->sa_family == AF_INET6)
+    {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)buf;
+
+        memset(ip6, 0, sizeof(*ip6));
+        ip6->ip6_flow = htonl(6 << 28);
+        ip6->ip6_plen = htons(len);
+        ip6->ip6_nxt = IPPROTO_ICMPV6;
+        ip6->ip6_hlim = ttl > 0 ? ttl : 0;
+        if (src)
+            ip6->ip6_src = ((const struct sockaddr_in6 *)src)->sin6_addr;
+        if (dst)
+            ip6->ip6_dst = ((const struct sockaddr_in6 *)dst)->sin6_addr;
+        return sizeof(*ip6);
+    }
+
+    struct ip *ip = (struct ip *)buf;
+
+    memset(ip, 0, sizeof(*ip));
+    ip->ip_v = 4;
+    ip->ip_hl = sizeof(*ip) >> 2;
+    ip->ip_len = htons(sizeof(*ip) + len);
+    ip->ip_ttl = ttl > 0 ? ttl : 0;
+    ip->ip_p = IPPROTO_ICMP;
+    if (src)
+        ip->ip_src = ((const struct sockaddr_in *)src)->sin_addr;
+    if (dst)
+        ip->ip_dst = ((const struct sockaddr_in *)dst)->sin_addr;
+    ip->ip_sum = icmp_cksum((uint16_t *)ip, sizeof(*ip));
+    return sizeof(*ip);
+}
+
+/**
+ * Appends a probe about to be sent to the capture.
+ *
+ * @param ping The PING structure.
+ * @param msg The message of the probe, its TTL taken from its ancillary data if set there.
+ */
+void capture_sent(PING *ping, struct msghdr *msg)
+{
+    uint32_t hdr[sizeof(struct ip6_hdr) / sizeof(uint32_t)];
+    int ttl = ping->options.ttl;
+    size_t len = 0;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+        if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_TTL) ||
+            (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_HOPLIMIT))
+            memcpy(&ttl, CMSG_DATA(cmsg), sizeof(ttl));
+    for (size_t i = 0; i < msg->msg_iovlen; i++)
+        len += msg->msg_iov[i].iov_len;
+
+    capture_record(ping, realtime_ns(), hdr, capture_ip_header(hdr, NULL, msg->msg_name, ttl, len),
+                   msg->msg_iov, msg->msg_iovlen);
+}
+
+/**
+ * Appends a received packet to the capture.
+ *
+ * Raw IPv4 sockets return the IP header, the other ones only the ICMP message.
+ *
+ * @param ping The PING structure.
+ * @param from The address the packet was received from.
+ * @param packet The packet.
+ * @param len The size of the packet.
+ * @param rx The kernel timestamps of the packet.
+ * @param hops The hop limit of an ICMPv6 packet, -1 if unknown.
+ */
+void capture_received(PING *ping, const void *from, const char *packet, size_t len, t_ping_stamp *rx, int hops)
+{
+    struct iovec iov = {.iov_base = (void *)packet, .iov_len = len};
+    uint64_t time = rx && rx->sw ? (uint64_t)rx->sw : realtime_ns();
+    uint32_t hdr[sizeof(struct ip6_hdr) / sizeof(uint32_t)];
+
+    if (((const struct sockaddr *)from)->sa_family == AF_INET && ping->raw)
+        capture_record(ping, time, NULL, 0, &iov, 1);
+    else
+        capture_record(ping, time, hdr, capture_ip_header(hdr, from, NULL, hops, len), &iov, 1);
+}
+
+/**
+ * Creates the capture file, when one is asked for.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 if the file could not be created.
+ */
+int capture_open(PING *ping)
+{
+    t_ping_capture *cap = &ping->cap;
+    t_ping_pcap_header header = {
+        .magic = PING_PCAP_MAGIC_NS,
+        .version_major = 2,
+        .version_minor = 4,
+        .snaplen = IP_MAXPACKET,
+        .linktype = PING_PCAP_LINKTYPE_RAW,
+    };
+
+    if (!ping->options.capture)
+        return 0;
+
+    cap->fd = open(ping->options.capture, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (cap->fd < 0)
+    {
+        printf("%s: %s: %s\n", ping->progname, ping->options.capture, strerror(errno));
+        return 1;
+    }
+    if (capture_map(cap, 0))
+        return 1;
+    capture_copy(cap, &header, sizeof(header));
+    return 0;
+}
+
+/**
+ * Cuts the capture file to the packets written, and closes it.
+ *
+ * @param ping The PING structure.
+ */
+void capture_close(PING *ping)
+{
+    t_ping_capture *cap = &ping->cap;
+
+    if (cap->fd < 0)
+        return;
+    if (cap->map)
+        munmap(cap->map, PING_PCAP_CHUNK);
+    cap->map = NULL;
+    if (ftruncate(cap->fd, cap->base + cap->len) < 0)
+        perror("ftruncate");
+    close(cap->fd);
+    cap->fd = -1;
+}
+
+/**
+ * Replays an echo request: it stands for a probe sent to its destination.
+ *
+ * The destination becomes a target the first time it is seen. Requests
+ * are sent round-robin, so the target after the last one is tried first.
+ */
+static void replay_request(PING *ping, const void *dst, struct icmphdr *icp, uint64_t time, size_t *last)
+{
+    char addr[INET6_ADDRSTRLEN];
+    uint16_t wire_seq = ntohs(icp->un.echo.sequence);
+    size_t i = ping->num_targets ? (*last + 1) % ping->num_targets : 0;
+
+    if (ping->options.family != AF_UNSPEC && ping->options.family != ((const struct sockaddr *)dst)->sa_family)
+        return;
+    format_addr(dst, addr, sizeof(addr));
+    if (i < ping->num_targets && strcmp(ping->targets[i].addr, addr))
+        for (i = 0; i < ping->num_targets && strcmp(ping->targets[i].addr, addr); i++)
+            ;
+    if (i == ping->num_targets && ping_add_target(ping, addr) < 0)
+    {
+        perror("realloc");
+        return;
+    }
+    *last = i;
+
+    /* The wire counter stays just past the last request, as it was when sending */
+    ping->num_emit += (uint16_t)(wire_seq + 1 - ping->num_emit);
+    publish_probe(ping, wire_seq, i, ping->targets[i].num_emit++);
+    ping->inflight[wire_seq].tx.sw = time;
+}
+
+/**
+ * Replays a packet of the capture, a probe sent or a packet received.
+ */
+static void replay_packet(PING *ping, char *data, size_t len, uint64_t time, uint32_t linktype, size_t *last)
+{
+    t_ping_stamp stamp = {.sw = time, .hw = 0};
+
+    if (linktype == PING_PCAP_LINKTYPE_ETHERNET)
+    {
+        if (len < 14 || (ntohs(*(uint16_t *)(data + 12)) != 0x0800 && ntohs(*(uint16_t *)(data + 12)) != 0x86dd))
+            return;
+        data += 14;
+        len -= 14;
+    }
+    if (len < sizeof(struct ip))
+        return;
+
+    if (data[0] >> 4 == 4)
+    {
+        struct ip *ip = (struct ip *)data;
+        struct icmphdr *icp = (struct icmphdr *)(data + (ip->ip_hl << 2));
+        struct sockaddr_in addr = {.sin_family = AF_INET};
+
+        if (ip->ip_p != IPPROTO_ICMP || len < (size_t)(ip->ip_hl << 2) + ICMP_MINLEN)
+            return;
+        if (icp->type == ICMP_ECHO)
+        {
+            addr.sin_addr = ip->ip_dst;
+            replay_request(ping, &addr, icp, time, last);
+            return;
+        }
+        addr.sin_addr = ip->ip_src;
+        process_packet(ping, data, len, &addr, &stamp);
+    }
+    else if (data[0] >> 4 == 6)
+    {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)data;
+        struct icmphdr *icp = (struct icmphdr *)(ip6 + 1);
+        struct sockaddr_in6 addr = {.sin6_family = AF_INET6};
+
+        if (len < sizeof(*ip6) + ICMP_MINLEN || ip6->ip6_nxt != IPPROTO_ICMPV6)
+            return;
+        if (icp->type == ICMP6_ECHO_REQUEST)
+        {
+            addr.sin6_addr = ip6->ip6_dst;
+            replay_request(ping, &addr, icp, time, last);
+            return;
+        }
+        addr.sin6_addr = ip6->ip6_src;
+        process_packet6(ping, (char *)icp, len - sizeof(*ip6), &addr, &stamp, ip6->ip6_hlim);
+    }
+}
+
+/**
+ * Analyses the packets of a capture instead of pinging.
+ *
+ * The file is mapped and read through at disk speed. Echo requests stand
+ * for the probes: they are published in the in-flight table, with their
+ * capture time as transmit timestamp. Every other packet goes through
+ * process_packet() or process_packet6() with its capture time as receive
+ * timestamp, so that replies are matched, timed, printed and counted as
+ * they were live. Raw IP and Ethernet captures are read, in the byte
+ * order of the host.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 if the capture could not be read.
+ */
+int ping_replay(PING *ping)
+{
+    const char *path = ping->options.replay;
+    t_ping_pcap_header *header;
+    struct stat st;
+    size_t off = sizeof(*header);
+    size_t last = 0;
+    char *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        printf("%s: %s: %s\n", ping->progname, path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return 1;
+    }
+    map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("%s: %s: %s\n", ping->progname, path, st.st_size ? strerror(errno) : "empty file");
+        return 1;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    header = (t_ping_pcap_header *)map;
+    if ((size_t)st.st_size < sizeof(*header) ||
+        (header->magic != PING_PCAP_MAGIC_NS && header->magic != PING_PCAP_MAGIC_US) ||
+        (header->linktype != PING_PCAP_LINKTYPE_RAW && header->linktype != PING_PCAP_LINKTYPE_ETHERNET))
+    {
+        printf("%s: %s: not a raw IP or Ethernet pcap file\n", ping->progname, path);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    while (!g_kill && off + sizeof(t_ping_pcap_record) <= (size_t)st.st_size)
+    {
+        t_ping_pcap_record rec;
+        uint64_t time;
+
+        /* Packets follow each other without padding, their headers are not aligned */
+        memcpy(&rec, map + off, sizeof(rec));
+        off += sizeof(rec);
+        time = (uint64_t)rec.ts_sec * 1000000000 +
+               (header->magic == PING_PCAP_MAGIC_NS ? rec.ts_frac : rec.ts_frac * 1000ULL);
+        /* A capture cut short ends with a partial packet */
+        if (rec.caplen > st.st_size - off)
+            break;
+        replay_packet(ping, map + off, rec.caplen, time, header->linktype, &last);
+        off += rec.caplen;
+    }
+
+    munmap(map, st.st_size);
+    return 0;
+}
@@ -0,0 +1,485 @@
+#include "ft_ping.h"
+
+extern bool g_kill;
+
+/*
+ * Path MTU discovery (-P).
+ *
+ * Probes are sent with the DF bit set and without regard to the path MTU
+ * the kernel has cached (IP_PMTUDISC_PROBE), and the largest size that gets
+ * an echo reply is searched for by bisection. The search starts with the
+ * MTU of the route, which most paths support, and a fragmentation needed or
+ * packet too big error gives the MTU of the next hop, which is tried next.
+ * Sizes above the MTU of the local link fail right away with EMSGSIZE, so
+ * the cached path MTU is checked as well without waiting for the network.
+ * Errors are read from the socket error queue (IP_RECVERR), where both raw
+ * and datagram sockets get them along with the probe they quote.
+ *
+ * Every target is searched at the same time, each with one size in flight,
+ * so the sweep takes about as long as the slowest target. The probes in
+ * flight are kept to what the receive buffer holds, as a burst of large
+ * replies would overflow it. A lost reply says nothing of the size of its
+ * probe: only an error or EMSGSIZE rules a size out, and a size that gets
+ * no reply at all ends the search.
+ */
+
+/**
+ * Reads the MTU of the route to a target, the path MTU if the kernel knows it.
+ *
+ * @return The MTU, or 0 if unknown.
+ */
+static uint32_t route_mtu(t_ping_target *target)
+{
+    struct sockaddr_storage dest = target->dest;
+    int v6 = dest.ss_family == AF_INET6;
+    int mtu = 0;
+    socklen_t len = sizeof(mtu);
+    int fd;
+
+    /* Connecting a UDP socket looks the route up without sending anything */
+    fd = socket(dest.ss_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return 0;
+    if (v6)
+        ((struct sockaddr_in6 *)&dest)->sin6_port = htons(9);
+    else
+        ((struct sockaddr_in *)&dest)->sin_port = htons(9);
+    if (connect(fd, (struct sockaddr *)&dest, target->destlen) < 0 ||
+        getsockopt(fd, v6 ? IPPROTO_IPV6 : IPPROTO_IP, v6 ? IPV6_MTU : IP_MTU, &mtu, &len) < 0)
+        mtu = 0;
+    close(fd);
+
+    return mtu > 0 ? mtu : 0;
+}
+
+/**
+ * Prints the result of the search of a target, and appends it to the records.
+ */
+static void pmtu_print(PING *ping, size_t i)
+{
+    t_ping_target *target = &ping->targets[i];
+    t_ping_pmtu *pmtu = &ping->pmtu[i];
+    size_t hdr = target->dest.ss_family == AF_INET6 ? sizeof(struct ip6_hdr) : sizeof(struct ip);
+    /* Probes stop at the size of the template, the path may take more */
+    bool capped = pmtu->ok == hdr + ping->packetlen;
+
+    output_pmtu(ping, target, pmtu);
+    if (output_to_stdout(ping))
+        return;
+
+    printf("%s (%s): ", target->hostname, target->addr);
+    if (pmtu->error)
+        printf("%s", strerror(pmtu->error));
+    else if (pmtu->type)
+        printf("%s from %s", pmtu->type == ICMP_TIME_EXCEEDED ? "Time to live exceeded" : "Destination Host Unreachable",
+               pmtu->from);
+    else if (!pmtu->answered)
+        printf("no reply");
+    else
+        printf("path MTU %s%u, %zu data bytes", capped || pmtu->unanswered ? ">= " : "", pmtu->ok,
+               pmtu->ok - hdr - sizeof(struct icmphdr));
+    if (pmtu->answered && pmtu->unanswered)
+        printf(", no reply to %u", pmtu->unanswered);
+    if (pmtu->route)
+        printf(", route MTU %u", pmtu->route);
+    printf(", %zu probes\n", target->num_emit);
+}
+
+/**
+ * Ends the search of a target.
+ */
+static void pmtu_finish(PING *ping, size_t i)
+{
+    ping->pmtu[i].done = true;
+    ping->pmtu[i].size = 0;
+    pmtu_print(ping, i);
+}
+
+/**
+ * Sets the bounds of the search of a target, once it is resolved.
+ *
+ * The largest size is what the echo request template holds, and the first
+ * probe has the size of the MTU of the route.
+ */
+static void pmtu_start(PING *ping, size_t i)
+{
+    t_ping_target *target = &ping->targets[i];
+    t_ping_pmtu *pmtu = &ping->pmtu[i];
+    int v6 = target->dest.ss_family == AF_INET6;
+    uint32_t min = v6 ? PING_PMTU_MIN6 : PING_PMTU_MIN;
+    uint32_t max = (v6 ? sizeof(struct ip6_hdr) : sizeof(struct ip)) + ping->packetlen;
+
+    pmtu->route = route_mtu(target);
+    pmtu->ok = (min < max ? min : max) - 1;
+    pmtu->bad = max + 1;
+    pmtu->next = pmtu->route && pmtu->route < max ? pmtu->route : max;
+}
+
+/**
+ * Sends a probe of the current size of the search of a target.
+ *
+ * The template is zero-padded, so a prefix of it keeps its checksum: only
+ * the head is rewritten, as for the pings.
+ */
+static void pmtu_send(PING *ping, size_t i, uint64_t now)
+{
+    t_ping_target *target = &ping->targets[i];
+    t_ping_pmtu *pmtu = &ping->pmtu[i];
+    int v6 = target->dest.ss_family == AF_INET6;
+    size_t len = pmtu->size - (v6 ? sizeof(struct ip6_hdr) : sizeof(struct ip));
+    char *head = ping->txbuf;
+    struct iovec iov[2] = {
+        {.iov_base = head, .iov_len = ping->headlen},
+        {.iov_base = ping->packet + ping->headlen, .iov_len = len - ping->headlen},
+    };
+    struct msghdr msg = {
+        .msg_name = &target->dest,
+        .msg_namelen = target->destlen,
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+    };
+    ssize_t sent;
+
+    memcpy(head, ping->packet, ping->headlen);
+    if (v6)
+        stamp_packet6((struct icmphdr *)head, ping->headlen, ping->num_emit);
+    else
+        stamp_packet((struct icmphdr *)head, ping->headlen, ping->num_emit);
+
+    pmtu->wire_seq = ping->num_emit;
+    if (!pmtu->tries)
+        pmtu->first_seq = pmtu->wire_seq;
+    pmtu->deadline = now + ping->options.timeout;
+    publish_probe(ping, ping->num_emit, i, target->num_emit);
+    ping->num_send_calls++;
+    if (ping->cap.fd >= 0)
+        capture_sent(ping, &msg);
+
+    /* An ICMP error is also returned by the next send on the socket, which clears it */
+    sent = sendmsg(v6 ? ping->fd6 : ping->fd, &msg, 0);
+    if (sent < 0 && errno != ENOBUFS)
+        sent = sendmsg(v6 ? ping->fd6 : ping->fd, &msg, 0);
+    if (sent < 0 && errno == EMSGSIZE)
+    {
+        /* Larger than the MTU of the local link, it did not leave */
+        pmtu->bad = pmtu->size;
+        pmtu->size = 0;
+        return;
+    }
+    target->num_emit++;
+    __atomic_store_n(&ping->num_emit, ping->num_emit + 1, __ATOMIC_RELAXED);
+    /* With IP_RECVERR, packets dropped by a local queue are reported too: they are lost */
+    if (sent >= 0 || errno == ENOBUFS)
+        return;
+    pmtu->error = errno;
+    pmtu_finish(ping, i);
+}
+
+/**
+ * Tells whether a probe may leave now, and counts it in flight if so.
+ *
+ * Replies wait in the receive buffer until the loop reads them, so the
+ * probes in flight are kept to the budget it allows, a single one going
+ * whatever its size. The -r rate applies as well.
+ *
+ * @param ping The PING structure.
+ * @param size The size of the probe.
+ * @param budget The bytes that may be in flight.
+ * @param inflight The bytes in flight, updated.
+ * @param now The current monotonic date in nanoseconds.
+ * @return true if the probe may be sent.
+ */
+static bool pmtu_admit(PING *ping, uint32_t size, size_t budget, size_t *inflight, uint64_t now)
+{
+    if (*inflight && *inflight + size > budget)
+        return false;
+    if (!sched_tokens(&ping->sched, now))
+        return false;
+    sched_spend(&ping->sched, 1);
+    *inflight += size;
+    return true;
+}
+
+/**
+ * Sends the next probe of the search of a target, or ends it.
+ *
+ * Sizes the local link cannot send are ruled out on the spot, until a probe
+ * is in flight, there is no room for one or the search is over.
+ */
+static void pmtu_next(PING *ping, size_t i, uint64_t now, size_t budget, size_t *inflight)
+{
+    t_ping_pmtu *pmtu = &ping->pmtu[i];
+    uint32_t size;
+
+    while (!pmtu->size && !pmtu->done)
+    {
+        if (pmtu->bad - pmtu->ok <= 1)
+        {
+            pmtu_finish(ping, i);
+            return;
+        }
+        if (pmtu->next > pmtu->ok && pmtu->next < pmtu->bad)
+            size = pmtu->next;
+        else
+            size = pmtu->ok + (pmtu->bad - pmtu->ok) / 2;
+        if (!pmtu_admit(ping, size, budget, inflight, now))
+            return;
+        pmtu->size = size;
+        pmtu->next = 0;
+        pmtu->tries = 0;
+        pmtu_send(ping, i, now);
+    }
+}
+
+/**
+ * Tells whether a wire sequence is one of the probes of the size in flight.
+ *
+ * A late reply to an earlier probe of the same size counts as well.
+ */
+static bool pmtu_current(t_ping_pmtu *pmtu, uint16_t wire_seq)
+{
+    return pmtu->size && !pmtu->done &&
+           (uint16_t)(wire_seq - pmtu->first_seq) <= (uint16_t)(pmtu->wire_seq - pmtu->first_seq);
+}
+
+/**
+ * Records an echo reply of the path MTU search.
+ *
+ * @param ping The PING structure.
+ * @param target The index of the target.
+ * @param wire_seq The wire sequence number of the reply.
+ */
+void pmtu_reply(PING *ping, uint32_t target, uint16_t wire_seq)
+{
+    t_ping_pmtu *pmtu = &ping->pmtu[target];
+
+    if (!pmtu_current(pmtu, wire_seq))
+        return;
+    pmtu->ok = pmtu->size;
+    pmtu->answered = true;
+    pmtu->size = 0;
+
+    if (ping->shared)
+        while (__atomic_test_and_set(&ping->targets[target].lock, __ATOMIC_ACQUIRE))
+            ;
+    ping->targets[target].num_recv++;
+    if (ping->shared)
+        __atomic_clear(&ping->targets[target].lock, __ATOMIC_RELEASE);
+    PING_ADD(ping->num_recv, 1);
+}
+
+/**
+ * Handles an error queued on a socket, which quotes the probe it is about.
+ *
+ * A router that cannot forward a probe gives the MTU of its next hop. It
+ * becomes the new upper bound and is tried right away, so a path with a
+ * single bottleneck takes two probes. Other errors end the search.
+ */
+static void pmtu_error(PING *ping, int fd, struct msghdr *msg, size_t len)
+{
+    struct icmphdr *echo = msg->msg_iov->iov_base;
+    struct sock_extended_err *ee = NULL;
+    t_ping_probe *probe;
+    t_ping_pmtu *pmtu;
+    bool v6 = fd == ping->fd6;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+        if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+
+    /* Local errors quote nothing, they are returned by sendmsg() as well */
+    if (!ee || len < ICMP_MINLEN || echo->type != (v6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO) ||
+        (ee->ee_origin != SO_EE_ORIGIN_ICMP && ee->ee_origin != SO_EE_ORIGIN_ICMP6))
+        return;
+    if ((v6 ? ping->raw6 : ping->raw) && echo->un.echo.id != htons(ping->ident))
+        return;
+    probe = ping_match_probe(ping, ntohs(echo->un.echo.sequence));
+    if (!probe)
+        return;
+    pmtu = &ping->pmtu[probe->target];
+    if (!pmtu_current(pmtu, ntohs(echo->un.echo.sequence)))
+        return;
+
+    if (v6 ? ee->ee_type == ICMP6_PACKET_TOO_BIG
+           : ee->ee_type == ICMP_DEST_UNREACH && ee->ee_code == ICMP_FRAG_NEEDED)
+    {
+        if (pmtu->size < pmtu->bad)
+            pmtu->bad = pmtu->size;
+        if (ee->ee_info > pmtu->ok && ee->ee_info + 1 < pmtu->bad)
+        {
+            pmtu->bad = ee->ee_info + 1;
+            pmtu->next = ee->ee_info;
+        }
+        pmtu->size = 0;
+        return;
+    }
+
+    if (v6)
+        pmtu->type = ee->ee_type == ICMP6_TIME_EXCEEDED ? ICMP_TIME_EXCEEDED : ICMP_DEST_UNREACH;
+    else
+        pmtu->type = ee->ee_type == ICMP_TIME_EXCEEDED ? ICMP_TIME_EXCEEDED : ICMP_DEST_UNREACH;
+    pmtu->code = ee->ee_code;
+    format_addr(SO_EE_OFFENDER(ee), pmtu->from, sizeof(pmtu->from));
+    PING_ADD(ping->num_err, 1);
+    pmtu_finish(ping, probe->target);
+}
+
+/**
+ * Drains the error queue of a socket.
+ */
+static void pmtu_recv_errors(PING *ping, int fd)
+{
+    struct mmsghdr *msgs;
+    int received;
+
+    do
+    {
+        msgs = rxring_batch(&ping->rx);
+        received = recvmmsg(fd, msgs, PING_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if (received <= 0)
+            return;
+        ping->num_recv_calls++;
+
+        for (int i = 0; i < received; i++)
+            pmtu_error(ping, fd, &msgs[i].msg_hdr, msgs[i].msg_len);
+    } while (received == PING_BATCH);
+}
+
+/**
+ * Sets the DF bit on the probes, asks for the errors they trigger and
+ * makes room for many replies.
+ *
+ * A quarter of the receive buffer getsockopt() reports goes to the replies
+ * in flight. The kernel doubles the SO_RCVBUF asked for to account for
+ * its overhead, so that is half of the room for data, and the other half
+ * leaves room for the overhead of each reply and for the errors queued
+ * along with them.
+ *
+ * @param ping The PING structure.
+ * @param budget Set to the bytes of probes that may be in flight.
+ * @return Returns 0 on success, or 1 on failure.
+ */
+static int pmtu_init(PING *ping, size_t *budget)
+{
+    int probe = IP_PMTUDISC_PROBE;
+    int probe6 = IPV6_PMTUDISC_PROBE;
+    int on = 1;
+    size_t rcvbuf;
+
+    if (ping->fd >= 0 &&
+        (setsockopt(ping->fd, IPPROTO_IP, IP_MTU_DISCOVER, &probe, sizeof(probe)) < 0 ||
+         setsockopt(ping->fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) < 0))
+    {
+        perror("setsockopt");
+        return 1;
+    }
+    if (ping->fd6 >= 0 &&
+        (setsockopt(ping->fd6, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &probe6, sizeof(probe6)) < 0 ||
+         setsockopt(ping->fd6, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on)) < 0))
+    {
+        perror("setsockopt");
+        return 1;
+    }
+
+    *budget = SIZE_MAX;
+    if (ping->fd >= 0 && (rcvbuf = ping_grow_rcvbuf(ping->fd, PING_RCVBUF)) / 4 < *budget)
+        *budget = rcvbuf / 4;
+    if (ping->fd6 >= 0 && (rcvbuf = ping_grow_rcvbuf(ping->fd6, PING_RCVBUF)) / 4 < *budget)
+        *budget = rcvbuf / 4;
+
+    ping->pmtu = calloc(ping->num_targets, sizeof(t_ping_pmtu));
+    if (!ping->pmtu)
+    {
+        perror("calloc");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Runs the path MTU search of every target, until all of them are over or the -w deadline.
+ *
+ * Each target has its next probe sent as soon as the last one is answered,
+ * rejected or timed out, and there is room for it. A size is retried
+ * PING_PMTU_TRIES times before the search gives up on it.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 on failure.
+ */
+int ping_pmtu_loop(PING *ping)
+{
+    struct pollfd pfd[2] = {{.fd = ping->fd, .events = POLLIN}, {.fd = ping->fd6, .events = POLLIN}};
+    size_t left = ping->num_targets;
+    size_t budget, inflight;
+
+    if (pmtu_init(ping, &budget))
+        return 1;
+
+    ping->end = ping->options.deadline ? now_ns() + ping->options.deadline : 0;
+    sched_rate(&ping->sched, ping->options.rate, now_ns());
+    while (!g_kill)
+    {
+        uint64_t now = now_ns();
+        uint64_t until = now + PING_RX_POLL_MS * 1000000ULL;
+        struct timespec timeout;
+
+        if (ping->end && now >= ping->end)
+            break;
+        output_tick(ping, now);
+
+        /* Probes past their deadline are lost, their replies no longer expected */
+        inflight = 0;
+        for (size_t i = 0; i < ping->num_targets; i++)
+            if (ping->pmtu[i].size && !ping->pmtu[i].done && now < ping->pmtu[i].deadline)
+                inflight += ping->pmtu[i].size;
+
+        left = 0;
+        for (size_t i = 0; i < ping->num_targets; i++)
+        {
+            t_ping_pmtu *pmtu = &ping->pmtu[i];
+            int state = __atomic_load_n(&ping->targets[i].state, __ATOMIC_ACQUIRE);
+
+            if (pmtu->done || state == PING_TARGET_FAILED)
+                continue;
+            if (state == PING_TARGET_READY)
+            {
+                if (!pmtu->bad)
+                    pmtu_start(ping, i);
+                if (pmtu->size && now >= pmtu->deadline && pmtu->tries + 1 >= PING_PMTU_TRIES)
+                {
+                    pmtu->unanswered = pmtu->size;
+                    pmtu_finish(ping, i);
+                }
+                else if (pmtu->size && now >= pmtu->deadline &&
+                         pmtu_admit(ping, pmtu->size, budget, &inflight, now))
+                {
+                    pmtu->tries++;
+                    pmtu_send(ping, i, now);
+                }
+                pmtu_next(ping, i, now, budget, &inflight);
+                if (pmtu->size && pmtu->deadline > now && pmtu->deadline < until)
+                    until = pmtu->deadline;
+            }
+            left += !pmtu->done;
+        }
+        if (!left)
+            break;
+        if (ping->sched.cost && ping->sched.credit < ping->sched.cost && sched_refill(&ping->sched) < until)
+            until = sched_refill(&ping->sched);
+
+        calculate_timeout(&timeout, until, 0);
+        if (ppoll(pfd, ping->fd6 >= 0 ? 2 : 1, &timeout, NULL) <= 0)
+            continue;
+        ping->num_wakeups++;
+        for (int i = 0; i < 2; i++)
+        {
+            if (pfd[i].revents & POLLERR)
+                pmtu_recv_errors(ping, pfd[i].fd);
+            if (pfd[i].revents & POLLIN)
+                recv_packets(ping, pfd[i].fd, &ping->rx);
+        }
+    }
+
+    return 0;
+}
@@ -2,8 +2,30 @@
 
 void print_header(PING *ping)
 {
-    printf("PING %s (%s): %ld data bytes",
-           ping->hostname, inet_ntoa(ping->dest.sin_addr), ping->datalen);
+    if (ping->options.replay)
+        printf("REPLAY %s", ping->options.replay);
+    else if (ping->options.pmtu)
+    {
+        if (ping->num_targets == 1)
+            printf("PMTU %s (%s): up to %ld data bytes",
+                   ping->targets[0].hostname, ping->targets[0].addr, ping->datalen);
+        else
+            printf("PMTU %ld targets: up to %ld data bytes", ping->num_targets, ping->datalen);
+    }
+    else if (ping->options.trace)
+    {
+        if (ping->num_targets == 1)
+            printf("TRACE %s (%s): %d hops max, %ld data bytes",
+                   ping->targets[0].hostname, ping->targets[0].addr, ping->options.ttl, ping->datalen);
+        else
+            printf("TRACE %ld targets: %d hops max, %ld data bytes", ping->num_targets, ping->options.ttl,
+                   ping->datalen);
+    }
+    else if (ping->num_targets == 1)
+        printf("PING %s (%s): %ld data bytes",
+               ping->targets[0].hostname, ping->targets[0].addr, ping->datalen);
+    else
+        printf("PING %ld targets: %ld data bytes", ping->num_targets, ping->datalen);
 
     if (ping->options.verbose)
         printf(", id 0x%04x = %d", ping->ident, ping->ident);
@@ -12,25 +34,92 @@ void print_header(PING *ping)
 
 void print_stats(PING *ping)
 {
-    ping->num_recv -= ping->num_err;
-    int packet_loss = 100;
-    if (ping->num_recv > 0)
+    for (size_t i = 0; i < ping->num_targets; i++)
+        if (ping->targets[i].state != PING_TARGET_FAILED)
+            print_target_stats(&ping->targets[i]);
+
+    if (ping->num_targets > 1)
     {
-        packet_loss = (int)(100.0 - (float)(ping->num_emit) / (float)(ping->num_recv) * 100.0);
+        t_ping_stats total;
+
+        /* The percentiles come from the histogram of the whole run */
+        init_stats(&total);
+        for (size_t i = 0; i < ping->num_targets; i++)
+            merge_stats(&total, &ping->targets[i].stats);
+        total.hist = &ping->hist;
+        printf("--- %ld targets ---\n", ping->num_targets);
+        print_rtt_stats(&total);
     }
-    printf("--- %s ping statistics ---\n", ping->hostname);
-    printf("%ld packets transmitted, %ld packets received, %d%% packet loss\n",
-           ping->num_emit, ping->num_recv,
-           packet_loss);
-
-    double avg = ping->stats.sum / ping->num_recv;
-    double vari = ping->stats.sum_square / ping->num_recv - avg * avg;
-    if (ping->num_recv > 0 && ping->stats.sum > 0)
-        printf("round-trip min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n",
-               ping->stats.min,
-               ping->stats.sum / ping->num_recv,
-               ping->stats.max,
-               nsqrt(vari, 0.0005));
+
+    if (ping->options.verbose)
+        print_io_stats(ping);
+}
+
+void print_io_stats(PING *ping)
+{
+    printf("io: %ld packets sent in %ld calls (%.2f/call), %ld received in %ld calls (%.2f/call)\n",
+           ping->num_emit, ping->num_send_calls,
+           ping->num_send_calls ? (double)ping->num_emit / ping->num_send_calls : 0.0,
+           ping->num_recv_packets, ping->num_recv_calls,
+           ping->num_recv_calls ? (double)ping->num_recv_packets / ping->num_recv_calls : 0.0);
+    if (!ping->options.threads)
+    {
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        tvsub(&now, &ping->start_time);
+        double elapsed = now.tv_sec + now.tv_usec / 1000000.0;
+        printf("loop: %s, %ld wakeups (%.0f/s)\n", ping->evloop->name, ping->num_wakeups,
+               elapsed > 0 ? ping->num_wakeups / elapsed : 0.0);
+    }
+    if (ping->raw && ping->icmp_in_msgs)
+    {
+        uint64_t in_msgs = icmp_in_msgs() - ping->icmp_in_msgs;
+
+        printf("filter: %lu of %lu ICMP messages received by the host dropped in the kernel\n",
+               in_msgs > ping->num_recv_packets ? in_msgs - ping->num_recv_packets : 0, in_msgs);
+    }
+    if (ping->options.timestamp)
+        printf("timestamps: %ld transmit, %ld round trips timed by the kernel, %ld by hardware\n",
+               ping->num_stamp_tx, ping->num_stamp_sw, ping->num_stamp_hw);
+}
+
+void print_target_stats(t_ping_target *target)
+{
+    target->num_recv -= target->num_err;
+    int packet_loss = 0;
+    if (target->num_emit > 0)
+    {
+        packet_loss = (int)((target->num_emit - target->num_recv) * 100 / target->num_emit);
+    }
+    printf("--- %s ping statistics ---\n", target->hostname);
+    printf("%ld packets transmitted, %ld packets received, ",
+           target->num_emit, target->num_recv);
+    if (target->num_rept)
+        printf("+%ld duplicates, ", target->num_rept);
+    printf("%d%% packet loss\n", packet_loss);
+    if (target->num_reorder || target->num_late)
+        printf("%ld reordered, %ld late\n", target->num_reorder, target->num_late);
+
+    print_rtt_stats(&target->stats);
+}
+
+void print_rtt_stats(t_ping_stats *stats)
+{
+    if (!stats->count)
+        return;
+
+    printf("round-trip min/avg/max/stddev = %.3f/%.3f/%.3f/%.3f ms\n",
+           stats->min,
+           stats->mean,
+           stats->max,
+           stddev_stats(stats));
+    if (stats->hist)
+        printf("round-trip p50/p90/p99/p99.9 = %.3f/%.3f/%.3f/%.3f ms\n",
+               hist_quantile(stats->hist, 0.50) / 1000000.0,
+               hist_quantile(stats->hist, 0.90) / 1000000.0,
+               hist_quantile(stats->hist, 0.99) / 1000000.0,
+               hist_quantile(stats->hist, 0.999) / 1000000.0);
 }
 
 void print_error_dump(struct icmphdr *icmp_packet, ssize_t received)
@@ -66,7 +155,7 @@ void print_error_dump(struct icmphdr *icmp_packet, ssize_t received)
            icp->code, received - hlen, ntohs(icp->un.echo.id), ntohs(icp->un.echo.sequence));
 }
 
-int print_recv(uint8_t type, uint hlen, ssize_t received, char *from, uint seq, uint ttl, struct timeval *now)
+int print_recv(uint8_t type, uint hlen, ssize_t received, char *from, uint seq, uint ttl, struct timeval *now, const char *note)
 {
     char message[40];
     char time[20];
@@ -97,10 +186,11 @@ int print_recv(uint8_t type, uint hlen, ssize_t received, char *from, uint seq,
         snprintf(message, 22, "Unknown ICMP type %d", type);
         break;
     }
-    printf("%ld bytes from %s: %s",
+    printf("%ld bytes from %s: %s%s",
            received,
            from,
-           message);
+           message,
+           note);
 
     printf("\n");
     return error;
@@ -0,0 +1,127 @@
+#include "ft_ping.h"
+
+/*
+ * Timing of the hot path, built only with PING_PROFILE defined (make PROFILE=1).
+ *
+ * Each thread records in histograms of its own, without any synchronization,
+ * and adds them to the process-wide ones when it exits. Without PING_PROFILE,
+ * the PROFILE_* macros expand to nothing and this file is empty.
+ */
+#ifdef PING_PROFILE
+
+static const char *stage_names[PING_STAGES] = {
+    "build", "send", "wakeup", "recv", "process", "  print", "  stats",
+};
+
+static __thread t_ping_hist thread_hists[PING_STAGES];
+static __thread uint64_t thread_sums[PING_STAGES];
+static __thread bool thread_init;
+
+static t_ping_hist profile_hists[PING_STAGES];
+static uint64_t profile_sums[PING_STAGES];
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Reads the raw monotonic clock, not slewed by NTP, through the vDSO.
+ *
+ * @return The current time in nanoseconds.
+ */
+uint64_t profile_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Records how long a stage took in the histograms of the calling thread.
+ *
+ * @param stage The stage, one of PING_STAGE_*.
+ * @param ns The duration in nanoseconds.
+ */
+void profile_record(int stage, uint64_t ns)
+{
+    if (!thread_init)
+    {
+        for (int i = 0; i < PING_STAGES; i++)
+            hist_init(&thread_hists[i]);
+        thread_init = true;
+    }
+    hist_record(&thread_hists[stage], ns);
+    thread_sums[stage] += ns;
+}
+
+/**
+ * Records how late the loop woke up for a send.
+ *
+ * @param date The monotonic date the loop was to wake up at, 0 when polling.
+ */
+void profile_wakeup(uint64_t date)
+{
+    struct timespec ts;
+    uint64_t now;
+
+    if (!date)
+        return;
+    /* The date is one of the ordinary monotonic clock */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    if (now >= date)
+        profile_record(PING_STAGE_WAKEUP, now - date);
+}
+
+/**
+ * Adds the histograms of the calling thread to the process-wide ones.
+ *
+ * Every thread that records must call it before exiting.
+ */
+void profile_flush(void)
+{
+    if (!thread_init)
+        return;
+
+    pthread_mutex_lock(&profile_lock);
+    for (int i = 0; i < PING_STAGES; i++)
+    {
+        if (!profile_hists[i].count)
+            hist_init(&profile_hists[i]);
+        hist_merge(&profile_hists[i], &thread_hists[i]);
+        profile_sums[i] += thread_sums[i];
+        hist_init(&thread_hists[i]);
+        thread_sums[i] = 0;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+/**
+ * Prints the breakdown of the time spent per stage.
+ *
+ * The cost of reading the clock, paid once per timed stage, is measured and
+ * printed alongside so that it can be subtracted.
+ */
+void profile_print(void)
+{
+    uint64_t start = profile_now();
+
+    for (int i = 0; i < 1000; i++)
+        profile_now();
+    printf("--- profile, in ns, reading the clock takes %lu ---\n", (profile_now() - start) / 1000);
+    printf("%-10s %12s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50", "p90", "p99", "max");
+
+    pthread_mutex_lock(&profile_lock);
+    for (int i = 0; i < PING_STAGES; i++)
+    {
+        t_ping_hist *hist = &profile_hists[i];
+
+        if (!hist->count)
+            continue;
+        printf("%-10s %12lu %10lu %10lu %10lu %10lu %10lu\n", stage_names[i], hist->count,
+               profile_sums[i] / hist->count,
+               hist_quantile(hist, 0.50), hist_quantile(hist, 0.90), hist_quantile(hist, 0.99),
+               hist->max);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+#endif
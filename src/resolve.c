@@ -0,0 +1,371 @@
+#include "ft_ping.h"
+
+/**
+ * Resolves a host to a single address.
+ *
+ * When the host has addresses of both families and none was asked for,
+ * the IPv4 one is preferred.
+ *
+ * @param host The hostname or IP address.
+ * @param family The address family to resolve to, AF_UNSPEC for any.
+ * @param flags Extra getaddrinfo flags, such as AI_NUMERICHOST.
+ * @param addr Set to the address found.
+ * @param len Set to the size of the address.
+ * @return Returns 0 on success, or 1 if the host could not be resolved.
+ */
+int resolve_host(const char *host, int family, int flags, struct sockaddr_storage *addr, socklen_t *len)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    if (getaddrinfo(host, NULL, &hints, &res) != 0)
+        return 1;
+
+    ai = res;
+    for (struct addrinfo *p = res; p; p = p->ai_next)
+        if (p->ai_family == AF_INET)
+        {
+            ai = p;
+            break;
+        }
+    if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+    {
+        freeaddrinfo(res);
+        return 1;
+    }
+    memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+    *len = ai->ai_addrlen;
+
+    freeaddrinfo(res);
+
+    return 0;
+}
+
+/**
+ * Finds the cache entry of a host, or the free slot to insert it in.
+ *
+ * The table is open addressed with linear probing, and sized for all the
+ * targets when the resolver starts, so it never fills up.
+ */
+static t_ping_dns_entry *dns_slot(t_ping_dns *dns, const char *host)
+{
+    uint32_t hash = 2166136261u;
+
+    for (const char *p = host; *p; p++)
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    for (size_t i = hash & (dns->size - 1);; i = (i + 1) & (dns->size - 1))
+        if (!dns->entries[i].host || !strcmp(dns->entries[i].host, host))
+            return &dns->entries[i];
+}
+
+/**
+ * Resolves a host through the cache.
+ *
+ * Entries live for PING_DNS_TTL seconds, failures for PING_DNS_NEG_TTL. A
+ * host listed several times is only looked up once: the other workers wait
+ * for the lookup in progress instead of issuing their own. A host that
+ * can no longer be resolved keeps its last address in the entry.
+ *
+ * @param ping The PING structure holding the cache.
+ * @param host The hostname or IP address.
+ * @param addr Set to the address found.
+ * @param len Set to the size of the address.
+ * @return Returns 0 on success, or 1 if the host could not be resolved.
+ */
+static int dns_lookup(PING *ping, const char *host, struct sockaddr_storage *addr, socklen_t *len)
+{
+    t_ping_dns *dns = &ping->dns;
+    t_ping_dns_entry *entry;
+    int family = ping->options.family;
+    int failed;
+
+    /* Without an ICMPv6 socket, IPv6 addresses could not be probed */
+    if (family == AF_UNSPEC && ping->fd6 < 0)
+        family = AF_INET;
+
+    if (!dns->entries)
+        return resolve_host(host, family, 0, addr, len);
+
+    pthread_mutex_lock(&dns->lock);
+    entry = dns_slot(dns, host);
+    while (entry->host && entry->pending)
+        pthread_cond_wait(&dns->done, &dns->lock);
+    if (!entry->host || entry->expires <= now_ns())
+    {
+        entry->host = host;
+        entry->pending = true;
+        pthread_mutex_unlock(&dns->lock);
+
+        failed = resolve_host(host, family, 0, &entry->addr, &entry->len);
+
+        pthread_mutex_lock(&dns->lock);
+        entry->failed = failed;
+        entry->expires = now_ns() + (uint64_t)(failed ? PING_DNS_NEG_TTL : PING_DNS_TTL) * 1000000000;
+        entry->pending = false;
+        pthread_cond_broadcast(&dns->done);
+    }
+    /* The last address found still beats none */
+    failed = entry->failed && !entry->len;
+    *addr = entry->addr;
+    *len = entry->len;
+    pthread_mutex_unlock(&dns->lock);
+
+    return failed;
+}
+
+/**
+ * Marks a target as ready to be probed, with its address.
+ *
+ * The address is formatted once here, so that replies are printed without
+ * any formatting work. The state is stored last with release semantics: the
+ * sender loads it with acquire semantics before reading the address.
+ *
+ * @param target The target.
+ * @param addr Its address.
+ * @param len The size of the address.
+ */
+void target_ready(t_ping_target *target, struct sockaddr_storage *addr, socklen_t len)
+{
+    memcpy(&target->dest, addr, len);
+    target->destlen = len;
+    format_addr(&target->dest, target->addr, sizeof(target->addr));
+    __atomic_store_n(&target->state, PING_TARGET_READY, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes the new address the resolver found for a target, if any.
+ *
+ * Only the sender calls it, between two probes, so that no probe goes out
+ * to half an address.
+ *
+ * @param ping The PING structure.
+ * @param target The target.
+ */
+void target_renew(PING *ping, t_ping_target *target)
+{
+    if (!__atomic_load_n(&target->renew, __ATOMIC_ACQUIRE))
+        return;
+    if (ping->shared)
+        while (__atomic_test_and_set(&target->lock, __ATOMIC_ACQUIRE))
+            ;
+    memcpy(&target->dest, &target->renewed, target->renewedlen);
+    target->destlen = target->renewedlen;
+    format_addr(&target->dest, target->addr, sizeof(target->addr));
+    if (ping->shared)
+        __atomic_clear(&target->lock, __ATOMIC_RELEASE);
+    __atomic_store_n(&target->renew, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Resolves a target and marks it ready, or failed.
+ *
+ * A failed target no longer counts in the number of packets to send.
+ *
+ * @param ping The PING structure.
+ * @param target The target to resolve.
+ * @return Returns 0 on success, or 1 if the host is unknown.
+ */
+int resolve_target(PING *ping, t_ping_target *target)
+{
+    struct sockaddr_storage addr;
+    socklen_t len;
+
+    if (dns_lookup(ping, target->hostname, &addr, &len))
+    {
+        if (ping->options.count)
+            __atomic_fetch_sub(&ping->count, ping->options.count, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ping->num_failed, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&target->state, PING_TARGET_FAILED, __ATOMIC_RELEASE);
+        return 1;
+    }
+    target_ready(target, &addr, len);
+
+    return 0;
+}
+
+/**
+ * Tells when the next cache entry expires.
+ *
+ * @param dns The resolver cache, locked.
+ * @return Its monotonic date in nanoseconds, or UINT64_MAX if the cache is empty.
+ */
+static uint64_t dns_next_expiry(t_ping_dns *dns)
+{
+    uint64_t next = UINT64_MAX;
+
+    for (size_t i = 0; i < dns->size; i++)
+        if (dns->entries[i].host && !dns->entries[i].pending && dns->entries[i].expires < next)
+            next = dns->entries[i].expires;
+    return next;
+}
+
+/**
+ * Looks the targets given by name up again as their cache entry expires,
+ * until the run stops.
+ *
+ * A new address is handed to the sender, which takes it between two
+ * probes, see target_renew().
+ *
+ * @param ping The PING structure.
+ */
+static void dns_renew(PING *ping)
+{
+    t_ping_dns *dns = &ping->dns;
+    uint64_t next = 0;
+
+    while (!__atomic_load_n(&ping->stop, __ATOMIC_ACQUIRE))
+    {
+        struct timespec until;
+
+        if (now_ns() >= next)
+        {
+            for (size_t i = 0; i < ping->num_targets && !__atomic_load_n(&ping->stop, __ATOMIC_ACQUIRE); i++)
+            {
+                t_ping_target *target = &ping->targets[i];
+                struct sockaddr_storage addr;
+                socklen_t len;
+
+                /* A target whose last address is not taken yet waits for the next expiry */
+                if (!target->named || __atomic_load_n(&target->state, __ATOMIC_ACQUIRE) != PING_TARGET_READY ||
+                    __atomic_load_n(&target->renew, __ATOMIC_ACQUIRE))
+                    continue;
+                if (dns_lookup(ping, target->hostname, &addr, &len) ||
+                    (len == target->destlen && !memcmp(&addr, &target->dest, len)))
+                    continue;
+                memcpy(&target->renewed, &addr, len);
+                target->renewedlen = len;
+                __atomic_store_n(&target->renew, true, __ATOMIC_RELEASE);
+            }
+        }
+
+        pthread_mutex_lock(&dns->lock);
+        /* Entries expiring close together are looked up again in one pass */
+        next = dns_next_expiry(dns);
+        if (next < now_ns() + 1000000000)
+            next = now_ns() + 1000000000;
+        until.tv_sec = next / 1000000000;
+        until.tv_nsec = next % 1000000000;
+        if (!__atomic_load_n(&ping->stop, __ATOMIC_ACQUIRE))
+            pthread_cond_timedwait(&dns->done, &dns->lock, &until);
+        pthread_mutex_unlock(&dns->lock);
+    }
+}
+
+/**
+ * Resolves the pending targets one after the other, shared by the workers.
+ *
+ * The first worker done then looks the targets up again as they expire.
+ */
+static void *resolver_thread(void *arg)
+{
+    PING *ping = arg;
+    size_t i;
+
+    while (!__atomic_load_n(&ping->stop, __ATOMIC_ACQUIRE) &&
+           (i = __atomic_fetch_add(&ping->next_resolve, 1, __ATOMIC_RELAXED)) < ping->num_targets)
+    {
+        t_ping_target *target = &ping->targets[i];
+
+        if (__atomic_load_n(&target->state, __ATOMIC_ACQUIRE) != PING_TARGET_PENDING)
+            continue;
+        if (resolve_target(ping, target))
+            printf("%s: %s: unknown host\n", ping->progname, target->hostname);
+    }
+    if (!__atomic_exchange_n(&ping->dns.renewing, true, __ATOMIC_RELAXED))
+        dns_renew(ping);
+    return NULL;
+}
+
+/**
+ * Starts resolving the pending targets in the background.
+ *
+ * Up to PING_RESOLVERS workers look hosts up concurrently, while targets
+ * given as addresses, or already resolved, are probed right away. One of
+ * them stays to look the targets given by name up again, a single one
+ * resolved before included.
+ *
+ * @param ping The PING structure, with all its targets added.
+ * @return Returns 0 on success, or 1 if the resolver could not be started.
+ */
+int resolver_start(PING *ping)
+{
+    pthread_condattr_t attr;
+    size_t pending = 0;
+    size_t named = 0;
+
+    for (size_t i = 0; i < ping->num_targets; i++)
+    {
+        pending += ping->targets[i].state == PING_TARGET_PENDING;
+        named += ping->targets[i].named;
+    }
+    if (!named)
+        return 0;
+
+    ping->dns.size = 16;
+    while (ping->dns.size < 2 * named)
+        ping->dns.size *= 2;
+    ping->dns.entries = calloc(ping->dns.size, sizeof(t_ping_dns_entry));
+    if (!ping->dns.entries)
+    {
+        perror("calloc");
+        return 1;
+    }
+    ping->dns.renewing = false;
+    pthread_mutex_init(&ping->dns.lock, NULL);
+    /* Expiry dates are monotonic */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ping->dns.done, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ping->next_resolve = 0;
+    while (ping->num_resolvers < PING_RESOLVERS && (ping->num_resolvers < pending || !ping->num_resolvers))
+    {
+        int error = pthread_create(&ping->resolvers[ping->num_resolvers], NULL, resolver_thread, ping);
+
+        if (error)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(error));
+            return ping->num_resolvers == 0;
+        }
+        ping->num_resolvers++;
+    }
+
+    return 0;
+}
+
+/**
+ * Waits for the resolver workers and releases the hosts looked up.
+ *
+ * Workers check the stop flag between lookups, so only the lookups in
+ * progress are waited for when the run is cut short.
+ *
+ * @param ping The PING structure.
+ */
+void resolver_stop(PING *ping)
+{
+    __atomic_store_n(&ping->stop, true, __ATOMIC_RELEASE);
+    if (ping->dns.entries)
+    {
+        pthread_mutex_lock(&ping->dns.lock);
+        pthread_cond_broadcast(&ping->dns.done);
+        pthread_mutex_unlock(&ping->dns.lock);
+    }
+    for (size_t i = 0; i < ping->num_resolvers; i++)
+        pthread_join(ping->resolvers[i], NULL);
+    if (ping->dns.entries)
+    {
+        pthread_mutex_destroy(&ping->dns.lock);
+        pthread_cond_destroy(&ping->dns.done);
+        free(ping->dns.entries);
+        ping->dns.entries = NULL;
+    }
+    ping->num_resolvers = 0;
+}
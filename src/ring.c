@@ -0,0 +1,77 @@
+#include "ft_ping.h"
+
+/**
+ * Allocates a ring of receive buffers and sets up their message headers.
+ *
+ * The buffers, addresses and ancillary data areas are allocated once in a
+ * single block, and each mmsghdr is pointed at its own slot here, so that
+ * receiving a batch only has to reset the lengths the kernel overwrote.
+ *
+ * @param ring The ring to initialize.
+ * @param len The size of each buffer in bytes.
+ * @return Returns 0 on success, or 1 if the allocation failed.
+ */
+int rxring_init(t_ping_rxring *ring, size_t len)
+{
+    size_t slots = PING_RX_SLOTS;
+
+    ring->len = (len + 63) & ~(size_t)63;
+    ring->next = 0;
+    ring->buffers = malloc(slots * (ring->len + PING_CMSG_SIZE));
+    ring->msgs = calloc(slots, sizeof(*ring->msgs));
+    ring->iov = malloc(slots * sizeof(*ring->iov));
+    ring->from = malloc(slots * sizeof(*ring->from));
+    if (!ring->buffers || !ring->msgs || !ring->iov || !ring->from)
+    {
+        rxring_free(ring);
+        return 1;
+    }
+
+    for (size_t i = 0; i < slots; i++)
+    {
+        ring->iov[i].iov_base = ring->buffers + i * ring->len;
+        ring->msgs[i].msg_hdr.msg_iov = &ring->iov[i];
+        ring->msgs[i].msg_hdr.msg_iovlen = 1;
+        ring->msgs[i].msg_hdr.msg_name = &ring->from[i];
+        ring->msgs[i].msg_hdr.msg_control = ring->buffers + slots * ring->len + i * PING_CMSG_SIZE;
+    }
+
+    return 0;
+}
+
+/**
+ * Hands out the next PING_BATCH slots of the ring, ready for recvmmsg.
+ *
+ * The slots of the previous batch are left untouched, so packets parsed in
+ * place stay valid until the batch after next is received.
+ *
+ * @param ring The ring.
+ * @return The message headers of the batch.
+ */
+struct mmsghdr *rxring_batch(t_ping_rxring *ring)
+{
+    struct mmsghdr *msgs = &ring->msgs[ring->next];
+
+    for (size_t i = 0; i < PING_BATCH; i++)
+    {
+        msgs[i].msg_hdr.msg_iov->iov_len = ring->len;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in6);
+        msgs[i].msg_hdr.msg_controllen = PING_CMSG_SIZE;
+        msgs[i].msg_hdr.msg_flags = 0;
+    }
+    ring->next = (ring->next + PING_BATCH) % PING_RX_SLOTS;
+
+    return msgs;
+}
+
+void rxring_free(t_ping_rxring *ring)
+{
+    free(ring->buffers);
+    free(ring->msgs);
+    free(ring->iov);
+    free(ring->from);
+    ring->buffers = NULL;
+    ring->msgs = NULL;
+    ring->iov = NULL;
+    ring->from = NULL;
+}
@@ -0,0 +1,576 @@
+#include "ft_ping.h"
+
+#define WHEEL_MASK (PING_WHEEL_SLOTS - 1)
+
+/**
+ * Sets an empty timer wheel up.
+ *
+ * @param wheel The timer wheel.
+ * @param now The current monotonic date in nanoseconds.
+ */
+void wheel_init(t_ping_wheel *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now >> PING_WHEEL_TICK_SHIFT;
+}
+
+/**
+ * Appends a timer to the expired ones.
+ *
+ * @param wheel The timer wheel.
+ * @param timer The timer, in no slot.
+ */
+static void wheel_due(t_ping_wheel *wheel, t_ping_timer *timer)
+{
+    timer->next = NULL;
+    timer->pprev = NULL;
+    if (wheel->due)
+        wheel->due_last->next = timer;
+    else
+        wheel->due = timer;
+    wheel->due_last = timer;
+    wheel->num_due++;
+}
+
+/**
+ * Links a timer first in a slot.
+ *
+ * @param head The first timer of the slot.
+ * @param timer The timer, in no slot.
+ */
+static void wheel_link(t_ping_timer **head, t_ping_timer *timer)
+{
+    timer->next = *head;
+    if (timer->next)
+        timer->next->pprev = &timer->next;
+    timer->pprev = head;
+    *head = timer;
+}
+
+/**
+ * Puts a timer in the slot of its date, or in the expired ones if that date has come.
+ *
+ * The level is that of the highest 6-bit digit by which the tick of the
+ * timer differs from the current one. The timer is thus in a later slot of
+ * the current round of its level, and only comes up once every timer of the
+ * levels below has.
+ *
+ * @param wheel The timer wheel.
+ * @param timer The timer, whose date is set.
+ */
+static void wheel_place(t_ping_wheel *wheel, t_ping_timer *timer)
+{
+    uint64_t tick = timer->expires >> PING_WHEEL_TICK_SHIFT;
+    int level, slot;
+
+    if (tick <= wheel->now)
+    {
+        wheel_due(wheel, timer);
+        return;
+    }
+
+    level = (63 - __builtin_clzll(tick ^ wheel->now)) / PING_WHEEL_BITS;
+    if (level >= PING_WHEEL_LEVELS)
+    {
+        wheel_link(&wheel->far, timer);
+        return;
+    }
+
+    slot = (tick >> (level * PING_WHEEL_BITS)) & WHEEL_MASK;
+    if (!(wheel->occupied[level] & (1ULL << slot)) || timer->expires < wheel->first[level][slot])
+        wheel->first[level][slot] = timer->expires;
+    wheel->occupied[level] |= 1ULL << slot;
+    wheel_link(&wheel->slots[level][slot], timer);
+}
+
+/**
+ * Adds a timer to the wheel.
+ *
+ * @param wheel The timer wheel.
+ * @param timer The timer, not in the wheel.
+ * @param expires The monotonic date it expires at, in nanoseconds.
+ */
+void wheel_add(t_ping_wheel *wheel, t_ping_timer *timer, uint64_t expires)
+{
+    timer->expires = expires;
+    wheel_place(wheel, timer);
+}
+
+/**
+ * Finds the next slot to come up.
+ *
+ * Every level below the one found is empty, and every slot of that level
+ * before the one found as well, so it holds the earliest timers.
+ *
+ * @param wheel The timer wheel.
+ * @param slot Set to the slot within its level.
+ * @return The level of the slot, or -1 if every level is empty.
+ */
+static int wheel_upcoming(t_ping_wheel *wheel, int *slot)
+{
+    for (int level = 0; level < PING_WHEEL_LEVELS; level++)
+    {
+        int current = (wheel->now >> (level * PING_WHEEL_BITS)) & WHEEL_MASK;
+        uint64_t later = current == WHEEL_MASK ? 0 : wheel->occupied[level] & (~0ULL << (current + 1));
+
+        if (later)
+        {
+            *slot = __builtin_ctzll(later);
+            return level;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Moves every timer whose date has come to the expired ones.
+ *
+ * Rather than stepping through every tick, the wheel jumps from one
+ * occupied slot to the next. The timers of each slot that comes up go down
+ * to a lower level, or expire when it was at the bottom one: a timer is
+ * moved at most once per level.
+ *
+ * @param wheel The timer wheel.
+ * @param now The current monotonic date in nanoseconds.
+ */
+void wheel_advance(t_ping_wheel *wheel, uint64_t now)
+{
+    uint64_t to = now >> PING_WHEEL_TICK_SHIFT;
+
+    while (wheel->now < to)
+    {
+        t_ping_timer *timers;
+        uint64_t start;
+        int slot;
+        int level = wheel_upcoming(wheel, &slot);
+
+        if (level >= 0)
+        {
+            int shift = level * PING_WHEEL_BITS;
+
+            start = (wheel->now >> shift >> PING_WHEEL_BITS << PING_WHEEL_BITS | slot) << shift;
+            if (start > to)
+                break;
+            timers = wheel->slots[level][slot];
+            wheel->slots[level][slot] = NULL;
+            wheel->occupied[level] &= ~(1ULL << slot);
+        }
+        else
+        {
+            /* The far timers are sorted again once a round of the last level is over */
+            start = ((wheel->now >> (PING_WHEEL_LEVELS * PING_WHEEL_BITS)) + 1)
+                    << (PING_WHEEL_LEVELS * PING_WHEEL_BITS);
+            if (!wheel->far || start > to)
+                break;
+            timers = wheel->far;
+            wheel->far = NULL;
+        }
+
+        wheel->now = start;
+        while (timers)
+        {
+            t_ping_timer *next = timers->next;
+
+            wheel_place(wheel, timers);
+            timers = next;
+        }
+    }
+    if (wheel->now < to)
+        wheel->now = to;
+}
+
+/**
+ * Takes the oldest expired timer.
+ *
+ * @param wheel The timer wheel.
+ * @return The timer, or NULL if none has expired.
+ */
+t_ping_timer *wheel_pop(t_ping_wheel *wheel)
+{
+    t_ping_timer *timer = wheel->due;
+
+    if (timer)
+    {
+        wheel->due = timer->next;
+        wheel->num_due--;
+    }
+    return timer;
+}
+
+/**
+ * Tells when the next timer expires, among those that have not yet.
+ *
+ * @param wheel The timer wheel.
+ * @return Its monotonic date in nanoseconds, or UINT64_MAX if there is
+ *         none. Timers beyond the last level are only looked at once a
+ *         round of it is over.
+ */
+uint64_t wheel_next(t_ping_wheel *wheel)
+{
+    int slot;
+    int level;
+
+    level = wheel_upcoming(wheel, &slot);
+    if (level >= 0)
+        return wheel->first[level][slot];
+    if (wheel->far)
+        return ((wheel->now >> (PING_WHEEL_LEVELS * PING_WHEEL_BITS)) + 1)
+               << (PING_WHEEL_LEVELS * PING_WHEEL_BITS) << PING_WHEEL_TICK_SHIFT;
+    return UINT64_MAX;
+}
+
+/**
+ * Takes a timer out of the slot it waits in.
+ *
+ * Its slot is left marked even if it is now empty: the wheel at worst
+ * wakes up once for nothing, when that slot comes up.
+ *
+ * @param timer The timer.
+ * @return Returns true if it was waiting in a slot, false if it had already
+ *         expired or is not in a wheel.
+ */
+bool wheel_remove(t_ping_timer *timer)
+{
+    if (!timer->pprev)
+        return false;
+    *timer->pprev = timer->next;
+    if (timer->next)
+        timer->next->pprev = timer->pprev;
+    timer->pprev = NULL;
+    return true;
+}
+
+/**
+ * Expires a timer before its date, the wheel staying at the current tick.
+ *
+ * @param wheel The timer wheel.
+ * @param timer The timer.
+ * @return Returns true if it was waiting in a slot, false if it had already
+ *         expired or is not in the wheel.
+ */
+bool wheel_expire(t_ping_wheel *wheel, t_ping_timer *timer)
+{
+    if (!wheel_remove(timer))
+        return false;
+    wheel_due(wheel, timer);
+    return true;
+}
+
+/**
+ * Finds a timer of the next slot to come up, the far ones left aside.
+ *
+ * @param wheel The timer wheel.
+ * @return The timer, or NULL if every level is empty.
+ */
+static t_ping_timer *wheel_peek(t_ping_wheel *wheel)
+{
+    int slot;
+    int level;
+
+    while ((level = wheel_upcoming(wheel, &slot)) >= 0)
+    {
+        if (wheel->slots[level][slot])
+            return wheel->slots[level][slot];
+        /* Emptied by wheel_expire */
+        wheel->occupied[level] &= ~(1ULL << slot);
+    }
+    return NULL;
+}
+
+/**
+ * Draws how late a probe goes out, so that targets with the same interval
+ * do not all send in the same bursts.
+ *
+ * @param sched The schedule.
+ * @param interval The interval of the target in nanoseconds.
+ * @return A delay up to the jitter fraction of the interval, in nanoseconds.
+ */
+static uint64_t sched_jitter(t_ping_sched *sched, uint64_t interval)
+{
+    uint64_t span = interval * sched->jitter;
+    uint64_t x = sched->seed;
+
+    if (!span)
+        return 0;
+    /* xorshift64 */
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    sched->seed = x;
+    return x % (span + 1);
+}
+
+/**
+ * Sets the token bucket up, full, for the rate given to -r.
+ *
+ * The path MTU search and the TTL sweep, which have no timer wheel, are
+ * capped by it as well.
+ *
+ * @param sched The schedule.
+ * @param rate The probes per second, 0 for no limit.
+ * @param now The current monotonic date in nanoseconds.
+ */
+void sched_rate(t_ping_sched *sched, double rate, uint64_t now)
+{
+    sched->cost = rate > 0 ? 1000000000.0 / rate : 0;
+    if (rate > 0 && !sched->cost)
+        sched->cost = 1;
+    sched->credit = PING_BATCH * sched->cost;
+    sched->refilled = now;
+}
+
+/**
+ * Sets the schedule up: each target gets its first probe, the targets
+ * being spread evenly across their interval, and the token bucket starts full.
+ *
+ * @param ping The PING structure, with all its targets.
+ */
+void sched_init(PING *ping)
+{
+    t_ping_sched *sched = &ping->sched;
+    uint64_t now = now_ns();
+
+    wheel_init(&sched->wheel, now);
+    sched->jitter = ping->options.jitter;
+    if (sched->jitter < 0)
+        sched->jitter = ping->num_targets > 1 ? PING_DEFAULT_JITTER : 0;
+    sched->seed = now ^ ((uint64_t)ping->ident << 32) ^ 0x9e3779b97f4a7c15ULL;
+    sched_rate(sched, ping->options.rate, now);
+    ping->end = ping->options.deadline ? now + ping->options.deadline : 0;
+
+    for (size_t i = 0; i < ping->num_targets; i++)
+    {
+        t_ping_target *target = &ping->targets[i];
+
+        target->next_send = now + target->interval / ping->num_targets * i;
+        wheel_add(&sched->wheel, &target->timer,
+                  i ? target->next_send + sched_jitter(sched, target->interval) : now);
+    }
+}
+
+/**
+ * Refills the token bucket and tells how many probes it lets out now.
+ *
+ * The bucket holds up to a batch of probes, so that a rate limit does not
+ * split the sends into one syscall per probe.
+ *
+ * @param sched The schedule.
+ * @param now The current monotonic date in nanoseconds.
+ * @return The number of probes, at most PING_BATCH.
+ */
+size_t sched_tokens(t_ping_sched *sched, uint64_t now)
+{
+    if (!sched->cost)
+        return PING_BATCH;
+
+    if (now > sched->refilled)
+    {
+        sched->credit += now - sched->refilled;
+        if (sched->credit > PING_BATCH * sched->cost)
+            sched->credit = PING_BATCH * sched->cost;
+    }
+    sched->refilled = now;
+    return sched->credit / sched->cost;
+}
+
+/**
+ * Takes the tokens of the probes sent from the bucket.
+ *
+ * @param sched The schedule.
+ * @param n The number of probes, at most what sched_tokens() allowed.
+ */
+void sched_spend(t_ping_sched *sched, size_t n)
+{
+    if (sched->cost)
+        sched->credit -= n * sched->cost;
+}
+
+/**
+ * Tells when the bucket has a token again.
+ *
+ * @param sched The schedule.
+ * @return The monotonic date in nanoseconds, in the past if it has one now.
+ */
+uint64_t sched_refill(t_ping_sched *sched)
+{
+    if (sched->credit >= sched->cost)
+        return sched->refilled;
+    return sched->refilled + sched->cost - sched->credit;
+}
+
+/**
+ * Tells when the loop has something to do next: send a probe, give up on
+ * a reply, write out the records or stop.
+ *
+ * @param ping The PING structure.
+ * @return The monotonic date in nanoseconds, 0 if probes are already due.
+ *         With none of these to come, a timeout later.
+ */
+uint64_t sched_next(PING *ping)
+{
+    t_ping_sched *sched = &ping->sched;
+    uint64_t next, expiry, due;
+
+    /* Probes held back by the rate limit leave with the next token */
+    if (sched->wheel.due)
+        return sched->credit < sched->cost ? sched_refill(sched) : 0;
+    next = wheel_next(&sched->wheel);
+    expiry = ping_next_expiry(ping);
+    if (expiry < next)
+        next = expiry;
+    due = __atomic_load_n(&ping->out.due, __ATOMIC_RELAXED);
+    if (due && due < next)
+        next = due;
+    if (ping->end && ping->end < next)
+        next = ping->end;
+    if (next == UINT64_MAX)
+        return now_ns() + ping->options.timeout;
+    return next;
+}
+
+/**
+ * Sets the date of the next probe of a target, one interval after the last.
+ *
+ * Probes that fell due while the loop was busy then go out in a burst, so
+ * that the rate is preserved, but a target never lags more than a batch of
+ * intervals behind, as it would forever under a rate limit.
+ *
+ * @param sched The schedule.
+ * @param target The target, not in the wheel.
+ * @param now The current monotonic date in nanoseconds.
+ */
+static void sched_target(t_ping_sched *sched, t_ping_target *target, uint64_t now)
+{
+    target->next_send += target->interval;
+    if (target->next_send + PING_BATCH * target->interval < now)
+        target->next_send = now;
+    wheel_add(&sched->wheel, &target->timer, target->next_send + sched_jitter(sched, target->interval));
+}
+
+/**
+ * Counts the probes of a target already in the batch being built.
+ *
+ * @param batch The targets of the batch, one per probe.
+ * @param n The number of probes in the batch.
+ * @param target The target.
+ * @return The number of its probes.
+ */
+static size_t sched_queued(t_ping_target **batch, size_t n, t_ping_target *target)
+{
+    size_t queued = 0;
+
+    for (size_t i = 0; i < n; i++)
+        queued += batch[i] == target;
+    return queued;
+}
+
+/**
+ * Releases the next probe of a target whose reply came, in adaptive mode.
+ *
+ * Receiver threads push the target on a list the sender takes whole, a
+ * target being on it at most once.
+ *
+ * @param ping The PING structure.
+ * @param target The target that answered.
+ */
+void sched_kick(PING *ping, t_ping_target *target)
+{
+    if (!__atomic_exchange_n(&target->kicked, true, __ATOMIC_ACQUIRE))
+    {
+        target->kick_next = __atomic_load_n(&ping->kicked, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&ping->kicked, &target->kick_next, target, true, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+    }
+    PING_ADD(ping->num_kick, 1);
+    if (ping->kick_fd >= 0)
+        eventfd_write(ping->kick_fd, 1);
+}
+
+/**
+ * Expires the timers of the targets replies came from.
+ *
+ * Each reply releases a probe: when its target has none waiting, having one
+ * due already or having left the schedule, the earliest probes go instead
+ * until as many are due as replies came. The wheel stays at the current date, so that the targets
+ * scheduled again are not due before their interval.
+ *
+ * @param ping The PING structure.
+ */
+static void sched_release(PING *ping)
+{
+    t_ping_wheel *wheel = &ping->sched.wheel;
+    size_t kick = __atomic_exchange_n(&ping->num_kick, 0, __ATOMIC_RELAXED);
+    t_ping_target *target = __atomic_exchange_n(&ping->kicked, NULL, __ATOMIC_ACQUIRE);
+    t_ping_timer *timer;
+
+    while (target)
+    {
+        t_ping_target *next = target->kick_next;
+
+        /* Once cleared, a receiver may push it again */
+        __atomic_store_n(&target->kicked, false, __ATOMIC_RELEASE);
+        wheel_expire(wheel, &target->timer);
+        target = next;
+    }
+    while (wheel->num_due < kick && (timer = wheel_peek(wheel)))
+        wheel_expire(wheel, timer);
+}
+
+/**
+ * Sends the probes whose date has come, as far as the rate limit allows.
+ *
+ * Each due target sends one probe and is scheduled an interval later; one
+ * that is not resolved yet lets its turn go by, and one that is unknown or
+ * got all its probes leaves the schedule. Targets the rate limit holds
+ * back stay first in line for the next tokens.
+ *
+ * @param ping The PING structure.
+ */
+void send_due(PING *ping)
+{
+    t_ping_sched *sched = &ping->sched;
+    t_ping_wheel *wheel = &sched->wheel;
+    t_ping_target *batch[PING_BATCH];
+    t_ping_timer *timer;
+    uint64_t now = now_ns();
+    size_t tokens;
+    size_t n = 0;
+
+    /* No probe leaves past the deadline, its reply would not be waited for */
+    if (ping->end && now >= ping->end)
+        return;
+    wheel_advance(wheel, now);
+    /* In adaptive mode, each reply releases the next probe right away */
+    if (ping->options.adaptive)
+        sched_release(ping);
+
+    tokens = sched_tokens(sched, now);
+    for (size_t i = 0; i < PING_BATCH && n < tokens && (timer = wheel_pop(wheel)); i++)
+    {
+        t_ping_target *target = (t_ping_target *)((char *)timer - offsetof(t_ping_target, timer));
+        int state = __atomic_load_n(&target->state, __ATOMIC_ACQUIRE);
+
+        if (state == PING_TARGET_FAILED)
+            continue;
+        if (state == PING_TARGET_READY)
+        {
+            size_t sent = ping->options.count ? target->num_emit + sched_queued(batch, n, target) : 0;
+
+            target_renew(ping, target);
+            batch[n++] = target;
+            if (ping->options.count && sent + 1 >= ping->options.count)
+                continue;
+        }
+        /* A probe released early starts the interval over */
+        if (target->next_send > now)
+            target->next_send = now;
+        sched_target(sched, target, now);
+    }
+
+    if (n)
+    {
+        send_packets(ping, batch, n);
+        sched_spend(sched, n);
+    }
+}
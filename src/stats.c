@@ -1,22 +1,87 @@
 #include "ft_ping.h"
 
-void calculate_stats(t_ping_stats *stats, struct timeval *sent)
+void init_stats(t_ping_stats *stats)
+{
+    stats->count = 0;
+    stats->mean = 0;
+    stats->m2 = 0;
+    stats->min = 0;
+    stats->max = 0;
+    stats->hist = NULL;
+}
+
+/**
+ * Adds a round-trip time to the statistics.
+ *
+ * The mean and the sum of squared deviations are updated with Welford's
+ * method, which stays accurate over billions of samples where accumulating
+ * the sum of squares would cancel out.
+ *
+ * @param stats The statistics to update.
+ * @param sent The round-trip time.
+ * @return The round-trip time in nanoseconds, for the histograms kept apart.
+ */
+uint64_t calculate_stats(t_ping_stats *stats, struct timeval *sent)
 {
     double timediff = sent->tv_sec * 1000.0 + sent->tv_usec / 1000.0;
-    if (stats->min == -1)
+    double delta = timediff - stats->mean;
+    uint64_t ns = timediff > 0 ? (uint64_t)(timediff * 1000000.0) : 0;
+
+    if (stats->hist)
+        hist_record(stats->hist, ns);
+
+    if (stats->count == 0 || timediff < stats->min)
         stats->min = timediff;
-    else
-        stats->min = stats->min < timediff ? stats->min : timediff;
-    if (stats->max == -1)
+    if (stats->count == 0 || timediff > stats->max)
         stats->max = timediff;
-    else
-        stats->max = stats->max > timediff ? stats->max : timediff;
-    if (stats->sum == -1)
-        stats->sum = timediff;
-    else
-        stats->sum += timediff;
-    if (stats->sum_square == -1)
-        stats->sum_square = timediff * timediff;
-    else
-        stats->sum_square += timediff * timediff;
-}
\ No newline at end of file
+
+    stats->count++;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (timediff - stats->mean);
+    return ns;
+}
+
+/**
+ * Merges two partial aggregates, as if every sample of src had been added to dst.
+ *
+ * Uses the pairwise update of Chan et al., so aggregates kept per target or
+ * per thread combine without loss of precision. Histograms are merged when
+ * both sides keep one.
+ *
+ * @param dst The statistics to merge into.
+ * @param src The statistics to merge from.
+ */
+void merge_stats(t_ping_stats *dst, t_ping_stats *src)
+{
+    uint64_t count;
+    double delta;
+
+    if (!src->count)
+        return;
+    if (!dst->count || src->min < dst->min)
+        dst->min = src->min;
+    if (!dst->count || src->max > dst->max)
+        dst->max = src->max;
+
+    count = dst->count + src->count;
+    delta = src->mean - dst->mean;
+    dst->mean += delta * src->count / count;
+    dst->m2 += src->m2 + delta * delta * ((double)dst->count * src->count / count);
+    dst->count = count;
+
+    if (dst->hist && src->hist)
+        hist_merge(dst->hist, src->hist);
+}
+
+/**
+ * Computes the standard deviation of the round-trip times.
+ *
+ * @param stats The statistics.
+ * @return The population standard deviation in milliseconds.
+ */
+double stddev_stats(t_ping_stats *stats)
+{
+    if (stats->count < 2)
+        return 0;
+    return sqrt(stats->m2 / stats->count);
+}
@@ -0,0 +1,344 @@
+#include "ft_ping.h"
+
+/**
+ * Appends a host to the list of targets.
+ *
+ * The targets array grows geometrically so that loading a large list stays linear.
+ * Addresses are parsed right away; hostnames are left pending for the resolver.
+ *
+ * @param ping The PING structure holding the targets.
+ * @param host The hostname or IP address of the destination.
+ * @return Returns 0 on success, or -1 on allocation failure.
+ */
+int ping_add_target(PING *ping, const char *host)
+{
+    t_ping_target *target;
+    struct sockaddr_storage addr;
+    socklen_t len;
+
+    if (ping->num_targets == ping->max_targets)
+    {
+        size_t max = ping->max_targets ? ping->max_targets * 2 : 16;
+        t_ping_target *targets = realloc(ping->targets, max * sizeof(*targets));
+
+        if (!targets)
+            return -1;
+        ping->targets = targets;
+        ping->max_targets = max;
+    }
+
+    target = &ping->targets[ping->num_targets];
+    memset(target, 0, sizeof(*target));
+    ft_strlcpy(target->hostname, host, HOST_NAME_MAX);
+    target->state = PING_TARGET_PENDING;
+    target->interval = (uint64_t)(ping->options.interval * 1000.0);
+    target->timeout = ping->options.timeout;
+    if (!resolve_host(host, ping->options.family, AI_NUMERICHOST, &addr, &len))
+        target_ready(target, &addr, len);
+    else
+        target->named = true;
+    init_stats(&target->stats);
+    ping->num_targets++;
+
+    return 0;
+}
+
+/**
+ * Reads targets from a file, one host per line.
+ *
+ * A host may be followed by its own interval in seconds, which replaces
+ * the one of -i for it, then by its own reply timeout in seconds, which
+ * replaces -W. Blank lines and lines starting with '#' are
+ * ignored. Hostnames are only resolved later, unknown ones are then
+ * reported and skipped so that one stale entry does not abort a whole sweep.
+ *
+ * @param ping The PING structure holding the targets.
+ * @param path The path of the file, or "-" for the standard input.
+ * @param progname The name of the program.
+ * @return Returns 0 on success, or 1 if the file could not be read in full.
+ */
+int ping_read_targets(PING *ping, const char *path, const char *progname)
+{
+    FILE *file;
+    char line[HOST_NAME_MAX + 64];
+    int ret = 0;
+
+    file = strcmp(path, "-") ? fopen(path, "r") : stdin;
+    if (!file)
+    {
+        printf("%s: %s: %s\n", progname, path, strerror(errno));
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), file))
+    {
+        char *host = line;
+        char *interval, *timeout, *end;
+        double seconds;
+
+        while (isspace((unsigned char)*host))
+            host++;
+        interval = host + strcspn(host, " \t\r\n");
+        if (*interval)
+            *interval++ = '\0';
+        if (!*host || *host == '#')
+            continue;
+
+        /* A truncated list would be probed as if it were the whole one */
+        if (ping_add_target(ping, host) < 0)
+        {
+            perror("realloc");
+            ret = 1;
+            break;
+        }
+        interval += strspn(interval, " \t");
+        timeout = interval + strcspn(interval, " \t\r\n");
+        if (*timeout)
+            *timeout++ = '\0';
+        timeout += strspn(timeout, " \t");
+        timeout[strcspn(timeout, " \t\r\n")] = '\0';
+        if (!*interval)
+            continue;
+        seconds = strtod(interval, &end);
+        if (end == interval || *end || !(seconds >= 0 && seconds <= PING_MAX_SECONDS))
+            printf("%s: %s: invalid interval: '%s'\n", progname, host, interval);
+        else
+            ping->targets[ping->num_targets - 1].interval = seconds * 1000000000.0;
+        if (!*timeout)
+            continue;
+        seconds = strtod(timeout, &end);
+        if (end == timeout || *end || !(seconds >= 0.001 && seconds <= PING_MAX_SECONDS))
+            printf("%s: %s: invalid timeout: '%s'\n", progname, host, timeout);
+        else
+            ping->targets[ping->num_targets - 1].timeout = seconds * 1000000000.0;
+    }
+
+    if (!ret && ferror(file))
+    {
+        printf("%s: %s: %s\n", progname, path, strerror(errno));
+        ret = 1;
+    }
+    if (file != stdin)
+        fclose(file);
+
+    return ret;
+}
+
+/**
+ * Marks every entry of the in-flight table unused, its deadline in no wheel.
+ *
+ * @param ping The PING structure holding the in-flight table.
+ */
+void ping_reset_inflight(PING *ping)
+{
+    memset(ping->inflight, 0xff, PING_SEQ_SPACE * sizeof(t_ping_probe));
+    for (size_t i = 0; i < PING_SEQ_SPACE; i++)
+        ping->inflight[i].timer.pprev = NULL;
+}
+
+/**
+ * Finds the probe a reply belongs to from its wire sequence number.
+ *
+ * @param ping The PING structure holding the in-flight table.
+ * @param wire_seq The ICMP sequence number found in the reply, in host order.
+ * @return The matching probe, or NULL if the sequence was never sent.
+ */
+t_ping_probe *ping_match_probe(PING *ping, uint16_t wire_seq)
+{
+    t_ping_probe *probe = &ping->inflight[wire_seq];
+
+    if (__atomic_load_n(&probe->target, __ATOMIC_ACQUIRE) == PING_NO_TARGET)
+        return NULL;
+
+    return probe;
+}
+
+/**
+ * Records that a reply came back for a wire sequence number.
+ *
+ * The bit of the sequence in the rolling bitmap is cleared when its probe is
+ * sent and set by the first reply, so a second reply finds it already set.
+ *
+ * @param ping The PING structure holding the bitmap.
+ * @param wire_seq The ICMP sequence number found in the reply, in host order.
+ * @return true if a reply was already recorded for this sequence.
+ */
+bool ping_mark_seen(PING *ping, uint16_t wire_seq)
+{
+    uint64_t bit = 1ULL << (wire_seq % 64);
+
+    return __atomic_fetch_or(&ping->seen[wire_seq / 64], bit, __ATOMIC_ACQ_REL) & bit;
+}
+
+/**
+ * Tells whether a wire sequence number was answered or given up on.
+ *
+ * @param ping The PING structure holding the bitmap.
+ * @param wire_seq The wire sequence number.
+ * @return true if its bit in the seen bitmap is set.
+ */
+bool ping_is_seen(PING *ping, uint16_t wire_seq)
+{
+    return __atomic_load_n(&ping->seen[wire_seq / 64], __ATOMIC_RELAXED) & (1ULL << (wire_seq % 64));
+}
+
+/**
+ * Tells whether a reply is too old to be told apart from a newer probe.
+ *
+ * Wire sequence numbers wrap around every PING_SEQ_SPACE probes. A reply
+ * whose sequence is more than half the space behind the last one sent is
+ * considered late rather than matched against the table. Replies slightly
+ * ahead are expected, receivers may see them before the counter moves.
+ *
+ * @param ping The PING structure.
+ * @param wire_seq The ICMP sequence number found in the reply, in host order.
+ * @return true if the reply is late.
+ */
+bool ping_is_late(PING *ping, uint16_t wire_seq)
+{
+    size_t emit = __atomic_load_n(&ping->num_emit, __ATOMIC_RELAXED);
+
+    return (int16_t)(uint16_t)(emit - wire_seq) < -PING_BATCH;
+}
+
+/**
+ * Records the highest sequence number answered by a target.
+ *
+ * @param target The target that replied.
+ * @param seq The sequence number within the target.
+ * @return true if a later probe of the target was already answered.
+ */
+bool ping_mark_order(t_ping_target *target, uint32_t seq)
+{
+    uint32_t next = __atomic_load_n(&target->next_seq, __ATOMIC_RELAXED);
+
+    while (seq >= next)
+        if (__atomic_compare_exchange_n(&target->next_seq, &next, seq + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            return false;
+    return true;
+}
+
+/**
+ * Fills an entry of the in-flight table for a probe about to be sent.
+ *
+ * The target index is stored last with release semantics: a receiver thread
+ * that loads it with acquire semantics in ping_match_probe() sees the rest of
+ * the entry, without any lock between the sender and the receivers.
+ *
+ * @param ping The PING structure holding the in-flight table.
+ * @param wire_seq The wire sequence number of the probe.
+ * @param target The index of the probed target.
+ * @param seq The sequence number within that target.
+ */
+void publish_probe(PING *ping, uint16_t wire_seq, uint32_t target, uint32_t seq)
+{
+    t_ping_probe *probe = &ping->inflight[wire_seq];
+
+    __atomic_fetch_and(&ping->seen[wire_seq / 64], ~(1ULL << (wire_seq % 64)), __ATOMIC_RELAXED);
+    probe->seq = seq;
+    probe->lost = false;
+    probe->tx.sw = 0;
+    probe->tx.hw = 0;
+    __atomic_store_n(&probe->target, target, __ATOMIC_RELEASE);
+}
+
+/**
+ * Counts a probe as lost, unless its reply came first.
+ *
+ * @param ping The PING structure holding the in-flight table.
+ * @param probe The probe, its deadline in no wheel.
+ */
+static void ping_lose(PING *ping, t_ping_probe *probe)
+{
+    uint16_t wire_seq = probe - ping->inflight;
+    t_ping_target *target;
+
+    if (ping_is_seen(ping, wire_seq))
+        return;
+    __atomic_store_n(&probe->lost, true, __ATOMIC_RELEASE);
+    if (ping_mark_seen(ping, wire_seq))
+    {
+        /* The reply won, a second one is a duplicate */
+        __atomic_store_n(&probe->lost, false, __ATOMIC_RELAXED);
+        return;
+    }
+
+    target = &ping->targets[probe->target];
+    PING_ADD(target->num_lost, 1);
+    PING_ADD(ping->num_lost, 1);
+    /* Hops that stay silent are part of a TTL sweep, its summary tells them */
+    if (ping->options.output == PING_OUTPUT_TEXT && !ping->options.quiet && !ping->options.flood &&
+        !ping->trace)
+        printf("no reply from %s: icmp_seq=%u\n", target->addr, probe->seq);
+}
+
+/**
+ * Gives up on the probes whose reply is overdue, counting them as lost.
+ *
+ * Each target has its own reply timeout, so probes do not expire in the
+ * order they were sent: the deadline of each probe goes in a timer wheel
+ * of its own, at the first call after the send since the send paths do
+ * not touch it. Answered probes are dropped when their deadline comes up,
+ * or when their entry is reused.
+ *
+ * A cursor also follows the oldest probe whose fate is not settled, in
+ * sending order. A probe is given up on before its sequence can be
+ * mistaken for a newer one, half the sequence space later.
+ *
+ * The first reply and the expiry both claim the bit of the probe in the
+ * seen bitmap: only one of them wins, so a probe counts either as received
+ * or as lost, and a reply that comes after its deadline as late. The probe
+ * is marked lost before the expiry claims its bit, so that a reply finding
+ * the bit claimed by the expiry always sees it lost.
+ *
+ * @param ping The PING structure holding the in-flight table.
+ * @param now The current monotonic date in nanoseconds.
+ */
+void ping_expire(PING *ping, uint64_t now)
+{
+    t_ping_timer *timer;
+
+    while (ping->num_armed < ping->num_emit)
+    {
+        t_ping_probe *probe = &ping->inflight[(uint16_t)ping->num_armed++];
+
+        /* The probe sent before with this sequence may still be waiting, answered */
+        wheel_remove(&probe->timer);
+        wheel_add(&ping->deadlines, &probe->timer, probe->sent + ping->targets[probe->target].timeout);
+    }
+
+    wheel_advance(&ping->deadlines, now);
+    while ((timer = wheel_pop(&ping->deadlines)))
+        ping_lose(ping, (t_ping_probe *)((char *)timer - offsetof(t_ping_probe, timer)));
+
+    while (ping->num_expired < ping->num_emit)
+    {
+        t_ping_probe *probe = &ping->inflight[(uint16_t)ping->num_expired];
+
+        if (!ping_is_seen(ping, ping->num_expired))
+        {
+            if (ping->num_emit - ping->num_expired < PING_SEQ_SPACE / 2)
+                break;
+            wheel_remove(&probe->timer);
+            ping_lose(ping, probe);
+        }
+        ping->num_expired++;
+    }
+}
+
+/**
+ * Tells when the next probe waiting for its reply is given up on.
+ *
+ * Answered probes stay in the wheel until their deadline, the loop then
+ * wakes up for nothing, along with the probes that do expire then.
+ *
+ * @param ping The PING structure holding the in-flight table.
+ * @return Its monotonic date in nanoseconds, or UINT64_MAX if no probe is waiting.
+ */
+uint64_t ping_next_expiry(PING *ping)
+{
+    if (ping->num_expired == ping->num_emit)
+        return UINT64_MAX;
+    return wheel_next(&ping->deadlines);
+}
@@ -0,0 +1,185 @@
+#include "ft_ping.h"
+
+extern bool g_kill;
+
+/**
+ * @brief A receiver thread and its own receive buffers.
+ */
+typedef struct s_ping_rxthread
+{
+    PING *ping;
+    pthread_t thread;
+    int cpu; /* CPU to run on, -1 for any */
+    t_ping_rxring rx;
+} t_ping_rxthread;
+
+/**
+ * Pins the calling thread to a CPU.
+ *
+ * @param cpu The CPU, or -1 to leave the thread unpinned.
+ */
+static void pin_thread(int cpu)
+{
+    cpu_set_t set;
+    int error;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (error)
+        fprintf(stderr, "pthread_setaffinity_np: cpu %d: %s\n", cpu, strerror(error));
+}
+
+/**
+ * Receives and processes replies until the sender tells it to stop.
+ *
+ * The socket is polled with a short timeout so that the stop flag is seen
+ * even when no reply comes back.
+ */
+static void *rx_thread(void *arg)
+{
+    t_ping_rxthread *self = arg;
+    PING *ping = self->ping;
+    struct pollfd pfd[2] = {{.fd = ping->fd, .events = POLLIN}, {.fd = ping->fd6, .events = POLLIN}};
+    nfds_t nfds = ping->fd6 >= 0 ? 2 : 1;
+
+    pin_thread(self->cpu);
+    while (!__atomic_load_n(&ping->stop, __ATOMIC_ACQUIRE))
+    {
+        if (poll(pfd, nfds, ping->options.busy_poll ? 0 : PING_RX_POLL_MS) <= 0)
+            continue;
+        for (nfds_t i = 0; i < nfds; i++)
+            if (pfd[i].revents)
+                recv_packets(ping, pfd[i].fd, &self->rx);
+    }
+    PROFILE_FLUSH();
+    return NULL;
+}
+
+/**
+ * Sleeps until an absolute time of the monotonic clock.
+ *
+ * In adaptive mode, the sleep is cut short as soon as a receiver counts a
+ * reply, so that the next probe leaves right away.
+ *
+ * @param ping The PING structure.
+ * @param deadline The time to wake up at, in nanoseconds.
+ */
+static void sleep_until(PING *ping, uint64_t deadline)
+{
+    struct timespec ts;
+
+    if (ping->options.busy_poll)
+    {
+        while (now_ns() < deadline && !g_kill && !__atomic_load_n(&ping->num_kick, __ATOMIC_RELAXED))
+            ;
+        return;
+    }
+    if (ping->kick_fd >= 0)
+    {
+        struct pollfd pfd = {.fd = ping->kick_fd, .events = POLLIN};
+        eventfd_t kicks;
+
+        calculate_timeout(&ts, deadline, 0);
+        if (ppoll(&pfd, 1, &ts, NULL) > 0)
+            eventfd_read(ping->kick_fd, &kicks);
+        return;
+    }
+    ts.tv_sec = deadline / 1000000000;
+    ts.tv_nsec = deadline % 1000000000;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/**
+ * Runs the ping loop with a dedicated sender and receiver threads.
+ *
+ * The calling thread becomes the sender: it sleeps until the next send with
+ * an absolute monotonic deadline, so slow output or bursts of replies never
+ * delay a send. The receivers share the socket and match replies through the
+ * lock-free in-flight table.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 if the threads could not be started.
+ */
+int ping_loop_threaded(PING *ping)
+{
+    t_ping_rxthread threads[PING_MAX_THREADS];
+    size_t started = 0;
+    int result = 0;
+
+    uint64_t slot = (uint64_t)(ping->options.interval * 1000.0) / ping->num_targets;
+
+    if (slot < PING_PRECISE_INTERVAL)
+        prctl(PR_SET_TIMERSLACK, 1UL);
+    if (ping->options.adaptive)
+        ping->kick_fd = eventfd(0, EFD_NONBLOCK);
+
+    for (; started < ping->options.threads; started++)
+    {
+        t_ping_rxthread *self = &threads[started];
+        int error;
+
+        self->ping = ping;
+        self->cpu = started + 1 < ping->options.num_cpus ? ping->options.cpus[started + 1] : -1;
+        if (rxring_init(&self->rx, ping->rx.len))
+        {
+            perror("malloc");
+            result = 1;
+            break;
+        }
+        error = pthread_create(&self->thread, NULL, rx_thread, self);
+        if (error)
+        {
+            fprintf(stderr, "pthread_create: %s\n", strerror(error));
+            rxring_free(&self->rx);
+            result = 1;
+            break;
+        }
+    }
+    pin_thread(ping->options.num_cpus ? ping->options.cpus[0] : -1);
+
+    sched_init(ping);
+
+    while (!g_kill && !result)
+    {
+        if (!__atomic_load_n(&ping->num_kick, __ATOMIC_RELAXED))
+        {
+            uint64_t until = sched_next(ping);
+
+            sleep_until(ping, until);
+            PROFILE_WAKEUP(until);
+        }
+        if (ping_done(ping))
+            break;
+        if (!g_kill)
+        {
+            uint64_t now;
+
+            send_due(ping);
+            now = now_ns();
+            ping_expire(ping, now);
+            output_tick(ping, now);
+        }
+        if (ping->options.flood)
+            fflush(stdout);
+
+        if (ping_done(ping))
+            break;
+    }
+
+    __atomic_store_n(&ping->stop, true, __ATOMIC_RELEASE);
+    for (size_t i = 0; i < started; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        rxring_free(&threads[i].rx);
+    }
+    if (ping->kick_fd >= 0)
+    {
+        close(ping->kick_fd);
+        ping->kick_fd = -1;
+    }
+
+    return result;
+}
@@ -0,0 +1,531 @@
+#include "ft_ping.h"
+
+extern bool g_kill;
+
+/*
+ * TTL sweep (-H).
+ *
+ * Each round sends one probe per hop to every target at once, the TTL of
+ * each probe set with an IP_TTL or IPV6_HOPLIMIT control message rather
+ * than on the socket. The router where a probe expires answers with a time
+ * exceeded error quoting it, and its wire sequence gives the target and the
+ * hop back from the in-flight table, like any other reply. The target
+ * itself answers the probes that reach it, which tells how many hops the
+ * next rounds need.
+ *
+ * Since all hops are probed in parallel, a round takes one round trip to
+ * the farthest hop instead of one per hop, and the statistics of every hop
+ * are built up continuously, as mtr does. The probes of a round are spread
+ * over the interval rather than sent at once, which would overflow the
+ * receive buffer with the answers.
+ *
+ * Raw sockets receive the errors as packets. Datagram sockets only get
+ * them on their error queue (IP_RECVERR), with the probe they quote.
+ */
+
+/**
+ * Tells how many hops of a target are probed and reported.
+ *
+ * That is up to the target once it answered, or up to the farthest hop
+ * that did before, all of them when sending.
+ */
+static int trace_hops(t_ping_trace *trace, size_t i, bool sending)
+{
+    t_ping_hop *hops = &trace->hops[i * trace->max_ttl];
+    int last = 0;
+
+    if (trace->reached[i])
+        return trace->reached[i];
+    if (sending)
+        return trace->max_ttl;
+    for (int h = 0; h < trace->max_ttl; h++)
+        if (hops[h].received)
+            last = h + 1;
+    return last;
+}
+
+/**
+ * Formats the note traceroute appends to an unreachable hop.
+ */
+static const char *trace_note(t_ping_target *target, t_ping_hop *hop)
+{
+    int v6 = target->dest.ss_family == AF_INET6;
+
+    if (hop->type != ICMP_DEST_UNREACH)
+        return "";
+    switch (hop->code)
+    {
+    case 0:
+        return " !N";
+    case 1:
+        return v6 ? " !X" : " !H";
+    case 2:
+        return v6 ? " !S" : " !P";
+    case 3:
+        return v6 ? " !H" : "";
+    case 4:
+        return v6 ? "" : " !F";
+    case 9:
+    case 10:
+    case 13:
+        return v6 ? " !" : " !X";
+    default:
+        return " !";
+    }
+}
+
+/**
+ * Prints the hops of a target as a table, and appends them to the records.
+ */
+static void trace_print(PING *ping, size_t i)
+{
+    t_ping_target *target = &ping->targets[i];
+    t_ping_trace *trace = ping->trace;
+    t_ping_hop *hops = &trace->hops[i * trace->max_ttl];
+    int last = trace_hops(trace, i, false);
+    int width = sizeof("address") - 1;
+
+    for (int h = 0; h < last; h++)
+        output_hop(ping, target, h + 1, &hops[h], trace->rounds);
+    if (output_to_stdout(ping))
+        return;
+
+    for (int h = 0; h < last; h++)
+    {
+        int len = strlen(hops[h].from) + strlen(trace_note(target, &hops[h]));
+
+        if (len > width)
+            width = len;
+    }
+
+    printf("--- %s (%s) %zu rounds ---\n", target->hostname, target->addr, trace->rounds);
+    if (!last)
+    {
+        printf("no reply\n");
+        return;
+    }
+    printf("hop  %-*s  %6s %5s %7s %7s %7s %7s %7s\n", width, "address",
+           "loss%", "sent", "last", "avg", "best", "worst", "stddev");
+    for (int h = 0; h < last; h++)
+    {
+        t_ping_hop *hop = &hops[h];
+        char addr[INET6_ADDRSTRLEN + 4];
+
+        snprintf(addr, sizeof(addr), "%s%s", hop->received ? hop->from : "???", trace_note(target, hop));
+        printf("%3d  %-*s  %5.1f%% %5zu", h + 1, width, addr,
+               hop->sent ? (hop->sent - hop->received) * 100.0 / hop->sent : 0.0, hop->sent);
+        if (hop->stats.count)
+            printf(" %7.3f %7.3f %7.3f %7.3f %7.3f", hop->last, hop->stats.mean, hop->stats.min,
+                   hop->stats.max, stddev_stats(&hop->stats));
+        printf("\n");
+    }
+}
+
+/**
+ * Prints the hops of every target probed so far.
+ */
+static void trace_print_all(PING *ping)
+{
+    for (size_t i = 0; i < ping->num_targets; i++)
+        if (__atomic_load_n(&ping->targets[i].state, __ATOMIC_ACQUIRE) == PING_TARGET_READY)
+            trace_print(ping, i);
+    output_flush(ping);
+    fflush(stdout);
+}
+
+/**
+ * Sends the messages of a burst, one sendmmsg call per address family.
+ */
+static void trace_flush(PING *ping, struct mmsghdr msgs[2][PING_BATCH], size_t count[2])
+{
+    if (count[0])
+        send_messages(ping, ping->fd, msgs[0], count[0]);
+    if (count[1])
+        send_messages(ping, ping->fd6, msgs[1], count[1]);
+    count[0] = 0;
+    count[1] = 0;
+}
+
+/**
+ * Starts a round: one probe per hop to each resolved target.
+ */
+static void trace_round(PING *ping, uint64_t now)
+{
+    t_ping_trace *trace = ping->trace;
+
+    trace->size = 0;
+    for (size_t i = 0; i < ping->num_targets; i++)
+        if (__atomic_load_n(&ping->targets[i].state, __ATOMIC_ACQUIRE) == PING_TARGET_READY)
+            trace->size += trace_hops(trace, i, true);
+    trace->target = trace->size ? 0 : ping->num_targets;
+    trace->ttl = 1;
+    trace->done = 0;
+    trace->start = now;
+    trace->rounds++;
+}
+
+/**
+ * Sends the probes of the round whose date has come.
+ *
+ * The probes are spread evenly over the interval and go out in bursts of
+ * up to PING_BATCH, with the head of each one rewritten as for the pings
+ * and its TTL given as ancillary data. The -r rate caps them, and so does
+ * the sequence space: at most half of it waits for answers, so that a
+ * round too large for it goes on as the oldest probes are answered or
+ * given up on, rather than reusing their sequences.
+ *
+ * @param ping The PING structure.
+ * @param now The current monotonic date in nanoseconds.
+ * @param slot The interval between two rounds in nanoseconds.
+ * @return The monotonic date the round goes on at, UINT64_MAX once it is all sent.
+ */
+static uint64_t trace_send(PING *ping, uint64_t now, uint64_t slot)
+{
+    t_ping_trace *trace = ping->trace;
+    struct mmsghdr msgs[2][PING_BATCH];
+    struct iovec iov[PING_BATCH][2];
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control[PING_BATCH];
+    size_t count[2] = {0, 0};
+    size_t due = SIZE_MAX;
+    size_t tokens, k;
+
+    /* Past the interval, what is left goes, targets resolved meanwhile included */
+    if (slot && now - trace->start < slot)
+        due = (double)(now - trace->start) / slot * trace->size + 1;
+
+    while (trace->target < ping->num_targets && trace->done < due &&
+           ping->num_emit - ping->num_expired < PING_SEQ_SPACE / 2 && (tokens = sched_tokens(&ping->sched, now)))
+    {
+        for (k = 0; k < tokens && trace->target < ping->num_targets && trace->done < due &&
+                    ping->num_emit - ping->num_expired < PING_SEQ_SPACE / 2;)
+        {
+            t_ping_target *target = &ping->targets[trace->target];
+            int ttl = trace->ttl;
+            char *head = ping->txbuf + k * ping->headlen;
+            uint16_t wire_seq = ping->num_emit;
+            struct mmsghdr *msg;
+            struct cmsghdr *cmsg;
+            int v6;
+
+            if (__atomic_load_n(&target->state, __ATOMIC_ACQUIRE) != PING_TARGET_READY ||
+                ttl > trace_hops(trace, trace->target, true))
+            {
+                trace->target++;
+                trace->ttl = 1;
+                continue;
+            }
+            v6 = target->dest.ss_family == AF_INET6;
+            msg = &msgs[v6][count[v6]++];
+
+            memcpy(head, ping->packet, ping->headlen);
+            if (v6)
+                stamp_packet6((struct icmphdr *)head, ping->headlen, wire_seq);
+            else
+                stamp_packet((struct icmphdr *)head, ping->headlen, wire_seq);
+            iov[k][0].iov_base = head;
+            iov[k][0].iov_len = ping->headlen;
+            iov[k][1].iov_base = ping->packet + ping->headlen;
+            iov[k][1].iov_len = ping->packetlen - ping->headlen;
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_hdr.msg_iov = iov[k];
+            msg->msg_hdr.msg_iovlen = 2;
+            msg->msg_hdr.msg_name = &target->dest;
+            msg->msg_hdr.msg_namelen = target->destlen;
+            msg->msg_hdr.msg_control = control[k].buf;
+            msg->msg_hdr.msg_controllen = sizeof(control[k].buf);
+            cmsg = CMSG_FIRSTHDR(&msg->msg_hdr);
+            cmsg->cmsg_level = v6 ? IPPROTO_IPV6 : IPPROTO_IP;
+            cmsg->cmsg_type = v6 ? IPV6_HOPLIMIT : IP_TTL;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &ttl, sizeof(ttl));
+
+            /* The hop is the sequence within the target, replies and errors find it there */
+            ping->inflight[wire_seq].sent = now;
+            publish_probe(ping, wire_seq, trace->target, ttl - 1);
+            trace->hops[trace->target * trace->max_ttl + ttl - 1].sent++;
+            target->num_emit++;
+            __atomic_store_n(&ping->num_emit, ping->num_emit + 1, __ATOMIC_RELAXED);
+            trace->ttl++;
+            trace->done++;
+            k++;
+        }
+        trace_flush(ping, msgs, count);
+        sched_spend(&ping->sched, k);
+    }
+
+    if (trace->target >= ping->num_targets)
+        return UINT64_MAX;
+    if (trace->done < due)
+        return ping->sched.credit < ping->sched.cost ? sched_refill(&ping->sched) : UINT64_MAX;
+    return trace->start + (uint64_t)((double)trace->done / trace->size * slot);
+}
+
+/**
+ * Records the answer to a probe of the TTL sweep.
+ *
+ * A time exceeded error comes from the router at the hop of the probe. An
+ * echo reply or an unreachable error ends the path: the next rounds do not
+ * probe beyond it.
+ *
+ * @param ping The PING structure.
+ * @param probe The probe answered, its sequence being its hop.
+ * @param wire_seq The wire sequence number of the probe.
+ * @param type The ICMP type of the answer, ICMPv6 ones translated.
+ * @param code The ICMP code of the answer.
+ * @param from The address the answer came from.
+ * @param rx The kernel timestamps of the answer, or NULL to time it now.
+ */
+void trace_reply(PING *ping, t_ping_probe *probe, uint16_t wire_seq, uint8_t type, uint8_t code,
+                 const void *from, t_ping_stamp *rx)
+{
+    t_ping_trace *trace = ping->trace;
+    t_ping_target *target = &ping->targets[probe->target];
+    t_ping_hop *hop = &trace->hops[probe->target * trace->max_ttl + probe->seq];
+    uint8_t *reached = &trace->reached[probe->target];
+    struct timeval rtt;
+    int64_t ns;
+
+    if (ping_is_late(ping, wire_seq) || ping_mark_seen(ping, wire_seq))
+        return;
+
+    if (rx && rx->hw && probe->tx.hw)
+        ns = rx->hw - probe->tx.hw;
+    else if (rx && rx->sw && probe->tx.sw)
+        ns = rx->sw - probe->tx.sw;
+    else
+        ns = now_ns() - probe->sent;
+    ns_to_timeval(&rtt, ns);
+
+    format_addr(from, hop->from, sizeof(hop->from));
+    hop->type = type;
+    hop->code = code;
+    hop->received++;
+    hop->last = ns / 1000000.0;
+    calculate_stats(&hop->stats, &rtt);
+
+    if (type != ICMP_TIME_EXCEEDED && (!*reached || probe->seq + 1 < *reached))
+        *reached = probe->seq + 1;
+
+    if (ping->shared)
+        while (__atomic_test_and_set(&target->lock, __ATOMIC_ACQUIRE))
+            ;
+    target->num_recv++;
+    if (ping->shared)
+        __atomic_clear(&target->lock, __ATOMIC_RELEASE);
+    PING_ADD(ping->num_recv, 1);
+}
+
+/**
+ * Handles an entry of the error queue of a socket, if it is an ICMP error.
+ *
+ * @param ping The PING structure.
+ * @param fd The socket the entry was read from.
+ * @param msg The entry, its payload being the probe the error quotes.
+ * @param len The size of the payload.
+ * @return true if the entry was an ICMP error, whether it quoted a probe or not.
+ */
+bool trace_error(PING *ping, int fd, struct msghdr *msg, size_t len)
+{
+    struct icmphdr *echo = msg->msg_iov->iov_base;
+    struct sock_extended_err *ee = NULL;
+    bool v6 = fd == ping->fd6;
+    t_ping_probe *probe;
+    t_ping_stamp stamp;
+    uint8_t type;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+        if ((cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            ee = (struct sock_extended_err *)CMSG_DATA(cmsg);
+
+    if (!ee || (ee->ee_origin != SO_EE_ORIGIN_ICMP && ee->ee_origin != SO_EE_ORIGIN_ICMP6))
+        return false;
+    if (len < ICMP_MINLEN || echo->type != (v6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO))
+        return true;
+    if ((v6 ? ping->raw6 : ping->raw) && echo->un.echo.id != htons(ping->ident))
+        return true;
+    probe = ping_match_probe(ping, ntohs(echo->un.echo.sequence));
+    if (!probe)
+        return true;
+
+    if (v6)
+        type = ee->ee_type == ICMP6_TIME_EXCEEDED ? ICMP_TIME_EXCEEDED : ICMP_DEST_UNREACH;
+    else
+        type = ee->ee_type == ICMP_TIME_EXCEEDED ? ICMP_TIME_EXCEEDED : ICMP_DEST_UNREACH;
+    read_stamp(msg, &stamp);
+    trace_reply(ping, probe, ntohs(echo->un.echo.sequence), type, ee->ee_code, SO_EE_OFFENDER(ee), &stamp);
+    return true;
+}
+
+/**
+ * Drains the error queue of a socket.
+ */
+static void trace_recv_errors(PING *ping, int fd)
+{
+    struct mmsghdr *msgs;
+    int received;
+
+    do
+    {
+        msgs = rxring_batch(&ping->rx);
+        received = recvmmsg(fd, msgs, PING_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if (received <= 0)
+            return;
+        ping->num_recv_calls++;
+
+        for (int i = 0; i < received; i++)
+            trace_error(ping, fd, &msgs[i].msg_hdr, msgs[i].msg_len);
+    } while (received == PING_BATCH);
+}
+
+/**
+ * Asks datagram sockets for the errors their probes trigger, and sets up the hops.
+ *
+ * @return Returns 0 on success, or 1 on failure.
+ */
+static int trace_init(PING *ping)
+{
+    t_ping_trace *trace;
+    int on = 1;
+
+    if ((ping->fd >= 0 && !ping->raw &&
+         setsockopt(ping->fd, IPPROTO_IP, IP_RECVERR, &on, sizeof(on)) < 0) ||
+        (ping->fd6 >= 0 && !ping->raw6 &&
+         setsockopt(ping->fd6, IPPROTO_IPV6, IPV6_RECVERR, &on, sizeof(on)) < 0))
+    {
+        perror("setsockopt");
+        return 1;
+    }
+    /* A round's answers come back in a burst, the errors along with the echo replies */
+    if (ping->fd >= 0)
+        ping_grow_rcvbuf(ping->fd, PING_RCVBUF);
+    if (ping->fd6 >= 0)
+        ping_grow_rcvbuf(ping->fd6, PING_RCVBUF);
+
+    trace = calloc(1, sizeof(t_ping_trace));
+    ping->trace = trace;
+    if (!trace)
+    {
+        perror("calloc");
+        return 1;
+    }
+    trace->max_ttl = ping->options.ttl;
+    trace->target = ping->num_targets;
+    trace->reached = calloc(ping->num_targets, sizeof(uint8_t));
+    trace->hops = calloc(ping->num_targets * trace->max_ttl, sizeof(t_ping_hop));
+    if (!trace->reached || !trace->hops)
+    {
+        perror("calloc");
+        return 1;
+    }
+    for (size_t h = 0; h < ping->num_targets * trace->max_ttl; h++)
+        init_stats(&trace->hops[h].stats);
+    return 0;
+}
+
+/**
+ * Releases the TTL sweep.
+ *
+ * @param ping The PING structure.
+ */
+void trace_free(PING *ping)
+{
+    if (!ping->trace)
+        return;
+    free(ping->trace->reached);
+    free(ping->trace->hops);
+    free(ping->trace);
+    ping->trace = NULL;
+}
+
+/**
+ * Runs the TTL sweep of every target, one round per interval.
+ *
+ * It stops after -c rounds, once their probes are answered or timed out,
+ * at the -w deadline, or when interrupted. The hops are printed at the end, and every -I
+ * interval if given.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 on failure.
+ */
+int ping_trace_loop(PING *ping)
+{
+    struct pollfd pfd[2] = {{.fd = ping->fd, .events = POLLIN}, {.fd = ping->fd6, .events = POLLIN}};
+    uint64_t slot = (uint64_t)(ping->options.interval * 1000.0);
+    uint64_t summary = ping->options.summary;
+    uint64_t next, report, end = 0;
+
+    if (trace_init(ping))
+        return 1;
+
+    next = now_ns();
+    sched_rate(&ping->sched, ping->options.rate, next);
+    report = next + summary;
+    ping->end = ping->options.deadline ? next + ping->options.deadline : 0;
+    while (!g_kill)
+    {
+        uint64_t now = now_ns();
+        uint64_t until = now + PING_RX_POLL_MS * 1000000ULL;
+        uint64_t due = UINT64_MAX;
+        struct timespec timeout;
+
+        if (__atomic_load_n(&ping->num_failed, __ATOMIC_RELAXED) == ping->num_targets ||
+            (ping->end && now >= ping->end))
+            break;
+        output_tick(ping, now);
+        ping_expire(ping, now);
+        if (!end && ping->trace->target >= ping->num_targets && now >= next)
+        {
+            trace_round(ping, now);
+            next = now + slot;
+        }
+        if (ping->trace->target < ping->num_targets)
+            due = trace_send(ping, now, slot);
+        if (!end && ping->trace->target >= ping->num_targets && ping->options.count &&
+            ping->trace->rounds == ping->options.count)
+            end = now + ping->options.timeout;
+        if (end && (now >= end ||
+                    __atomic_load_n(&ping->num_recv, __ATOMIC_RELAXED) + ping->num_lost == ping->num_emit))
+            break;
+        if (summary && now >= report)
+        {
+            trace_print_all(ping);
+            while (report <= now)
+                report += summary;
+        }
+
+        if (due < until)
+            until = due;
+        if (!end && ping->trace->target >= ping->num_targets && next < until)
+            until = next;
+        if (ping_next_expiry(ping) < until)
+            until = ping_next_expiry(ping);
+        if (end && end < until)
+            until = end;
+        if (ping->end && ping->end < until)
+            until = ping->end;
+        if (summary && report < until)
+            until = report;
+        calculate_timeout(&timeout, until, 0);
+        if (ppoll(pfd, ping->fd6 >= 0 ? 2 : 1, &timeout, NULL) <= 0)
+            continue;
+        ping->num_wakeups++;
+        for (int i = 0; i < 2; i++)
+        {
+            /* Transmit timestamps share the error queue, they are read along with the errors */
+            if ((pfd[i].revents & POLLERR) && ping->options.timestamp)
+                recv_tx_stamps(ping, pfd[i].fd, &ping->rx);
+            else if (pfd[i].revents & POLLERR)
+                trace_recv_errors(ping, pfd[i].fd);
+            if (pfd[i].revents & POLLIN)
+                recv_packets(ping, pfd[i].fd, &ping->rx);
+        }
+    }
+
+    trace_print_all(ping);
+    return 0;
+}
@@ -0,0 +1,327 @@
+#include "ft_ping.h"
+
+/**
+ * @brief Number of submission queue entries, and of receive buffers.
+ */
+#define URING_ENTRIES 64
+
+/**
+ * @brief Identifies the completions of the receive and of the timer.
+ */
+#define URING_RECV 1
+#define URING_RECV6 2
+#define URING_TIMEOUT 3
+
+/**
+ * @brief Rings shared with the kernel, and the buffers it receives into.
+ */
+typedef struct s_ping_uring
+{
+    void *sq_ring;                 /* Submission queue ring mapping */
+    void *cq_ring;                 /* Completion queue ring mapping */
+    size_t sq_ring_len;
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes;     /* Submission queue entries mapping */
+    size_t sqes_len;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;  /* Buffers the kernel picks from */
+    char *buffers;
+    size_t buflen;                 /* Size of each buffer */
+    unsigned to_submit;            /* Entries queued since the last submission */
+    bool recv_armed[2];            /* The multishot receive of each socket is in flight */
+    struct msghdr msg;             /* Name and control sizes of the receive */
+    struct __kernel_timespec ts;   /* Date of the pending timer */
+} t_ping_uring;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Queues a new submission entry, zeroed but for its opcode and user data.
+ */
+static struct io_uring_sqe *uring_sqe(t_ping_uring *ring, uint8_t opcode, uint64_t user_data)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+
+    return sqe;
+}
+
+/**
+ * Hands a receive buffer back to the kernel.
+ */
+static void uring_recycle(t_ping_uring *ring, uint16_t bid)
+{
+    uint16_t tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (URING_ENTRIES - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + bid * ring->buflen);
+    buf->len = ring->buflen;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Sets up an io_uring instance with a ring of provided receive buffers.
+ *
+ * The rings are mapped and the buffers registered once. Replies are then
+ * received by a single multishot recvmsg request that keeps producing a
+ * completion per packet, each in a buffer the kernel picks from the ring.
+ *
+ * @param ping The PING structure.
+ * @return Returns 0 on success, or 1 if io_uring is unavailable.
+ */
+int uring_init(PING *ping)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    t_ping_uring *ring;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return 1;
+    ping->uring = ring;
+
+    memset(&params, 0, sizeof(params));
+    ping->loop_fd = uring_setup(URING_ENTRIES, &params);
+    if (ping->loop_fd < 0)
+        return 1;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        errno = ENOSYS;
+        return 1;
+    }
+
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_ring_len > ring->sq_ring_len)
+        ring->sq_ring_len = ring->cq_ring_len;
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ping->loop_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        return 1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ping->loop_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        return 1;
+    }
+
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+    /* Each buffer holds the recvmsg header, the address, the control data then the packet */
+    ring->msg.msg_namelen = sizeof(struct sockaddr_in6);
+    ring->msg.msg_controllen = PING_CMSG_SIZE;
+    ring->buflen = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in6) +
+                   PING_CMSG_SIZE + ping->rx.len;
+    ring->br = mmap(NULL, URING_ENTRIES * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->buffers = malloc(URING_ENTRIES * ring->buflen);
+    if (ring->br == MAP_FAILED || !ring->buffers)
+    {
+        if (ring->br == MAP_FAILED)
+            ring->br = NULL;
+        return 1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->br;
+    reg.ring_entries = URING_ENTRIES;
+    reg.bgid = 0;
+    if (uring_register(ping->loop_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return 1;
+    ring->br->tail = 0;
+    for (uint16_t bid = 0; bid < URING_ENTRIES; bid++)
+        uring_recycle(ring, bid);
+
+    return 0;
+}
+
+/**
+ * Parses one reply received by the multishot request.
+ *
+ * @param ping The PING structure.
+ * @param ring The io_uring backend.
+ * @param cqe The completion of the reply.
+ */
+static void uring_reply(PING *ping, t_ping_uring *ring, struct io_uring_cqe *cqe)
+{
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char *buf = ring->buffers + bid * ring->buflen;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buf;
+    char *from = (char *)(out + 1);
+    char *control = from + ring->msg.msg_namelen;
+    char *payload = control + ring->msg.msg_controllen;
+    struct msghdr msg = {.msg_name = from, .msg_namelen = out->namelen,
+                         .msg_control = control, .msg_controllen = out->controllen};
+
+    PING_ADD(ping->num_recv_packets, 1);
+    if (!(out->flags & MSG_TRUNC))
+        process_message(ping, &msg, payload, out->payloadlen);
+    uring_recycle(ring, bid);
+}
+
+/**
+ * Waits with io_uring, a timeout request firing at the date of the next send.
+ *
+ * The multishot receive stays armed across calls, and the timer is set with
+ * an absolute date. Queuing them and waiting for completions takes a single
+ * io_uring_enter() call, and replies are read without any further syscall.
+ *
+ * @param ping The PING structure.
+ * @param until The monotonic date of the next send in nanoseconds, 0 to poll.
+ * @return Returns 0 on success, or 1 on failure.
+ */
+int uring_wait(PING *ping, uint64_t until)
+{
+    t_ping_uring *ring = ping->uring;
+    struct io_uring_sqe *sqe;
+    unsigned wait = 1;
+
+    for (int v6 = 0; v6 < 2; v6++)
+    {
+        if (ring->recv_armed[v6] || (v6 && ping->fd6 < 0))
+            continue;
+        sqe = uring_sqe(ring, IORING_OP_RECVMSG, v6 ? URING_RECV6 : URING_RECV);
+        sqe->fd = v6 ? ping->fd6 : ping->fd;
+        sqe->addr = (uint64_t)(uintptr_t)&ring->msg;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        ring->recv_armed[v6] = true;
+    }
+
+    if (until <= now_ns())
+        wait = 0;
+    else if (until != ping->timer_armed)
+    {
+        ring->ts.tv_sec = until / 1000000000;
+        ring->ts.tv_nsec = until % 1000000000;
+        if (ping->timer_armed)
+        {
+            /* Move the pending timer rather than adding another one */
+            sqe = uring_sqe(ring, IORING_OP_TIMEOUT_REMOVE, 0);
+            sqe->addr = URING_TIMEOUT;
+            sqe->addr2 = (uint64_t)(uintptr_t)&ring->ts;
+            sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+        }
+        else
+        {
+            sqe = uring_sqe(ring, IORING_OP_TIMEOUT, URING_TIMEOUT);
+            sqe->addr = (uint64_t)(uintptr_t)&ring->ts;
+            sqe->len = 1;
+            sqe->timeout_flags = IORING_TIMEOUT_ABS;
+        }
+        ping->timer_armed = until;
+    }
+
+    /* Transmit timestamps still come from the error queue */
+    if (ping->options.timestamp)
+    {
+        recv_tx_stamps(ping, ping->fd, &ping->rx);
+        if (ping->fd6 >= 0)
+            recv_tx_stamps(ping, ping->fd6, &ping->rx);
+    }
+
+    if (ring->to_submit || wait)
+    {
+        unsigned head = *ring->cq_head;
+
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+            wait = 0;
+        if (uring_enter(ping->loop_fd, ring->to_submit, wait, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        {
+            perror("io_uring_enter");
+            return 1;
+        }
+        PING_ADD(ping->num_recv_calls, 1);
+        ring->to_submit = 0;
+    }
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+
+        /* A timer that fired before it could be moved is set again on the next call */
+        if (cqe->user_data == URING_TIMEOUT || (cqe->user_data == 0 && cqe->res < 0))
+            ping->timer_armed = 0;
+        else if (cqe->user_data == URING_RECV || cqe->user_data == URING_RECV6)
+        {
+            if (!(cqe->flags & IORING_CQE_F_MORE))
+                ring->recv_armed[cqe->user_data == URING_RECV6] = false;
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+                uring_reply(ping, ring, cqe);
+            else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR)
+            {
+                errno = -cqe->res;
+                perror("recvmsg");
+                return 1;
+            }
+        }
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+void uring_free(PING *ping)
+{
+    t_ping_uring *ring = ping->uring;
+
+    if (ring)
+    {
+        if (ring->sq_ring)
+            munmap(ring->sq_ring, ring->sq_ring_len);
+        if (ring->sqes)
+            munmap(ring->sqes, ring->sqes_len);
+        if (ring->br)
+            munmap(ring->br, URING_ENTRIES * sizeof(struct io_uring_buf));
+        free(ring->buffers);
+        free(ring);
+    }
+    if (ping->loop_fd >= 0)
+        close(ping->loop_fd);
+    ping->loop_fd = -1;
+    ping->uring = NULL;
+}
@@ -11,7 +11,7 @@
 int parse_count_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
 {
     char *p;
-    ping_args->count = strtol(argr->values[0], &p, 10);
+    long count = strtol(argr->values[0], &p, 10);
     if (errno == ERANGE)
     {
         printf("%s: invalid argument: '%s': %s\n",
@@ -23,12 +23,13 @@ int parse_count_arg(t_ping_options *ping_args, t_argr *argr, const char *prognam
         printf("%s: invalid count: '%s'\n", progname, argr->values[0]);
         return 1;
     }
-    if (ping_args->count < 1)
+    if (count < 1)
     {
         printf("%s: invalid argument: '%s': out of range: 1 <= value <= %lld\n",
                progname, argr->values[0], LLONG_MAX);
         return 1;
     }
+    ping_args->count = count;
     return 0;
 }
 
@@ -53,18 +54,21 @@ int parse_size_arg(t_ping_options *ping_args, t_argr *argr, const char *progname
 int parse_interval_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
 {
     char *p;
-    ping_args->interval = strtof(argr->values[0], &p) * 1000000;
-    if (*p)
+    double seconds = strtod(argr->values[0], &p);
+
+    if (*p || p == argr->values[0])
     {
         printf("%s: invalid interval: '%s'\n", progname, argr->values[0]);
         return 1;
     }
-    if (ping_args->interval < 0.2)
+    /* Also rejects inf and nan, which would not fit the nanoseconds of the schedule */
+    if (!(seconds >= 0 && seconds <= PING_MAX_SECONDS))
     {
-        printf("%s: invalid argument: '%s': out of range: 0 <= value <= 9223372036854775807\n",
-               progname, argr->values[0]);
+        printf("%s: invalid argument: '%s': out of range: 0 <= value <= %d\n",
+               progname, argr->values[0], PING_MAX_SECONDS);
         return 1;
     }
+    ping_args->interval = seconds * 1000000;
     return 0;
 }
 
@@ -92,91 +96,247 @@ int parse_ttl_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
     return 0;
 }
 
-/**
- * @brief Subtract two timeval structs.
- *
- * @param out The result of the subtraction.
- * @param in The timeval struct to subtract from out.
- */
-void tvsub(struct timeval *out, struct timeval *in)
+int parse_summary_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
 {
-    if ((out->tv_usec -= in->tv_usec) < 0)
+    char *p;
+    double seconds = strtod(argr->values[0], &p);
+
+    if (!strcmp(p, "ms"))
+        seconds /= 1000;
+    else if (!strcmp(p, "m"))
+        seconds *= 60;
+    else if (*p && strcmp(p, "s"))
     {
-        --out->tv_sec;
-        out->tv_usec += 1000000;
+        printf("%s: invalid summary interval: '%s'\n", progname, argr->values[0]);
+        return 1;
     }
-    out->tv_sec -= in->tv_sec;
+    if (seconds < 0.001 || seconds > 86400)
+    {
+        printf("%s: invalid argument: '%s': out of range: 1ms <= value <= 24h\n",
+               progname, argr->values[0]);
+        return 1;
+    }
+    ping_args->summary = seconds * 1000000000;
+    return 0;
 }
 
-void calculate_timeout(struct timeval *timeout, struct timeval *last, struct timeval *interval)
+int parse_output_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
 {
-    struct timeval now;
+    if (!strcmp(argr->values[0], "text"))
+        ping_args->output = PING_OUTPUT_TEXT;
+    else if (!strcmp(argr->values[0], "json"))
+        ping_args->output = PING_OUTPUT_JSON;
+    else if (!strcmp(argr->values[0], "binary"))
+        ping_args->output = PING_OUTPUT_BINARY;
+    else
+    {
+        printf("%s: invalid output format: '%s'\n", progname, argr->values[0]);
+        return 1;
+    }
+    return 0;
+}
 
-    gettimeofday(&now, NULL);
-    timeout->tv_sec = last->tv_sec + interval->tv_sec - now.tv_sec;
-    timeout->tv_usec = last->tv_usec + interval->tv_usec - now.tv_usec;
+int parse_evloop_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
+{
+    if (!evloop_find(argr->values[0]))
+    {
+        printf("%s: invalid event loop: '%s'\n", progname, argr->values[0]);
+        return 1;
+    }
+    ping_args->evloop = argr->values[0];
+    return 0;
+}
 
-    while (timeout->tv_usec < 0)
+int parse_threads_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
+{
+    char *p;
+    long threads = strtol(argr->values[0], &p, 10);
+    if (*p)
     {
-        timeout->tv_usec += 1000000;
-        timeout->tv_sec--;
+        printf("%s: invalid thread count: '%s'\n", progname, argr->values[0]);
+        return 1;
     }
-    while (timeout->tv_usec >= 1000000)
+    if (threads < 1 || threads > PING_MAX_THREADS)
     {
-        timeout->tv_usec -= 1000000;
-        timeout->tv_sec++;
+        printf("%s: invalid argument: '%s': out of range: 1 <= value <= %d\n",
+               progname, argr->values[0], PING_MAX_THREADS);
+        return 1;
     }
+    ping_args->threads = threads;
+    return 0;
+}
+
+int parse_affinity_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
+{
+    char *p = (char *)argr->values[0];
+
+    ping_args->num_cpus = 0;
+    do
+    {
+        long cpu = strtol(p, &p, 10);
+        if ((*p && *p != ',') || cpu < 0 || cpu >= CPU_SETSIZE ||
+            ping_args->num_cpus > PING_MAX_THREADS)
+        {
+            printf("%s: invalid cpu list: '%s'\n", progname, argr->values[0]);
+            return 1;
+        }
+        ping_args->cpus[ping_args->num_cpus++] = cpu;
+    } while (*p++);
+    return 0;
+}
 
-    if (timeout->tv_sec < 0)
-        timeout->tv_sec = timeout->tv_usec = 0;
+int parse_jitter_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
+{
+    char *p;
+    ping_args->jitter = strtof(argr->values[0], &p);
+    if (*p)
+    {
+        printf("%s: invalid jitter: '%s'\n", progname, argr->values[0]);
+        return 1;
+    }
+    if (!(ping_args->jitter >= 0 && ping_args->jitter <= 1))
+    {
+        printf("%s: invalid argument: '%s': out of range: 0 <= value <= 1\n",
+               progname, argr->values[0]);
+        return 1;
+    }
+    return 0;
+}
+
+int parse_rate_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
+{
+    char *p;
+    ping_args->rate = strtod(argr->values[0], &p);
+    if (*p)
+    {
+        printf("%s: invalid rate: '%s'\n", progname, argr->values[0]);
+        return 1;
+    }
+    if (!(ping_args->rate > 0 && ping_args->rate <= 1e9))
+    {
+        printf("%s: invalid argument: '%s': out of range: 0 < value <= 1000000000\n",
+               progname, argr->values[0]);
+        return 1;
+    }
+    return 0;
 }
 
 /**
- * Calculates the Internet Checksum (ICMP checksum) for the given data.
+ * Parses a duration in seconds, from a millisecond to a day.
  *
- * @param addr The address of the data.
- * @param len The length of the data in bytes.
- * @return The calculated ICMP checksum.
+ * @param ns Set to the duration in nanoseconds.
+ * @param argr The argument.
+ * @param what What the duration is, for the error messages.
+ * @param progname The name of the program.
+ * @return 0 if the duration is valid, other otherwise.
  */
-uint16_t icmp_cksum(uint16_t *icmph, int len)
+static int parse_seconds_arg(uint64_t *ns, t_argr *argr, const char *what, const char *progname)
 {
-    uint16_t ret = 0;
-    uint32_t sum = 0;
-    uint16_t odd_byte;
+    char *p;
+    double seconds = strtod(argr->values[0], &p);
 
-    while (len > 1)
+    if (*p || p == argr->values[0])
     {
-        sum += *icmph++;
-        len -= 2;
+        printf("%s: invalid %s: '%s'\n", progname, what, argr->values[0]);
+        return 1;
     }
-
-    if (len == 1)
+    if (!(seconds >= 0.001 && seconds <= PING_MAX_SECONDS))
     {
-        *(uint8_t *)(&odd_byte) = *(uint8_t *)icmph;
-        sum += odd_byte;
+        printf("%s: invalid argument: '%s': out of range: 0.001 <= value <= %d\n",
+               progname, argr->values[0], PING_MAX_SECONDS);
+        return 1;
     }
+    *ns = seconds * 1000000000;
+    return 0;
+}
+
+int parse_timeout_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
+{
+    return parse_seconds_arg(&ping_args->timeout, argr, "timeout", progname);
+}
 
-    sum = (sum >> 16) + (sum & 0xffff);
-    sum += (sum >> 16);
-    ret = ~sum;
+int parse_deadline_arg(t_ping_options *ping_args, t_argr *argr, const char *progname)
+{
+    return parse_seconds_arg(&ping_args->deadline, argr, "deadline", progname);
+}
 
-    return ret;
+/**
+ * @brief Subtract two timeval structs.
+ *
+ * @param out The result of the subtraction.
+ * @param in The timeval struct to subtract from out.
+ */
+void tvsub(struct timeval *out, struct timeval *in)
+{
+    if ((out->tv_usec -= in->tv_usec) < 0)
+    {
+        --out->tv_sec;
+        out->tv_usec += 1000000;
+    }
+    out->tv_sec -= in->tv_sec;
 }
 
-double nsqrt(double a, double prec)
+/**
+ * @brief Computes how long to wait until the next slot of the schedule.
+ *
+ * @param timeout Set to the time left until last + interval, or zero if it has passed.
+ * @param last The start of the current slot in monotonic nanoseconds.
+ * @param interval The length of a slot in nanoseconds.
+ */
+void calculate_timeout(struct timespec *timeout, uint64_t last, uint64_t interval)
 {
-    double x0, x1;
+    uint64_t now = now_ns();
+    uint64_t left = last + interval > now ? last + interval - now : 0;
 
-    if (a < 0)
-        return 0;
-    if (a < prec)
-        return 0;
-    x1 = a / 2;
-    do
+    timeout->tv_sec = left / 1000000000;
+    timeout->tv_nsec = left % 1000000000;
+}
+
+/**
+ * @brief Converts a duration or a date in nanoseconds to a timeval.
+ *
+ * @param tv The timeval to fill.
+ * @param ns The number of nanoseconds.
+ */
+void ns_to_timeval(struct timeval *tv, int64_t ns)
+{
+    tv->tv_sec = ns / 1000000000;
+    tv->tv_usec = ns % 1000000000 / 1000;
+    if (tv->tv_usec < 0)
     {
-        x0 = x1;
-        x1 = (x0 + a / x0) / 2;
-    } while (fabs(x1 - x0) > prec);
+        --tv->tv_sec;
+        tv->tv_usec += 1000000;
+    }
+}
+
+/**
+ * @brief Reads the monotonic clock, which is immune to wall clock adjustments.
+ *
+ * @return The current monotonic time in nanoseconds.
+ */
+uint64_t now_ns(void)
+{
+    struct timespec ts;
 
-    return x1;
-}
\ No newline at end of file
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @brief Formats an IPv4 or IPv6 socket address without its port.
+ *
+ * @param addr The sockaddr_in or sockaddr_in6 to format.
+ * @param buf The buffer to write to, INET6_ADDRSTRLEN bytes are enough.
+ * @param len The size of the buffer.
+ * @return The buffer.
+ */
+const char *format_addr(const void *addr, char *buf, size_t len)
+{
+    const struct sockaddr *sa = addr;
+
+    if (sa->sa_family == AF_INET6)
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, buf, len);
+    else
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, buf, len);
+    return buf;
+}
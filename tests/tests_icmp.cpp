@@ -0,0 +1,579 @@
+#include <atomic>
+#include <gtest/gtest.h>
+#include <random>
+#include <thread>
+#include <vector>
+
+extern "C"
+{
+#include "ft_ping.h"
+}
+
+/**
+ * The checksum of RFC 1071, one word at a time, as the reference.
+ */
+static uint16_t reference_cksum(const uint8_t *data, int len)
+{
+    uint32_t sum = 0;
+
+    for (int i = 0; i + 1 < len; i += 2)
+        sum += data[i] | data[i + 1] << 8;
+    if (len & 1)
+        sum += data[len - 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+static std::vector<uint8_t> random_bytes(size_t len, unsigned seed)
+{
+    std::mt19937 gen(seed);
+    std::vector<uint8_t> buf(len);
+
+    for (auto &byte : buf)
+        byte = gen();
+    return buf;
+}
+
+TEST(Cksum, KnownValue)
+{
+    /* Echo request with identifier 0x1234 and sequence 1, no payload */
+    uint8_t packet[8] = {8, 0, 0, 0, 0x12, 0x34, 0x00, 0x01};
+
+    EXPECT_EQ(icmp_cksum((uint16_t *)packet, sizeof(packet)), reference_cksum(packet, sizeof(packet)));
+}
+
+TEST(Cksum, MatchesTheReferenceForAllLengths)
+{
+    auto buf = random_bytes(2048 + 8, 1);
+
+    for (int offset = 0; offset < 8; offset += 2)
+        for (int len = 0; len <= 2048; len++)
+            ASSERT_EQ(icmp_cksum((uint16_t *)(buf.data() + offset), len),
+                      reference_cksum(buf.data() + offset, len))
+                << "offset " << offset << ", length " << len;
+}
+
+TEST(Cksum, AllImplementationsAgree)
+{
+    auto buf = random_bytes(1500 + 8, 2);
+
+    for (const t_cksum_impl *impl = cksum_impls; impl->name; impl++)
+    {
+        if (!impl->supported())
+            continue;
+        for (int offset = 0; offset < 8; offset++)
+            for (int len = 0; len <= 1500; len++)
+                ASSERT_EQ(impl->fn((uint16_t *)(buf.data() + offset), len),
+                          cksum_scalar((uint16_t *)(buf.data() + offset), len))
+                    << impl->name << ": offset " << offset << ", length " << len;
+    }
+}
+
+TEST(Cksum, ValidPacketSumsToZero)
+{
+    auto buf = random_bytes(64, 3);
+
+    buf[2] = buf[3] = 0;
+    uint16_t cksum = icmp_cksum((uint16_t *)buf.data(), buf.size());
+    memcpy(&buf[2], &cksum, sizeof(cksum));
+    EXPECT_EQ(icmp_cksum((uint16_t *)buf.data(), buf.size()), 0);
+}
+
+TEST(Cksum, IncrementalUpdateMatchesAFullSum)
+{
+    auto buf = random_bytes(64, 4);
+    uint16_t *words = (uint16_t *)buf.data();
+    uint16_t old[4];
+
+    uint16_t cksum = icmp_cksum(words, buf.size());
+    memcpy(old, words + 10, sizeof(old));
+    for (int i = 0; i < 4; i++)
+        words[10 + i] ^= 0x5a5a + i;
+
+    EXPECT_EQ(cksum_update(cksum, old, words + 10, 4), icmp_cksum(words, buf.size()));
+}
+
+/**
+ * A PING structure with one IPv4 target and no socket, enough to build
+ * packets and feed replies to the receive path.
+ */
+class PingTest : public ::testing::Test
+{
+protected:
+    PING ping;
+
+    void SetUp() override
+    {
+        memset(&ping, 0, sizeof(ping));
+        ping.fd = -1;
+        ping.fd6 = -1;
+        ping.raw = true;
+        ping.ident = 0x1234;
+        ping.options.quiet = true;
+        ping.options.output = PING_OUTPUT_TEXT;
+        ping.options.family = AF_UNSPEC;
+        ping.datalen = 56;
+        ping.packetlen = sizeof(struct icmphdr) + ping.datalen;
+        ping.headlen = sizeof(struct icmphdr) + sizeof(struct timeval);
+        ping.inflight = (t_ping_probe *)malloc(PING_SEQ_SPACE * sizeof(t_ping_probe));
+        ping_reset_inflight(&ping);
+        ping.seen = (uint64_t *)calloc(PING_SEQ_SPACE / 64, sizeof(uint64_t));
+        ASSERT_EQ(ping_add_target(&ping, "127.0.0.1"), 0);
+        ASSERT_EQ(ping.targets[0].state, PING_TARGET_READY);
+    }
+
+    void TearDown() override
+    {
+        free(ping.inflight);
+        free(ping.seen);
+        for (size_t i = 0; i < ping.num_targets; i++)
+            free(ping.targets[i].stats.hist);
+        free(ping.targets);
+    }
+
+    /** Marks the next wire sequence as sent to the target. */
+    uint16_t send_probe()
+    {
+        uint16_t wire_seq = ping.num_emit;
+
+        publish_probe(&ping, wire_seq, 0, ping.targets[0].num_emit++);
+        ping.num_emit++;
+        return wire_seq;
+    }
+
+    /** Builds an IPv4 datagram carrying an echo reply. */
+    std::vector<char> echo_reply(uint16_t wire_seq, uint16_t id)
+    {
+        std::vector<char> packet(sizeof(struct ip) + ping.packetlen);
+        struct ip *ip = (struct ip *)packet.data();
+        struct icmphdr *icp = (struct icmphdr *)(ip + 1);
+        struct timeval now;
+
+        ip->ip_hl = 5;
+        ip->ip_v = 4;
+        ip->ip_ttl = 61;
+        ip->ip_p = IPPROTO_ICMP;
+        icp->type = ICMP_ECHOREPLY;
+        icp->un.echo.id = htons(id);
+        icp->un.echo.sequence = htons(wire_seq);
+        gettimeofday(&now, NULL);
+        memcpy(icp + 1, &now, sizeof(now));
+        return packet;
+    }
+
+    /** Builds a time exceeded error quoting one of our echo requests. */
+    std::vector<char> time_exceeded(uint16_t wire_seq)
+    {
+        std::vector<char> packet(2 * sizeof(struct ip) + 2 * sizeof(struct icmphdr));
+        struct ip *ip = (struct ip *)packet.data();
+        struct icmphdr *icp = (struct icmphdr *)(ip + 1);
+        struct ip *orig = (struct ip *)(icp + 1);
+        struct icmphdr *echo = (struct icmphdr *)(orig + 1);
+
+        ip->ip_hl = 5;
+        ip->ip_ttl = 250;
+        icp->type = ICMP_TIME_EXCEEDED;
+        orig->ip_hl = 5;
+        echo->type = ICMP_ECHO;
+        echo->un.echo.id = htons(ping.ident);
+        echo->un.echo.sequence = htons(wire_seq);
+        return packet;
+    }
+
+    int receive(std::vector<char> &packet)
+    {
+        struct sockaddr_in from;
+
+        memset(&from, 0, sizeof(from));
+        from.sin_family = AF_INET;
+        from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        return process_packet(&ping, packet.data(), packet.size(), &from, NULL);
+    }
+};
+
+TEST_F(PingTest, TemplateHasAValidChecksum)
+{
+    std::vector<char> packet(ping.packetlen);
+
+    create_packet(&ping, (struct icmphdr *)packet.data(), packet.size());
+    EXPECT_EQ(((struct icmphdr *)packet.data())->type, ICMP_ECHO);
+    EXPECT_EQ(ntohs(((struct icmphdr *)packet.data())->un.echo.id), 0x1234);
+    EXPECT_EQ(icmp_cksum((uint16_t *)packet.data(), packet.size()), 0);
+}
+
+TEST_F(PingTest, StampedPacketsKeepAValidChecksum)
+{
+    std::vector<char> packet(ping.packetlen);
+    struct icmphdr *icp = (struct icmphdr *)packet.data();
+
+    create_packet(&ping, icp, packet.size());
+    for (uint16_t seq : {1, 255, 256, 65535})
+    {
+        std::vector<char> copy = packet;
+
+        stamp_packet((struct icmphdr *)copy.data(), ping.headlen, seq);
+        EXPECT_EQ(ntohs(((struct icmphdr *)copy.data())->un.echo.sequence), seq);
+        EXPECT_EQ(icmp_cksum((uint16_t *)copy.data(), copy.size()), 0) << "sequence " << seq;
+    }
+}
+
+TEST_F(PingTest, ReplyIsMatchedAndTimed)
+{
+    uint16_t wire_seq = send_probe();
+    auto reply = echo_reply(wire_seq, ping.ident);
+
+    EXPECT_EQ(receive(reply), 0);
+    EXPECT_EQ(ping.targets[0].num_recv, 1u);
+    EXPECT_EQ(ping.targets[0].stats.count, 1u);
+    EXPECT_EQ(ping.num_recv, 1u);
+    EXPECT_EQ(ping.num_rept, 0u);
+}
+
+TEST_F(PingTest, HistogramsAreKeptPerTargetOnlyForFewTargets)
+{
+    uint16_t wire_seq = send_probe();
+    auto reply = echo_reply(wire_seq, ping.ident);
+
+    receive(reply);
+    ASSERT_NE(ping.targets[0].stats.hist, nullptr);
+    EXPECT_EQ(ping.targets[0].stats.hist->count, 1u);
+    EXPECT_EQ(ping.hist.count, 1u);
+
+    for (size_t i = 0; i < PING_HIST_TARGETS; i++)
+        ASSERT_EQ(ping_add_target(&ping, "127.0.0.2"), 0);
+    publish_probe(&ping, ++wire_seq, 1, ping.targets[1].num_emit++);
+    reply = echo_reply(wire_seq, ping.ident);
+    receive(reply);
+    EXPECT_EQ(ping.targets[1].stats.count, 1u);
+    EXPECT_EQ(ping.targets[1].stats.hist, nullptr);
+    EXPECT_EQ(ping.hist.count, 2u);
+}
+
+TEST_F(PingTest, SecondReplyIsADuplicate)
+{
+    uint16_t wire_seq = send_probe();
+    auto reply = echo_reply(wire_seq, ping.ident);
+
+    receive(reply);
+    receive(reply);
+    EXPECT_EQ(ping.targets[0].num_recv, 1u);
+    EXPECT_EQ(ping.targets[0].num_rept, 1u);
+    EXPECT_EQ(ping.num_rept, 1u);
+}
+
+TEST_F(PingTest, ProbeSentAgainIsNotADuplicate)
+{
+    uint16_t wire_seq = send_probe();
+    auto reply = echo_reply(wire_seq, ping.ident);
+
+    receive(reply);
+    /* The sequence space wrapped around and the number is reused */
+    publish_probe(&ping, wire_seq, 0, ping.targets[0].num_emit++);
+    receive(reply);
+    EXPECT_EQ(ping.targets[0].num_rept, 0u);
+    EXPECT_EQ(ping.targets[0].num_recv, 2u);
+}
+
+TEST_F(PingTest, OverdueProbeIsLostAndItsReplyLate)
+{
+    uint64_t now = now_ns();
+    uint16_t answered = send_probe();
+    uint16_t lost = send_probe();
+    uint16_t waiting = send_probe();
+    auto reply = echo_reply(answered, ping.ident);
+    auto late = echo_reply(lost, ping.ident);
+
+    ping.targets[0].timeout = 1000000000;
+    ping.inflight[answered].sent = now;
+    ping.inflight[lost].sent = now;
+    ping.inflight[waiting].sent = now + 500000000;
+    receive(reply);
+
+    ping_expire(&ping, now + 1200000000);
+    EXPECT_EQ(ping.num_lost, 1u);
+    EXPECT_EQ(ping.targets[0].num_lost, 1u);
+    EXPECT_EQ(ping_next_expiry(&ping), now + 1500000000);
+
+    receive(late);
+    EXPECT_EQ(ping.targets[0].num_late, 1u);
+    EXPECT_EQ(ping.targets[0].num_rept, 0u);
+    EXPECT_EQ(ping.num_recv + ping.num_lost, 2u);
+}
+
+TEST_F(PingTest, EachTargetWaitsItsOwnTimeout)
+{
+    uint64_t now = now_ns();
+
+    ASSERT_EQ(ping_add_target(&ping, "127.0.0.2"), 0);
+    ping.targets[0].timeout = 5000000000;
+    ping.targets[1].timeout = 1000000000;
+    uint16_t slow = send_probe();
+    uint16_t fast = ping.num_emit++;
+
+    publish_probe(&ping, fast, 1, ping.targets[1].num_emit++);
+    ping.inflight[slow].sent = now;
+    ping.inflight[fast].sent = now;
+
+    /* The probe sent later expires first, the one before it still waits */
+    ping_expire(&ping, now + 2000000000);
+    EXPECT_EQ(ping.targets[0].num_lost, 0u);
+    EXPECT_EQ(ping.targets[1].num_lost, 1u);
+    EXPECT_EQ(ping_next_expiry(&ping), now + 5000000000);
+    EXPECT_EQ(ping.num_expired, 0u);
+
+    ping_expire(&ping, now + 5000000000);
+    EXPECT_EQ(ping.targets[0].num_lost, 1u);
+    EXPECT_EQ(ping.num_expired, 2u);
+    EXPECT_EQ(ping_next_expiry(&ping), UINT64_MAX);
+}
+
+TEST_F(PingTest, ReplyRacingTheExpiryIsLateNotADuplicate)
+{
+    const size_t count = PING_SEQ_SPACE / 2 - PING_BATCH;
+    std::vector<std::vector<char>> replies;
+    std::atomic<size_t> replying(0), expiring(0);
+
+    /* A receiver thread and the expiry go in step, claiming each probe at the same time */
+    ping.shared = true;
+    ping.targets[0].timeout = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint16_t wire_seq = send_probe();
+
+        /* One tick of the deadline wheel apart, so that they expire one by one */
+        ping.inflight[wire_seq].sent = i << PING_WHEEL_TICK_SHIFT;
+        replies.push_back(echo_reply(wire_seq, ping.ident));
+    }
+    std::thread receiver([&] {
+        for (size_t i = 0; i < count; i++)
+        {
+            replying.store(i, std::memory_order_relaxed);
+            while (expiring.load(std::memory_order_relaxed) < i)
+                std::this_thread::yield();
+            receive(replies[i]);
+        }
+    });
+    for (size_t i = 0; i < count; i++)
+    {
+        expiring.store(i, std::memory_order_relaxed);
+        while (replying.load(std::memory_order_relaxed) < i)
+            std::this_thread::yield();
+        ping_expire(&ping, (i << PING_WHEEL_TICK_SHIFT) + 1);
+    }
+    receiver.join();
+
+    EXPECT_EQ(ping.num_rept, 0u);
+    EXPECT_EQ(ping.num_recv + ping.num_lost, count);
+    EXPECT_EQ(ping.targets[0].num_late, ping.num_lost);
+}
+
+TEST_F(PingTest, RepliesOfOthersAreIgnored)
+{
+    uint16_t wire_seq = send_probe();
+    auto other = echo_reply(wire_seq, ping.ident + 1);
+    auto unsent = echo_reply(wire_seq + 1, ping.ident);
+
+    EXPECT_EQ(receive(other), -1);
+    EXPECT_EQ(receive(unsent), -1);
+    EXPECT_EQ(ping.num_recv, 0u);
+}
+
+TEST_F(PingTest, TruncatedPacketsAreIgnored)
+{
+    uint16_t wire_seq = send_probe();
+    auto reply = echo_reply(wire_seq, ping.ident);
+
+    reply.resize(sizeof(struct ip) + ICMP_MINLEN - 1);
+    EXPECT_EQ(receive(reply), -1);
+}
+
+TEST_F(PingTest, ErrorQuotingOurProbeIsCounted)
+{
+    uint16_t wire_seq = send_probe();
+    auto error = time_exceeded(wire_seq);
+
+    testing::internal::CaptureStdout();
+    ping.options.quiet = false;
+    EXPECT_EQ(receive(error), 0);
+    std::string out = testing::internal::GetCapturedStdout();
+
+    EXPECT_NE(out.find("Time to live exceeded"), std::string::npos);
+    EXPECT_EQ(ping.targets[0].num_err, 1u);
+    EXPECT_EQ(ping.targets[0].stats.count, 0u);
+}
+
+TEST_F(PingTest, LaterReplyFirstMarksReordering)
+{
+    uint16_t first = send_probe();
+    uint16_t second = send_probe();
+    auto late = echo_reply(first, ping.ident);
+    auto early = echo_reply(second, ping.ident);
+
+    receive(early);
+    receive(late);
+    EXPECT_EQ(ping.targets[0].num_reorder, 1u);
+    EXPECT_EQ(ping.targets[0].num_recv, 2u);
+}
+
+TEST_F(PingTest, OldSequencesAreLate)
+{
+    ping.num_emit = 1000;
+    EXPECT_FALSE(ping_is_late(&ping, 999));
+    EXPECT_FALSE(ping_is_late(&ping, 1000 + PING_BATCH / 2));
+    EXPECT_TRUE(ping_is_late(&ping, (uint16_t)(1000 + PING_SEQ_SPACE / 2)));
+}
+
+TEST_F(PingTest, SeenBitIsClearedOnPublish)
+{
+    EXPECT_FALSE(ping_mark_seen(&ping, 7));
+    EXPECT_TRUE(ping_mark_seen(&ping, 7));
+    publish_probe(&ping, 7, 0, 0);
+    EXPECT_FALSE(ping_mark_seen(&ping, 7));
+}
+
+TEST_F(PingTest, PmtuCountsOnlyTheSizeInFlight)
+{
+    t_ping_pmtu pmtu;
+    uint16_t stale = send_probe();
+    uint16_t wire_seq = send_probe();
+    auto old = echo_reply(stale, ping.ident);
+    auto reply = echo_reply(wire_seq, ping.ident);
+
+    memset(&pmtu, 0, sizeof(pmtu));
+    pmtu.ok = PING_PMTU_MIN - 1;
+    pmtu.bad = 1501;
+    pmtu.size = 1500;
+    pmtu.first_seq = pmtu.wire_seq = wire_seq;
+    ping.pmtu = &pmtu;
+
+    receive(old);
+    EXPECT_EQ(pmtu.ok, PING_PMTU_MIN - 1u);
+    receive(reply);
+    EXPECT_EQ(pmtu.ok, 1500u);
+    EXPECT_TRUE(pmtu.answered);
+    EXPECT_EQ(pmtu.size, 0u);
+    EXPECT_EQ(ping.targets[0].stats.count, 0u);
+    ping.pmtu = NULL;
+}
+
+TEST_F(PingTest, TraceCountsAnswersAtTheHopOfTheirProbe)
+{
+    t_ping_trace trace;
+    t_ping_hop hops[3];
+    uint8_t reached = 0;
+    auto probe = [&](uint32_t hop) {
+        uint16_t wire_seq = ping.num_emit++;
+
+        ping.inflight[wire_seq].sent = now_ns();
+        publish_probe(&ping, wire_seq, 0, hop);
+        return wire_seq;
+    };
+
+    memset(&trace, 0, sizeof(trace));
+    memset(hops, 0, sizeof(hops));
+    for (auto &hop : hops)
+        init_stats(&hop.stats);
+    trace.max_ttl = 3;
+    trace.reached = &reached;
+    trace.hops = hops;
+    ping.trace = &trace;
+
+    uint16_t ttl1 = probe(0), ttl2 = probe(1), ttl3 = probe(2);
+    auto error = time_exceeded(ttl1);
+    auto reply = echo_reply(ttl2, ping.ident);
+    auto beyond = echo_reply(ttl3, ping.ident);
+
+    EXPECT_EQ(receive(beyond), 0);
+    EXPECT_EQ(receive(error), 0);
+    EXPECT_EQ(receive(reply), 0);
+    EXPECT_EQ(receive(error), 0);
+
+    EXPECT_EQ(hops[0].received, 1u);
+    EXPECT_EQ(hops[0].type, ICMP_TIME_EXCEEDED);
+    EXPECT_STREQ(hops[0].from, "127.0.0.1");
+    EXPECT_EQ(hops[1].type, ICMP_ECHOREPLY);
+    EXPECT_EQ(hops[1].stats.count, 1u);
+    EXPECT_EQ(reached, 2);
+    EXPECT_EQ(ping.targets[0].num_err, 0u);
+    ping.trace = NULL;
+}
+
+TEST_F(PingTest, CaptureReplaysToTheSameRoundTrip)
+{
+    char path[] = "/tmp/ft_ping_captureXXXXXX";
+    std::vector<char> probe(ping.packetlen);
+    auto reply = echo_reply(5, ping.ident);
+    struct sockaddr_in from;
+    struct iovec iov = {probe.data(), probe.size()};
+    struct msghdr msg;
+    struct timespec now;
+    t_ping_stamp rx;
+
+    close(mkstemp(path));
+    ping.progname = "ft_ping";
+    ping.options.capture = path;
+    ping.cap.fd = -1;
+    ASSERT_EQ(capture_open(&ping), 0);
+
+    create_packet(&ping, (struct icmphdr *)probe.data(), probe.size());
+    stamp_packet((struct icmphdr *)probe.data(), ping.headlen, 5);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &ping.targets[0].dest;
+    msg.msg_namelen = ping.targets[0].destlen;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    capture_sent(&ping, &msg);
+
+    /* Received 1.5 ms later, by the clock of the capture */
+    clock_gettime(CLOCK_REALTIME, &now);
+    rx.sw = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec + 1500000;
+    rx.hw = 0;
+    memset(&from, 0, sizeof(from));
+    from.sin_family = AF_INET;
+    from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    capture_received(&ping, &from, reply.data(), reply.size(), &rx, -1);
+    capture_close(&ping);
+
+    /* Start over from the capture alone */
+    free(ping.targets);
+    ping.targets = NULL;
+    ping.num_targets = ping.max_targets = 0;
+    ping.num_emit = 0;
+    ping_reset_inflight(&ping);
+    ping.options.replay = path;
+    EXPECT_EQ(ping_replay(&ping), 0);
+    unlink(path);
+
+    ASSERT_EQ(ping.num_targets, 1u);
+    EXPECT_STREQ(ping.targets[0].addr, "127.0.0.1");
+    EXPECT_EQ(ping.targets[0].num_emit, 1u);
+    EXPECT_EQ(ping.targets[0].num_recv, 1u);
+    ASSERT_EQ(ping.targets[0].stats.count, 1u);
+    EXPECT_NEAR(ping.targets[0].stats.mean, 1.5, 0.1);
+}
+
+TEST(Loop, DeadlineRunLosesNothingOnLoopback)
+{
+    const char *threads[] = {"ft_ping", "-q", "-w", "1", "-i", "0.2", "-T", "1", "127.0.0.1", NULL};
+    const char *single[] = {"ft_ping", "-q", "-w", "1", "-i", "0.2", "127.0.0.1", NULL};
+
+    for (const char **argv : {single, threads})
+    {
+        PING ping;
+
+        memset(&ping, 0, sizeof(ping));
+        ASSERT_EQ(ping_parse_args(&ping, argv), 0);
+        if (ping.fd < 0)
+        {
+            ping_free(&ping);
+            GTEST_SKIP() << "no ICMP socket";
+        }
+        EXPECT_EQ(ping.options.threads ? ping_loop_threaded(&ping) : ping_loop(&ping), 0);
+
+        /* The probe due at the deadline is not sent */
+        EXPECT_EQ(ping.num_emit, 5u) << argv[6];
+        EXPECT_EQ(ping.num_recv, ping.num_emit) << argv[6];
+        ping_free(&ping);
+    }
+}
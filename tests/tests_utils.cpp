@@ -0,0 +1,422 @@
+#include <gtest/gtest.h>
+#include <random>
+#include <vector>
+
+extern "C"
+{
+#include "ft_ping.h"
+}
+
+/**
+ * Builds the argument of an option as libargparse hands it to the parsers.
+ */
+class ArgTest : public ::testing::Test
+{
+protected:
+    t_ping_options options;
+    t_argr argr;
+    char *values[1];
+
+    void SetUp() override
+    {
+        memset(&options, 0, sizeof(options));
+        argr.option = NULL;
+        argr.values = values;
+    }
+
+    int parse(int (*parser)(t_ping_options *, t_argr *, const char *), const char *value)
+    {
+        values[0] = (char *)value;
+        errno = 0;
+        return parser(&options, &argr, "ft_ping");
+    }
+};
+
+TEST(Tvsub, SubtractsWithoutBorrow)
+{
+    struct timeval out = {10, 500000};
+    struct timeval in = {3, 200000};
+
+    tvsub(&out, &in);
+    EXPECT_EQ(out.tv_sec, 7);
+    EXPECT_EQ(out.tv_usec, 300000);
+}
+
+TEST(Tvsub, BorrowsASecond)
+{
+    struct timeval out = {10, 100000};
+    struct timeval in = {3, 200000};
+
+    tvsub(&out, &in);
+    EXPECT_EQ(out.tv_sec, 6);
+    EXPECT_EQ(out.tv_usec, 900000);
+}
+
+TEST(Tvsub, EqualTimesGiveZero)
+{
+    struct timeval out = {5, 123456};
+    struct timeval in = out;
+
+    tvsub(&out, &in);
+    EXPECT_EQ(out.tv_sec, 0);
+    EXPECT_EQ(out.tv_usec, 0);
+}
+
+TEST(CalculateTimeout, PastSlotGivesZero)
+{
+    struct timespec timeout;
+
+    calculate_timeout(&timeout, now_ns() - 2000000000ULL, 1000000000ULL);
+    EXPECT_EQ(timeout.tv_sec, 0);
+    EXPECT_EQ(timeout.tv_nsec, 0);
+}
+
+TEST(CalculateTimeout, FutureSlotGivesTimeLeft)
+{
+    struct timespec timeout;
+
+    calculate_timeout(&timeout, now_ns(), 1500000000ULL);
+    EXPECT_EQ(timeout.tv_sec, 1);
+    EXPECT_GT(timeout.tv_nsec, 400000000);
+    EXPECT_LE(timeout.tv_nsec, 500000000);
+}
+
+TEST(CalculateTimeout, NanosecondsStayBelowASecond)
+{
+    struct timespec timeout;
+
+    calculate_timeout(&timeout, now_ns() + 3000000000ULL, 0);
+    EXPECT_GE(timeout.tv_sec, 2);
+    EXPECT_LT(timeout.tv_nsec, 1000000000);
+}
+
+TEST_F(ArgTest, CountAcceptsPositiveNumbers)
+{
+    EXPECT_EQ(parse(parse_count_arg, "42"), 0);
+    EXPECT_EQ(options.count, 42u);
+}
+
+TEST_F(ArgTest, CountRejectsZeroGarbageAndOverflow)
+{
+    EXPECT_NE(parse(parse_count_arg, "0"), 0);
+    EXPECT_NE(parse(parse_count_arg, "-3"), 0);
+    EXPECT_NE(parse(parse_count_arg, "12abc"), 0);
+    EXPECT_NE(parse(parse_count_arg, "99999999999999999999999"), 0);
+}
+
+TEST_F(ArgTest, SizeAcceptsUpToTheMaximum)
+{
+    EXPECT_EQ(parse(parse_size_arg, "0"), 0);
+    EXPECT_EQ(options.size, 0);
+    EXPECT_EQ(parse(parse_size_arg, std::to_string(PING_MAX_DATALEN).c_str()), 0);
+    EXPECT_EQ(options.size, PING_MAX_DATALEN);
+}
+
+TEST_F(ArgTest, SizeRejectsTooBigAndGarbage)
+{
+    EXPECT_NE(parse(parse_size_arg, std::to_string(PING_MAX_DATALEN + 1).c_str()), 0);
+    EXPECT_NE(parse(parse_size_arg, "56b"), 0);
+}
+
+TEST_F(ArgTest, IntervalIsStoredInMicroseconds)
+{
+    EXPECT_EQ(parse(parse_interval_arg, "0.5"), 0);
+    EXPECT_FLOAT_EQ(options.interval, 500000);
+    EXPECT_EQ(parse(parse_interval_arg, "0"), 0);
+    EXPECT_FLOAT_EQ(options.interval, 0);
+}
+
+TEST_F(ArgTest, IntervalRejectsNegativeAndGarbage)
+{
+    EXPECT_NE(parse(parse_interval_arg, "-1"), 0);
+    EXPECT_NE(parse(parse_interval_arg, "1s"), 0);
+    EXPECT_NE(parse(parse_interval_arg, ""), 0);
+    EXPECT_NE(parse(parse_interval_arg, "1e40"), 0);
+    EXPECT_NE(parse(parse_interval_arg, "inf"), 0);
+    EXPECT_NE(parse(parse_interval_arg, "nan"), 0);
+}
+
+TEST_F(ArgTest, TtlAcceptsItsRange)
+{
+    EXPECT_EQ(parse(parse_ttl_arg, "1"), 0);
+    EXPECT_EQ(options.ttl, 1);
+    EXPECT_EQ(parse(parse_ttl_arg, "255"), 0);
+    EXPECT_EQ(options.ttl, 255);
+}
+
+TEST_F(ArgTest, TtlRejectsOutOfRange)
+{
+    EXPECT_NE(parse(parse_ttl_arg, "0"), 0);
+    EXPECT_NE(parse(parse_ttl_arg, "256"), 0);
+    EXPECT_NE(parse(parse_ttl_arg, "64x"), 0);
+}
+
+TEST_F(ArgTest, ThreadsAcceptsItsRange)
+{
+    EXPECT_EQ(parse(parse_threads_arg, "4"), 0);
+    EXPECT_EQ(options.threads, 4u);
+    EXPECT_NE(parse(parse_threads_arg, "0"), 0);
+    EXPECT_NE(parse(parse_threads_arg, std::to_string(PING_MAX_THREADS + 1).c_str()), 0);
+}
+
+TEST_F(ArgTest, AffinityParsesACpuList)
+{
+    EXPECT_EQ(parse(parse_affinity_arg, "0,2,5"), 0);
+    ASSERT_EQ(options.num_cpus, 3u);
+    EXPECT_EQ(options.cpus[0], 0);
+    EXPECT_EQ(options.cpus[1], 2);
+    EXPECT_EQ(options.cpus[2], 5);
+}
+
+TEST_F(ArgTest, AffinityRejectsBadLists)
+{
+    EXPECT_NE(parse(parse_affinity_arg, "1;2"), 0);
+    EXPECT_NE(parse(parse_affinity_arg, "-1"), 0);
+    EXPECT_NE(parse(parse_affinity_arg, std::to_string(CPU_SETSIZE).c_str()), 0);
+}
+
+TEST_F(ArgTest, EventLoopMustBeKnown)
+{
+    EXPECT_EQ(parse(parse_evloop_arg, "select"), 0);
+    EXPECT_STREQ(options.evloop, "select");
+    EXPECT_NE(parse(parse_evloop_arg, "kqueue"), 0);
+}
+
+TEST_F(ArgTest, OutputFormats)
+{
+    EXPECT_EQ(parse(parse_output_arg, "json"), 0);
+    EXPECT_EQ(options.output, PING_OUTPUT_JSON);
+    EXPECT_EQ(parse(parse_output_arg, "binary"), 0);
+    EXPECT_EQ(options.output, PING_OUTPUT_BINARY);
+    EXPECT_EQ(parse(parse_output_arg, "text"), 0);
+    EXPECT_EQ(options.output, PING_OUTPUT_TEXT);
+    EXPECT_NE(parse(parse_output_arg, "xml"), 0);
+}
+
+TEST_F(ArgTest, SummaryIntervalUnits)
+{
+    EXPECT_EQ(parse(parse_summary_arg, "10"), 0);
+    EXPECT_EQ(options.summary, 10000000000ULL);
+    EXPECT_EQ(parse(parse_summary_arg, "10s"), 0);
+    EXPECT_EQ(options.summary, 10000000000ULL);
+    EXPECT_EQ(parse(parse_summary_arg, "250ms"), 0);
+    EXPECT_EQ(options.summary, 250000000ULL);
+    EXPECT_EQ(parse(parse_summary_arg, "2m"), 0);
+    EXPECT_EQ(options.summary, 120000000000ULL);
+    EXPECT_NE(parse(parse_summary_arg, "5h"), 0);
+    EXPECT_NE(parse(parse_summary_arg, "0"), 0);
+}
+
+TEST_F(ArgTest, JitterAndRateRanges)
+{
+    EXPECT_EQ(parse(parse_jitter_arg, "0.25"), 0);
+    EXPECT_FLOAT_EQ(options.jitter, 0.25);
+    EXPECT_EQ(parse(parse_jitter_arg, "0"), 0);
+    EXPECT_NE(parse(parse_jitter_arg, "1.5"), 0);
+    EXPECT_NE(parse(parse_jitter_arg, "-0.1"), 0);
+    EXPECT_EQ(parse(parse_rate_arg, "1000"), 0);
+    EXPECT_DOUBLE_EQ(options.rate, 1000.0);
+    EXPECT_NE(parse(parse_rate_arg, "0"), 0);
+    EXPECT_NE(parse(parse_rate_arg, "10pps"), 0);
+}
+
+TEST_F(ArgTest, TimeoutAndDeadlineAreInSeconds)
+{
+    EXPECT_EQ(parse(parse_timeout_arg, "0.25"), 0);
+    EXPECT_EQ(options.timeout, 250000000ULL);
+    EXPECT_EQ(parse(parse_deadline_arg, "10"), 0);
+    EXPECT_EQ(options.deadline, 10000000000ULL);
+    EXPECT_NE(parse(parse_timeout_arg, "0"), 0);
+    EXPECT_NE(parse(parse_deadline_arg, "5s"), 0);
+    EXPECT_NE(parse(parse_deadline_arg, ""), 0);
+}
+
+TEST(FormatAddr, BothFamilies)
+{
+    struct sockaddr_in in4;
+    struct sockaddr_in6 in6;
+    char buf[INET6_ADDRSTRLEN];
+
+    memset(&in4, 0, sizeof(in4));
+    in4.sin_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.7", &in4.sin_addr);
+    EXPECT_STREQ(format_addr(&in4, buf, sizeof(buf)), "192.0.2.7");
+
+    memset(&in6, 0, sizeof(in6));
+    in6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::1", &in6.sin6_addr);
+    EXPECT_STREQ(format_addr(&in6, buf, sizeof(buf)), "2001:db8::1");
+}
+
+TEST(Hist, QuantilesStayWithinTheBucketError)
+{
+    t_ping_hist hist;
+
+    hist_init(&hist);
+    for (uint64_t i = 1; i <= 1000; i++)
+        hist_record(&hist, i * 1000);
+
+    EXPECT_EQ(hist.count, 1000u);
+    EXPECT_EQ(hist.min, 1000u);
+    EXPECT_EQ(hist.max, 1000000u);
+    EXPECT_NEAR(hist_quantile(&hist, 0.5), 500000, 500000 / (1 << PING_HIST_SUB_BITS));
+    EXPECT_NEAR(hist_quantile(&hist, 0.99), 990000, 990000 / (1 << PING_HIST_SUB_BITS));
+    EXPECT_NEAR(hist_quantile(&hist, 1.0), 1000000, 1000000 / (1 << PING_HIST_SUB_BITS));
+    EXPECT_LE(hist_quantile(&hist, 1.0), hist.max);
+}
+
+TEST(Hist, DiffLeavesTheValuesInBetween)
+{
+    t_ping_hist older, hist;
+
+    hist_init(&hist);
+    for (int i = 0; i < 100; i++)
+        hist_record(&hist, 1000);
+    older = hist;
+    for (int i = 0; i < 100; i++)
+        hist_record(&hist, 1000000);
+
+    hist_diff(&hist, &older);
+    EXPECT_EQ(hist.count, 100u);
+    EXPECT_NEAR(hist_quantile(&hist, 0.01), 1000000, 1000000 / (1 << PING_HIST_SUB_BITS));
+}
+
+TEST(Stats, MeanAndStddev)
+{
+    t_ping_stats stats;
+    struct timeval rtt[] = {{0, 1000}, {0, 2000}, {0, 3000}};
+
+    init_stats(&stats);
+    for (auto &tv : rtt)
+        calculate_stats(&stats, &tv);
+
+    EXPECT_EQ(stats.count, 3u);
+    EXPECT_DOUBLE_EQ(stats.min, 1.0);
+    EXPECT_DOUBLE_EQ(stats.max, 3.0);
+    EXPECT_DOUBLE_EQ(stats.mean, 2.0);
+    EXPECT_NEAR(stddev_stats(&stats), 0.8165, 0.0001);
+}
+
+TEST(Stats, MergeEqualsSequential)
+{
+    t_ping_stats all, a, b;
+
+    init_stats(&all);
+    init_stats(&a);
+    init_stats(&b);
+    for (int i = 1; i <= 20; i++)
+    {
+        struct timeval tv = {0, i * 137};
+
+        calculate_stats(&all, &tv);
+        calculate_stats(i % 3 ? &a : &b, &tv);
+    }
+    merge_stats(&a, &b);
+
+    EXPECT_EQ(a.count, all.count);
+    EXPECT_DOUBLE_EQ(a.min, all.min);
+    EXPECT_DOUBLE_EQ(a.max, all.max);
+    EXPECT_NEAR(a.mean, all.mean, 1e-12);
+    EXPECT_NEAR(stddev_stats(&a), stddev_stats(&all), 1e-12);
+}
+
+TEST(Wheel, ExpiresEachTimerOnceItsDateHasPassed)
+{
+    const uint64_t tick = 1ULL << PING_WHEEL_TICK_SHIFT;
+    const uint64_t start = 1000000000000ULL;
+    std::mt19937_64 gen(4);
+    std::vector<t_ping_timer> timers(5000);
+    std::vector<bool> expired(timers.size());
+    t_ping_wheel wheel;
+    uint64_t now = start;
+    size_t count = 0;
+
+    /* Dates from now to beyond the span of the levels, about 19 hours */
+    wheel_init(&wheel, now);
+    for (auto &timer : timers)
+        wheel_add(&wheel, &timer, start + (gen() >> (gen() % 64)) % (100000ULL * 1000000000));
+
+    while (count < timers.size())
+    {
+        uint64_t next = wheel_next(&wheel);
+
+        ASSERT_NE(next, UINT64_MAX);
+        /* Jump to the next date half of the time, else step a random bit further */
+        now = gen() % 2 && next > now ? next : now + (gen() >> (gen() % 64)) % 3600000000000ULL;
+        wheel_advance(&wheel, now);
+        for (t_ping_timer *timer; (timer = wheel_pop(&wheel)); count++)
+        {
+            size_t i = timer - timers.data();
+
+            ASSERT_FALSE(expired[i]);
+            expired[i] = true;
+            ASSERT_LE(timer->expires / tick, now / tick);
+        }
+        for (size_t i = 0; i < timers.size(); i++)
+            ASSERT_TRUE(expired[i] || timers[i].expires / tick > now / tick) << "timer " << i << " missed";
+    }
+    EXPECT_EQ(wheel_next(&wheel), UINT64_MAX);
+}
+
+TEST(Wheel, ExpiresATimerEarlyWithoutMovingOn)
+{
+    const uint64_t ms = 1000000;
+    const uint64_t start = 1000000000000ULL;
+    t_ping_timer timers[3];
+    t_ping_wheel wheel;
+
+    wheel_init(&wheel, start);
+    wheel_add(&wheel, &timers[0], start + ms);
+    wheel_add(&wheel, &timers[1], start + 2 * ms);
+    wheel_add(&wheel, &timers[2], start + 1000 * ms);
+
+    EXPECT_TRUE(wheel_expire(&wheel, &timers[1]));
+    EXPECT_EQ(wheel_pop(&wheel), &timers[1]);
+    EXPECT_FALSE(wheel_expire(&wheel, &timers[1]));
+
+    /* Scheduled again from now, it is not due before its date */
+    wheel_add(&wheel, &timers[1], start + 2 * ms);
+    EXPECT_EQ(wheel_pop(&wheel), nullptr);
+    EXPECT_EQ(wheel_next(&wheel), start + ms);
+    wheel_advance(&wheel, start + ms);
+    EXPECT_EQ(wheel_pop(&wheel), &timers[0]);
+    EXPECT_EQ(wheel_pop(&wheel), nullptr);
+
+    EXPECT_TRUE(wheel_expire(&wheel, &timers[2]));
+    wheel_advance(&wheel, start + 1000 * ms);
+    EXPECT_EQ(wheel_pop(&wheel), &timers[2]);
+    EXPECT_EQ(wheel_pop(&wheel), &timers[1]);
+    EXPECT_EQ(wheel_pop(&wheel), nullptr);
+    EXPECT_EQ(wheel_next(&wheel), UINT64_MAX);
+}
+
+TEST(TargetRenew, TakesTheNewAddressOnce)
+{
+    PING *ping = (PING *)calloc(1, sizeof(PING));
+    t_ping_target *target = (t_ping_target *)calloc(1, sizeof(t_ping_target));
+    struct sockaddr_in *dest = (struct sockaddr_in *)&target->dest;
+    struct sockaddr_in *renewed = (struct sockaddr_in *)&target->renewed;
+
+    ping->shared = true;
+    dest->sin_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.7", &dest->sin_addr);
+    target->destlen = sizeof(*dest);
+    format_addr(&target->dest, target->addr, sizeof(target->addr));
+
+    /* Nothing to take yet */
+    target_renew(ping, target);
+    EXPECT_STREQ(target->addr, "192.0.2.7");
+
+    renewed->sin_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.8", &renewed->sin_addr);
+    target->renewedlen = sizeof(*renewed);
+    target->renew = true;
+    target_renew(ping, target);
+    EXPECT_STREQ(target->addr, "192.0.2.8");
+    EXPECT_EQ(dest->sin_addr.s_addr, renewed->sin_addr.s_addr);
+    EXPECT_FALSE(target->renew);
+    EXPECT_EQ(target->lock, 0);
+
+    free(target);
+    free(ping);
+}